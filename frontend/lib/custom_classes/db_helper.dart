@@ -1,6 +1,7 @@
+import 'dart:async';
 import 'dart:ffi';
 import 'dart:io';
-import 'package:ffi/src/utf8.dart';
+import 'package:ffi/ffi.dart';
 
 import 'package:flutter/material.dart';
 import 'package:path/path.dart';
@@ -12,6 +13,53 @@ import 'package:flutter/foundation.dart';
 typedef UpdateNativeFunction = Int32 Function(Pointer<Utf8>);
 typedef UpdateNative = int Function(Pointer<Utf8>);
 
+// Mirrors SongRow in scanner/song_rows.hpp. Text fields are offsets into the
+// string arena of SongRows, -1 standing for NULL.
+final class SongRow extends Struct {
+  @Int32()
+  external int id;
+  @Int32()
+  external int album_id;
+  @Int32()
+  external int track_number;
+  @Int32()
+  external int disc_number;
+  @Int32()
+  external int title_offset;
+  @Int32()
+  external int title_length;
+  @Int32()
+  external int album_offset;
+  @Int32()
+  external int album_length;
+  @Int32()
+  external int album_artists_offset;
+  @Int32()
+  external int album_artists_length;
+  @Int32()
+  external int contributing_artists_offset;
+  @Int32()
+  external int contributing_artists_length;
+  @Int32()
+  external int location_offset;
+  @Int32()
+  external int location_length;
+  @Int32()
+  external int album_art_location_offset;
+  @Int32()
+  external int album_art_location_length;
+}
+
+// Mirrors SongRows in scanner/song_rows.hpp.
+final class SongRows extends Struct {
+  @Int32()
+  external int count;
+  @Int32()
+  external int strings_size;
+  external Pointer<SongRow> rows;
+  external Pointer<Uint8> strings;
+}
+
 class DbHelper {
   static final DbHelper instance = DbHelper._privateConstructor();
 
@@ -19,8 +67,21 @@ class DbHelper {
 
   late final updatorFunction;
 
+  late final Pointer<SongRows> Function(Pointer<Utf8>, Pointer<Int32>, int) getSongRows;
+
+  late final void Function(Pointer<SongRows>) freeSongRows;
+
+  late final Pointer<Uint8> Function(Pointer<Utf8>, Pointer<Utf8>, Pointer<Uint64>) artPackGet;
+  late final Pointer<NativeFinalizerFunction> artPackRelease;
+
+  late final String databasePath;
+
   Database? database;
 
+  // Songs asked for with getSong in the same frame, such as by the tiles of a
+  // list, which are then read together with getSongsByIds.
+  final Map<int, Completer<Map<String, dynamic>>> pendingSongs = {};
+
   DbHelper._privateConstructor() {
     databaseFactory = databaseFactoryFfi;
   }
@@ -37,20 +98,21 @@ class DbHelper {
       updator_lib = DynamicLibrary.open('$path/assets/libfor_ffi.dll');
     }
     updatorFunction = updator_lib.lookupFunction<Int32 Function(Pointer<Utf8>), int Function(Pointer<Utf8>)>("update");
+    final upgradeDatabase = updator_lib.lookupFunction<Int32 Function(Pointer<Utf8>), int Function(Pointer<Utf8>)>("upgradeDatabase");
     var directory = await getApplicationDocumentsDirectory();
     String path = join(directory.path, "Project DBS", "database.db");
 
-    database = await openDatabase(
-      path,
-      version: 1,
-      onCreate: (db, version) {
-        db.execute(CREATE_ALL_TABLES);
-        // db.execute(CREATE_SONGS);
-        // db.execute(CREATE_ARTISTS);
-        // db.execute(CREATE_CONTRIBUTING_ARTISTS);
-        // db.execute(CREATE_ALBUM_ARTISTS);
-      },
-    );
+    // The scanner owns the schema and its version (PRAGMA user_version), so
+    // the database is created and migrated there, and opened here without a
+    // version so that sqflite leaves user_version alone.
+    await Directory(dirname(path)).create(recursive: true);
+    upgradeDatabase(path.toNativeUtf8());
+    getSongRows = updator_lib.lookupFunction<Pointer<SongRows> Function(Pointer<Utf8>, Pointer<Int32>, Int32), Pointer<SongRows> Function(Pointer<Utf8>, Pointer<Int32>, int)>("getSongRows");
+    freeSongRows = updator_lib.lookupFunction<Void Function(Pointer<SongRows>), void Function(Pointer<SongRows>)>("freeSongRows");
+    artPackGet = updator_lib.lookupFunction<Pointer<Uint8> Function(Pointer<Utf8>, Pointer<Utf8>, Pointer<Uint64>), Pointer<Uint8> Function(Pointer<Utf8>, Pointer<Utf8>, Pointer<Uint64>)>("artPackGet");
+    artPackRelease = updator_lib.lookup<NativeFinalizerFunction>("artPackRelease");
+    databasePath = path;
+    database = await openDatabase(path);
     await database!.rawQuery("PRAGMA foreign_keys = 1;");
     return 0;
   }
@@ -59,6 +121,47 @@ class DbHelper {
     return await database!.rawQuery(GET_SONG_DATA);
   }
 
+  // Reads the details of many songs with one native query, in the order of
+  // ids, with their album art like getSong. Ids with no song get getSong's
+  // "DELETED" placeholder.
+  Future<List<Map<String, dynamic>>> getSongsByIds(List<int> ids) async {
+    final Pointer<Int32> nativeIds = calloc<Int32>(ids.length);
+    final Pointer<Utf8> nativePath = databasePath.toNativeUtf8();
+    for (int i = 0; i < ids.length; i++) {
+      nativeIds[i] = ids[i];
+    }
+    final Pointer<SongRows> result = getSongRows(nativePath, nativeIds, ids.length);
+    calloc.free(nativeIds);
+    calloc.free(nativePath);
+    if (result == nullptr) {
+      // The native query failed; fall back to one query per song.
+      return await Future.wait(ids.map(querySong));
+    }
+
+    final SongRows songRows = result.ref;
+    String? text(int offset, int length) => offset < 0 ? null : (songRows.strings + offset).cast<Utf8>().toDartString(length: length);
+    List<Map<String, dynamic>?> rows = [];
+    for (int i = 0; i < songRows.count; i++) {
+      final SongRow row = songRows.rows[i];
+      rows.add(row.id == -1
+          ? null
+          : {
+              "id": row.id,
+              "title": text(row.title_offset, row.title_length),
+              "track_number": row.track_number,
+              "disc_number": row.disc_number,
+              "album": text(row.album_offset, row.album_length),
+              "album_artist": text(row.album_artists_offset, row.album_artists_length),
+              "contributing_artists": text(row.contributing_artists_offset, row.contributing_artists_length),
+              "location": text(row.location_offset, row.location_length),
+              "album_art_location": text(row.album_art_location_offset, row.album_art_location_length),
+              "album_id": row.album_id,
+            });
+    }
+    freeSongRows(result);
+    return await Future.wait(rows.map((row) => row == null ? Future.value(deletedSong()) : withAlbumArt(row)));
+  }
+
   Future<List<int>> getSongIds() async {
     var result = await database!.rawQuery(GET_SONG_IDS);
     List<int> ids = [];
@@ -68,42 +171,110 @@ class DbHelper {
     return ids;
   }
 
-  Future<Map<String, dynamic>> getSong(int id) async {
+  // Reads one song. Calls made in the same frame are answered together by
+  // one getSongsByIds query, so a list of song tiles costs one query.
+  Future<Map<String, dynamic>> getSong(int id) {
+    Completer<Map<String, dynamic>>? completer = pendingSongs[id];
+    if (completer == null) {
+      if (pendingSongs.isEmpty) {
+        scheduleMicrotask(loadPendingSongs);
+      }
+      completer = Completer<Map<String, dynamic>>();
+      pendingSongs[id] = completer;
+    }
+    return completer.future;
+  }
+
+  Future<void> loadPendingSongs() async {
+    final Map<int, Completer<Map<String, dynamic>>> pending = Map.of(pendingSongs);
+    pendingSongs.clear();
+    try {
+      final List<Map<String, dynamic>> songs = await getSongsByIds(pending.keys.toList());
+      int i = 0;
+      for (var completer in pending.values) {
+        completer.complete(songs[i++]);
+      }
+    } catch (e, stackTrace) {
+      for (var completer in pending.values) {
+        if (!completer.isCompleted) {
+          completer.completeError(e, stackTrace);
+        }
+      }
+    }
+  }
+
+  Future<Map<String, dynamic>> querySong(int id) async {
     var result = await database!.rawQuery(GET_SONG_DATA_BY_ID, [id]);
     if (result.isEmpty) {
-      return {
-        "id": -1,
-        "title": "DELETED",
-        "track_number": -1,
-        "disc_number": -1,
-        "album": "DELETED",
-        "album_artist": "DELETED",
-        "contributing_artists": "DELETED",
-        "location": "DELETED",
-        "album_art_location": null,
-        "album_art": const AssetImage(
-          "assets/images/album_placeholder.jpg",
-        ),
-        "album_id": -1
-      };
+      return deletedSong();
+    }
+    return await withAlbumArt(Map<String, dynamic>.from(result[0]));
+  }
+
+  Map<String, dynamic> deletedSong() {
+    return {
+      "id": -1,
+      "title": "DELETED",
+      "track_number": -1,
+      "disc_number": -1,
+      "album": "DELETED",
+      "album_artist": "DELETED",
+      "contributing_artists": "DELETED",
+      "location": "DELETED",
+      "album_art_location": null,
+      "album_art": const AssetImage(
+        "assets/images/album_placeholder.jpg",
+      ),
+      "album_id": -1
+    };
+  }
+
+  Future<Map<String, dynamic>> withAlbumArt(Map<String, dynamic> answer) async {
+    if (answer["album_art_location"] == null) {
+      answer["album_art"] = const AssetImage(
+        "assets/images/album_placeholder.jpg",
+      );
     } else {
-      Map<String, dynamic> answer = Map<String, dynamic>.from(result[0]);
-      if (answer["album_art_location"] == null) {
+      try {
+        answer["album_art"] = await getAlbumArtImage(answer["album_art_location"], minSize: 256);
+      } catch (e) {
         answer["album_art"] = const AssetImage(
           "assets/images/album_placeholder.jpg",
         );
-      } else {
-        try {
-          String albumArtAbsoluteLocation = join((await getApplicationDocumentsDirectory()).path, "Project DBS", "album_art", answer["album_art_location"]);
-          answer["album_art"] = FileImage(File(albumArtAbsoluteLocation));
-        } catch (e) {
-          answer["album_art"] = const AssetImage(
-            "assets/images/album_placeholder.jpg",
-          );
-        }
       }
-      return answer;
     }
+    return answer;
+  }
+
+  // The smallest thumbnail of a piece of album art that is at least minSize
+  // pixels wide or high, or the art itself if there is none or no minSize is
+  // given. Packed art (locations starting with "pack:") is read straight out
+  // of the scanner's memory mapping of the pack, without a copy, and given
+  // back with artPackRelease once the image's bytes are garbage collected.
+  Future<ImageProvider> getAlbumArtImage(String albumArtLocation, {int? minSize}) async {
+    String location = albumArtLocation;
+    if (minSize != null) {
+      var result = await database!.rawQuery(GET_ALBUM_ART_VARIANT, [albumArtLocation, minSize]);
+      if (result.isNotEmpty) {
+        location = result[0]["location"] as String;
+      }
+    }
+    final String albumArtDirectory = join((await getApplicationDocumentsDirectory()).path, "Project DBS", "album_art");
+    if (!location.startsWith("pack:")) {
+      return FileImage(File(join(albumArtDirectory, location)));
+    }
+    final Pointer<Utf8> nativeDirectory = albumArtDirectory.toNativeUtf8();
+    final Pointer<Utf8> nativeLocation = location.toNativeUtf8();
+    final Pointer<Uint64> length = calloc<Uint64>();
+    final Pointer<Uint8> data = artPackGet(nativeDirectory, nativeLocation, length);
+    final int size = length.value;
+    calloc.free(nativeDirectory);
+    calloc.free(nativeLocation);
+    calloc.free(length);
+    if (data == nullptr) {
+      throw Exception("Album art $location is missing from the pack");
+    }
+    return MemoryImage(data.asTypedList(size, finalizer: artPackRelease, token: data.cast()));
   }
 
   Future<List<int>> getAlbumIds() async {
@@ -137,9 +308,8 @@ class DbHelper {
         );
       } else {
         try {
-          String albumArtAbsoluteLocation = join((await getApplicationDocumentsDirectory()).path, "Project DBS", "album_art", answer["album_art_location"]);
-          answer["album_art"] = Image.file(
-            File(albumArtAbsoluteLocation),
+          answer["album_art"] = Image(
+            image: await getAlbumArtImage(answer["album_art_location"], minSize: 256),
             fit: BoxFit.contain,
           );
         } catch (e) {
@@ -213,8 +383,7 @@ class DbHelper {
         );
       } else {
         try {
-          String albumArtAbsoluteLocation = join((await getApplicationDocumentsDirectory()).path, "Project DBS", "album_art", firstMap["album_art_location"]);
-          firstMap["album_art"] = FileImage(File(albumArtAbsoluteLocation));
+          firstMap["album_art"] = await getAlbumArtImage(firstMap["album_art_location"]);
         } catch (e) {
           firstMap["album_art"] = const AssetImage(
             "assets/images/album_placeholder.jpg",
@@ -287,26 +456,25 @@ class DbHelper {
       answer.add(Map<String, dynamic>.from(item));
       answer.last["album_art"] = (item["album_art_location"] == null)
           ? const AssetImage("assets/images/album_placeholder.jpg")
-          : FileImage(
-              File(
-                join(
-                  (await getApplicationDocumentsDirectory()).path,
-                  "Project DBS",
-                  "album_art",
-                  item["album_art_location"] as String,
-                ),
-              ),
-            );
+          : await getAlbumArtImage(item["album_art_location"] as String);
     }
     return answer;
   }
 
   Future<List<int>> getSongsLike(String name) async {
+    // Every word of the search term has to match the start of a word in the
+    // title, album, artists or genres of a song. Words are quoted so that
+    // FTS5 operators typed by the user are searched for literally.
+    var terms = name.split(RegExp(r"\s+")).where((term) => term.isNotEmpty).map((term) => '"${term.replaceAll('"', '""')}"*');
+    if (terms.isEmpty) {
+      return getSongIds();
+    }
     var result = await database!.rawQuery("""
-      SELECT id
-      FROM Songs
-      WHERE title LIKE ?
-    """, ["%$name%"]);
+      SELECT rowid AS id
+      FROM SongSearch
+      WHERE SongSearch MATCH ?
+      ORDER BY bm25(SongSearch, 10.0, 4.0, 4.0, 1.0)
+    """, [terms.join(" ")]);
     List<int> answer = [];
     for (var item in result) {
       answer.add(item["id"] as int);
@@ -342,16 +510,7 @@ class DbHelper {
       answer.add(Map<String, dynamic>.from(item));
       answer.last["album_art"] = (item["album_art_location"] == null)
           ? const AssetImage("assets/images/album_placeholder.jpg")
-          : FileImage(
-              File(
-                join(
-                  (await getApplicationDocumentsDirectory()).path,
-                  "Project DBS",
-                  "album_art",
-                  item["album_art_location"] as String,
-                ),
-              ),
-            );
+          : await getAlbumArtImage(item["album_art_location"] as String);
     }
     return answer;
   }
@@ -29,77 +29,8 @@ const TextStyle HugeAlbumTitle = TextStyle(
 );
 
 // SQL Queries below:
-
-const String CREATE_ALL_TABLES = """
-CREATE TABLE Albums (
-	id INTEGER PRIMARY KEY AUTOINCREMENT,
-	title VARCHAR(512),
-	album_art_location VARCHAR(2048)
-);
-
-CREATE TABLE Songs (
-	id INTEGER PRIMARY KEY AUTOINCREMENT,
-	title VARCHAR(512),
-	track_number INTEGER,
-	disc_number INTEGER,
-	rating SMALLINT DEFAULT 0,
-	album_id INTEGER,
-	location VARCHAR(2048),
-  play_count INTEGER DEFAULT 0,
-	FOREIGN KEY (album_id) REFERENCES Albums(id) ON DELETE CASCADE
-);
-
-CREATE TABLE Artists (
-	id INTEGER PRIMARY KEY AUTOINCREMENT,
-	name VARCHAR(512),
-	description VARCHAR(1024),
-	photo_location VARCHAR(2048)
-);
-
-CREATE TABLE Genres (
-	id INTEGER PRIMARY KEY AUTOINCREMENT,
-	name VARCHAR(128)
-);
-
-CREATE TABLE ContributingArtists (
-	song_id INTEGER,
-	artist_id INTEGER,
-	PRIMARY KEY (song_id, artist_id),
-	FOREIGN KEY (song_id) REFERENCES Songs(id) ON DELETE CASCADE,
-	FOREIGN KEY (artist_id) REFERENCES Artists(id) ON DELETE CASCADE
-);
-
-CREATE TABLE AlbumArtists (
-	album_id INTEGER,
-	artist_id INTEGER,
-	PRIMARY KEY (album_id, artist_id),
-	FOREIGN KEY (album_id) REFERENCES Albums(id) ON DELETE CASCADE,
-	FOREIGN KEY (artist_id) REFERENCES Artists(id) ON DELETE CASCADE
-);
-
-CREATE TABLE SongGenreMap (
-	song_id INTEGER,
-	genre_id INTEGER,
-	PRIMARY KEY (song_id, genre_id),
-	FOREIGN KEY (song_id) REFERENCES Songs(id) ON DELETE CASCADE,
-	FOREIGN KEY (genre_id) REFERENCES Genres(id) ON DELETE CASCADE
-);
-
-CREATE TABLE Playlists (
-	id INTEGER PRIMARY KEY AUTOINCREMENT,
-	title VARCHAR(512)
-);
-
-CREATE TABLE PlaylistSongs (
-	id INTEGER PRIMARY KEY AUTOINCREMENT,
-	playlist_id INTEGER,
-	song_id INTEGER,
-	FOREIGN KEY (playlist_id) REFERENCES Playlists(id) ON DELETE CASCADE,
-	FOREIGN KEY (song_id) REFERENCES Songs(id) ON DELETE CASCADE
-);
-
-
-""";
+// Song details are read from SongView, which the scanner keeps in step with
+// the normalized tables.
 
 const String CREATE_ALBUMS = "CREATE TABLE Albums ( id INTEGER PRIMARY KEY, title VARCHAR(512), release_year INT );";
 const String CREATE_SONGS =
@@ -111,24 +42,16 @@ const String CREATE_ALBUM_ARTISTS =
     "CREATE TABLE AlbumArtists ( album_id INT NOT NULL, artist_id INT NOT NULL, PRIMARY KEY (album_id, artist_id), FOREIGN KEY (album_id) REFERENCES Albums(id), FOREIGN KEY (artist_id) REFERENCES Artists(id) );";
 
 const String GET_SONG_DATA = """
-SELECT S.id, S.title, S.track_number, S.disc_number, A.title AS album, REPLACE(GROUP_CONCAT(DISTINCT AAA.name), ",", ", ") AS album_artist, REPLACE(GROUP_CONCAT(DISTINCT CAA.name), ",", ", ") AS contributing_artists, S.location, A.album_art_location
-FROM Songs S, Albums A, Artists AAA, Artists CAA, AlbumArtists AA, ContributingArtists CA
-WHERE S.album_id = A.id AND AA.album_id = A.id AND CA.song_id = S.id AND AA.artist_id = AAA.id AND CA.artist_id = CAA.id
-GROUP BY S.id;
+SELECT id, title, track_number, disc_number, album, album_artist, contributing_artists, location, album_art_location
+FROM SongView;
 """;
 
-const String GET_SONG_IDS = "SELECT id FROM Songs ORDER BY title ASC;";
+const String GET_SONG_IDS = "SELECT id FROM SongView ORDER BY title ASC;";
 
 const String GET_SONG_DATA_BY_ID = """
-SELECT S.id, S.title, S.track_number, S.disc_number, A.title AS album, REPLACE(GROUP_CONCAT(DISTINCT AAA.name), ",", ", ") AS album_artist, REPLACE(GROUP_CONCAT(DISTINCT CAA.name), ",", ", ") AS contributing_artists, S.location, A.album_art_location, A.id AS album_id
-FROM Songs S 
-LEFT JOIN Albums A ON S.album_id = A.id
-LEFT JOIN AlbumArtists AA ON A.id = AA.album_id
-LEFT JOIN ContributingArtists CA ON S.id = CA.song_id
-LEFT JOIN Artists CAA ON CA.artist_id = CAA.id
-LEFT JOIN Artists AAA ON AA.artist_id = AAA.id
-WHERE S.id = ?
-GROUP BY S.id;
+SELECT id, title, track_number, disc_number, album, album_artist, contributing_artists, location, album_art_location, album_id
+FROM SongView
+WHERE id = ?;
 """;
 
 const String GET_ALBUMS_BY_ID = """
@@ -138,15 +61,21 @@ WHERE A.id = AA.album_id AND AA.artist_id = AAA.id AND A.id = ?
 GROUP BY A.id;
 """;
 
+const String GET_ALBUM_ART_VARIANT = """
+SELECT location FROM AlbumArtVariants
+WHERE art_location = ? AND size >= ?
+ORDER BY size ASC
+LIMIT 1;
+""";
+
 const String GET_ARTISTS_BY_ID = """
 SELECT A.id, A.name, A.description
 FROM Artists A WHERE id = ?;
 """;
 
 const String GET_ALBUM_SONG_DATA = """
-SELECT S.id, S.title, S.track_number, S.disc_number, A.title AS album, REPLACE(GROUP_CONCAT(DISTINCT AAA.name), ",", ", ") AS album_artist, REPLACE(GROUP_CONCAT(DISTINCT CAA.name), ",", ", ") AS contributing_artists, S.location, A.album_art_location
-FROM Songs S, Albums A, Artists AAA, Artists CAA, AlbumArtists AA, ContributingArtists CA
-WHERE S.album_id = A.id AND AA.album_id = A.id AND CA.song_id = S.id AND AA.artist_id = AAA.id AND CA.artist_id = CAA.id AND A.id = ?
-GROUP BY S.id
+SELECT id, title, track_number, disc_number, album, album_artist, contributing_artists, location, album_art_location
+FROM SongView
+WHERE album_id = ?
 ORDER BY disc_number ASC, track_number ASC;
 """;
\ No newline at end of file
@@ -0,0 +1,111 @@
+#include <sqlite3.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "entity_cache.hpp"
+#include "misc.hpp"
+#include "string_pool.hpp"
+#include "tag_functions.hpp"
+
+// Every allocation made through operator new, by this program or the scanner.
+static long allocations = 0;
+
+void *operator new(size_t size) {
+    allocations++;
+    void *p = malloc(size ? size : 1);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+/**
+ * @brief Runs a step a number of times after one warm up run, and prints the
+ *        heap allocations it made per run.
+ */
+template <typename Step>
+static void measure(const char *name, int runs, Step step) {
+    step();
+    long before = allocations;
+    for (int i = 0; i < runs; i++)
+        step();
+    printf("%-28s %8.1f allocations per run\n", name, (allocations - before) / (double)runs);
+}
+
+/**
+ * @brief Counts the heap allocations the scanner makes for the names of one
+ *        file: splitting and interning them, looking them up in the entity
+ *        cache, and, given music files, reading them with the fast parser.
+ *
+ * @details Run it before and after a change to the scanner's hot path to see
+ *          whether the change allocates less, e.g.
+ *          alloc_bench song1.mp3 song2.flac.
+ */
+int main(int argc, char **argv) {
+    const char *inputs[] = {"Artist One; Artist Two & Guest", "Rock", "Some Long Album Artist Name, Another Long Artist Name"};
+    const char *album = "Some Album Title That Is Long";
+
+    measure("splitString", 1000, [&] {
+        for (const char *input : inputs)
+            splitString(input);
+    });
+
+    StringPool pool;
+    std::vector<NameList> lists;
+    measure("splitNames + intern", 1000, [&] {
+        lists.clear();
+        for (const char *input : inputs) {
+            std::string_view names[16];
+            lists.push_back(pool.internList(names, splitNames(input, names, 16)));
+        }
+        pool.intern(album);
+    });
+
+    sqlite3 *db;
+    sqlite3_open(":memory:", &db);
+    sqlite3_exec(db, "CREATE TABLE Albums(id INTEGER PRIMARY KEY, title TEXT, album_key TEXT);"
+                     "CREATE TABLE Artists(id INTEGER PRIMARY KEY, name TEXT);"
+                     "CREATE TABLE Genres(id INTEGER PRIMARY KEY, name TEXT);",
+                 NULL, NULL, NULL);
+    EntityCache entities;
+    entities.load(db);
+    int id = 1;
+    for (const NameList &list : lists)
+        for (std::string_view name : list)
+            entities.insert(Artist, name, id++);
+    std::string_view interned_album = pool.intern(album);
+    entities.insert(Album, interned_album, id++);
+    entities.commit();
+    measure("entity cache lookups", 1000, [&] {
+        for (const NameList &list : lists)
+            for (std::string_view name : list)
+                entities.find(Artist, name);
+        entities.find(Album, interned_album);
+    });
+    sqlite3_close(db);
+
+    if (argc > 1) {
+        TagReadOptions options;
+        options.fast_parser = true;
+        std::vector<std::string> files(argv + 1, argv + argc);
+        measure("extractFile, all files", 100, [&] {
+            for (const std::string &file : files) {
+                Metadata metadata;
+                std::string picture;
+                extractFile(file, metadata, pool, &picture, nullptr, options);
+            }
+        });
+    }
+    return 0;
+}
@@ -0,0 +1,615 @@
+#include "art_pack.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "art_store.hpp"
+#include "misc.hpp"
+
+#define PACK_RECORD_MAGIC 0x4B504153u  // "SAPK"
+#define PACK_INDEX_MAGIC 0x58494153u   // "SAIX"
+#define PACK_INDEX_VERSION 1
+#define PACK_COMPACT_MIN_WASTE (1u << 20)  // never rewrite a pack to save less than this
+
+/**
+ * @brief The header in front of every record of a pack, followed by the name
+ *        and then the data. Integers are little endian.
+ */
+struct PackRecordHeader {
+    uint32_t magic;
+    uint32_t name_length;
+    uint64_t data_length;
+    uint64_t checksum;  // xxh64 of the data, to catch records torn by a crash
+};
+
+struct PackIndexHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t generation;
+    uint64_t pack_size;
+    uint64_t count;
+};
+
+MappedFile::~MappedFile() {
+#ifdef _WIN32
+    if (address != NULL)
+        UnmapViewOfFile(address);
+    if (mapping != NULL)
+        CloseHandle(mapping);
+    if (file != NULL && file != INVALID_HANDLE_VALUE)
+        CloseHandle(file);
+#else
+    if (address != NULL)
+        munmap((void *)address, length);
+#endif
+}
+
+/**
+ * @brief Maps a whole file for reading. An empty file maps to no data.
+ *
+ * @param[in] path The file.
+ * @param[in] reserve The number of bytes to map if the file is smaller, so
+ *                    that data appended to it later can be read through the
+ *                    mapping. Ignored on Windows, where a read-only mapping
+ *                    cannot be larger than its file.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int MappedFile::map(const std::string &path, uint64_t reserve) {
+#ifdef _WIN32
+    file = CreateFileW(std::filesystem::u8path(path).wstring().c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return -1;
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size))
+        return -1;
+    length = file_size.QuadPart;
+    if (length == 0)
+        return 0;
+    mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL)
+        return -1;
+    address = (const unsigned char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    return address != NULL ? 0 : -1;
+#else
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    length = std::max<uint64_t>(st.st_size, st.st_size > 0 ? reserve : 0);
+    if (length > 0) {
+        void *mapped = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+        address = mapped != MAP_FAILED ? (const unsigned char *)mapped : NULL;
+    }
+    close(fd);
+    return length == 0 || address != NULL ? 0 : -1;
+#endif
+}
+
+ArtPack::ArtPack(const std::string &directory) : directory(directory) {}
+
+std::string ArtPack::packPath(uint64_t pack_generation) const {
+    return (std::filesystem::u8path(directory) / ("art-" + std::to_string(pack_generation) + ".pack")).u8string();
+}
+
+std::string ArtPack::indexPath() const {
+    return (std::filesystem::u8path(directory) / "art.idx").u8string();
+}
+
+/**
+ * @brief Loads the index and recovers the records appended after it was
+ *        saved. Packs of other generations, left by an interrupted
+ *        compaction, are removed.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int ArtPack::open() {
+    std::error_code error;
+    std::filesystem::create_directories(std::filesystem::u8path(directory), error);
+    if (loadIndex() != 0) {
+        // Without an index, start from the newest pack on disk.
+        generation = 1;
+        pack_size = 0;
+        entries.clear();
+        for (const auto &item : std::filesystem::directory_iterator(std::filesystem::u8path(directory), error)) {
+            std::string name = item.path().filename().u8string();
+            if (name.compare(0, 4, "art-") == 0 && endsWith(name, ".pack"))
+                generation = std::max<uint64_t>(generation, std::strtoull(name.c_str() + 4, NULL, 10));
+        }
+    }
+    if (recoverRecords() != 0)
+        return -1;
+
+    for (const auto &item : std::filesystem::directory_iterator(std::filesystem::u8path(directory), error)) {
+        std::string name = item.path().filename().u8string();
+        if (name.compare(0, 4, "art-") == 0 && item.path().u8string() != packPath(generation)) {
+            std::error_code remove_error;
+            std::filesystem::remove(item.path(), remove_error);  // fails on Windows while still mapped
+        }
+    }
+    live_bytes = 0;
+    for (auto &entry : entries)
+        live_bytes += sizeof(PackRecordHeader) + entry.first.size() + entry.second.length;
+    opened = true;
+    return 0;
+}
+
+int ArtPack::loadIndex() {
+    std::ifstream index(std::filesystem::u8path(indexPath()), std::ios_base::in | std::ios_base::binary);
+    PackIndexHeader header;
+    if (!index.read((char *)&header, sizeof(header)) || header.magic != PACK_INDEX_MAGIC || header.version != PACK_INDEX_VERSION)
+        return -1;
+
+    std::unordered_map<std::string, Entry> loaded;
+    for (uint64_t i = 0; i < header.count; i++) {
+        Entry entry;
+        uint32_t name_length;
+        if (!index.read((char *)&entry.offset, sizeof(entry.offset)) || !index.read((char *)&entry.length, sizeof(entry.length)) ||
+            !index.read((char *)&name_length, sizeof(name_length)) || name_length > 4096)
+            return -1;
+        std::string name(name_length, '\0');
+        if (!index.read(&name[0], name_length))
+            return -1;
+        loaded[name] = entry;
+    }
+    generation = header.generation;
+    pack_size = header.pack_size;
+    entries.swap(loaded);
+    return 0;
+}
+
+/**
+ * @brief Reads the records of the pack past pack_size into the index,
+ *        stopping at the end of the file or at the first incomplete or
+ *        damaged record, which is cut off.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int ArtPack::recoverRecords() {
+    std::filesystem::path path = std::filesystem::u8path(packPath(generation));
+    std::error_code error;
+    uint64_t file_size = std::filesystem::exists(path, error) ? std::filesystem::file_size(path, error) : 0;
+    if (error)
+        return -1;
+    if (file_size < pack_size)
+        pack_size = 0;  // the index belongs to a pack that is gone; rebuild it
+    if (file_size == pack_size)
+        return 0;
+
+    std::ifstream pack(path, std::ios_base::in | std::ios_base::binary);
+    pack.seekg(pack_size);
+    uint64_t recovered = 0;
+    while (pack_size + sizeof(PackRecordHeader) <= file_size) {
+        PackRecordHeader header;
+        if (!pack.read((char *)&header, sizeof(header)) || header.magic != PACK_RECORD_MAGIC || header.name_length > 4096 ||
+            pack_size + sizeof(header) + header.name_length + header.data_length > file_size)
+            break;
+        std::string name(header.name_length, '\0');
+        std::string data(header.data_length, '\0');
+        if (!pack.read(&name[0], name.size()) || !pack.read(&data[0], data.size()) || xxh64(data.data(), data.size()) != header.checksum)
+            break;
+        entries[name] = {pack_size + sizeof(header) + name.size(), header.data_length};
+        pack_size += sizeof(header) + name.size() + data.size();
+        recovered++;
+    }
+    pack.close();
+    if (pack_size < file_size) {
+        logWarning("Cutting %llu damaged bytes off the end of %s\n", (unsigned long long)(file_size - pack_size), path.u8string().c_str());
+        std::filesystem::resize_file(path, pack_size, error);
+    }
+    if (recovered > 0)
+        logWarning("Recovered %llu records of %s\n", (unsigned long long)recovered, path.u8string().c_str());
+    return 0;
+}
+
+/**
+ * @brief Writes the index next to the pack, replacing the previous one in a
+ *        single rename.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int ArtPack::saveIndex() {
+    std::filesystem::path path = std::filesystem::u8path(indexPath());
+    std::filesystem::path temporary = std::filesystem::u8path(indexPath() + ".tmp");
+    {
+        std::ofstream index(temporary, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+        PackIndexHeader header = {PACK_INDEX_MAGIC, PACK_INDEX_VERSION, generation, pack_size, entries.size()};
+        index.write((const char *)&header, sizeof(header));
+        for (auto &entry : entries) {
+            uint32_t name_length = entry.first.size();
+            index.write((const char *)&entry.second.offset, sizeof(entry.second.offset));
+            index.write((const char *)&entry.second.length, sizeof(entry.second.length));
+            index.write((const char *)&name_length, sizeof(name_length));
+            index.write(entry.first.data(), name_length);
+        }
+        if (!index.good()) {
+            logError("Unable to write art pack index %s\n", temporary.u8string().c_str());
+            return -1;
+        }
+    }
+    std::error_code error;
+    std::filesystem::rename(temporary, path, error);
+    if (error) {
+        logError("Unable to replace art pack index %s: %s\n", path.u8string().c_str(), error.message().c_str());
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads a record with positioned reads, opening the pack again if the
+ *        record was appended after it was opened.
+ */
+bool ArtPack::readEntry(const Entry &entry, std::string &data) {
+    if (!reader || reader_generation != generation || reader->size() < (int64_t)(entry.offset + entry.length)) {
+        if (writer.is_open())
+            writer.flush();
+        reader.reset(new PositionedFile(packPath(generation)));
+        reader_generation = generation;
+        if (!reader->isOpen()) {
+            logError("Unable to open art pack %s\n", packPath(generation).c_str());
+            reader.reset();
+            return false;
+        }
+    }
+    return reader->read(entry.offset, data, entry.length);
+}
+
+/**
+ * @brief Finds a record in a mapping of the pack, mapping the pack again if
+ *        the record lies past the end of the newest mapping, and counts the
+ *        pointer handed out. A new mapping reserves twice the size of the
+ *        pack.
+ */
+bool ArtPack::locate(const std::string &name, const unsigned char *&data, uint64_t &length) {
+    auto it = entries.find(name);
+    if (it == entries.end())
+        return false;
+    const Entry &entry = it->second;
+    if (mappings.empty() || mappings.back().file->size() < entry.offset + entry.length || mappings.back().generation != generation) {
+        if (writer.is_open())
+            writer.flush();
+        std::unique_ptr<MappedFile> mapping(new MappedFile());
+        if (mapping->map(packPath(generation), 2 * pack_size) != 0 || mapping->size() < entry.offset + entry.length) {
+            logError("Unable to map art pack %s\n", packPath(generation).c_str());
+            return false;
+        }
+        mappings.push_back({std::move(mapping), generation, 0});
+        dropMappings();
+    }
+    data = mappings.back().file->data() + entry.offset;
+    length = entry.length;
+    mappings.back().users++;
+    return true;
+}
+
+/**
+ * @brief Unmaps every mapping nothing points into, except the newest one of
+ *        the current generation, and removes the packs of older generations
+ *        no longer mapped.
+ */
+void ArtPack::dropMappings() {
+    std::vector<uint64_t> dropped;
+    for (size_t i = 0; i < mappings.size();) {
+        bool current = i + 1 == mappings.size() && mappings[i].generation == generation;
+        if (mappings[i].users == 0 && !current) {
+            dropped.push_back(mappings[i].generation);
+            mappings.erase(mappings.begin() + i);
+        } else {
+            i++;
+        }
+    }
+    for (uint64_t old : dropped) {
+        if (old == generation || std::any_of(mappings.begin(), mappings.end(), [&](const Mapping &mapping) { return mapping.generation == old; }))
+            continue;
+        std::error_code error;
+        std::filesystem::remove(std::filesystem::u8path(packPath(old)), error);  // already gone unless on Windows
+    }
+}
+
+int ArtPack::append(const std::string &name, const std::string &data) {
+    if (!writer.is_open()) {
+        writer.open(std::filesystem::u8path(packPath(generation)), std::ios_base::out | std::ios_base::binary | std::ios_base::app);
+        if (!writer) {
+            logError("Unable to open art pack %s\n", packPath(generation).c_str());
+            return -1;
+        }
+    }
+    PackRecordHeader header = {PACK_RECORD_MAGIC, (uint32_t)name.size(), data.size(), xxh64(data.data(), data.size())};
+    writer.write((const char *)&header, sizeof(header));
+    writer.write(name.data(), name.size());
+    writer.write(data.data(), data.size());
+    writer.flush();
+    if (!writer.good()) {
+        logError("Unable to append to art pack %s\n", packPath(generation).c_str());
+        writer.close();
+        return -1;
+    }
+    entries[name] = {pack_size + sizeof(header) + name.size(), data.size()};
+    pack_size += sizeof(header) + name.size() + data.size();
+    live_bytes += sizeof(header) + name.size() + data.size();
+    return 0;
+}
+
+/**
+ * @brief Adds art to the pack under a content-derived name, unless the same
+ *        bytes are already stored. A name taken by different bytes gets a
+ *        "-1", "-2"... suffix, as in the loose store.
+ *
+ * @param[in] name The name derived from the hash, as in "3f/3fa09c5e1b7d2640".
+ * @param[in] data The bytes to store.
+ *
+ * @return The location of the art, ART_PACK_PREFIX followed by its name, or
+ *         an empty string on failure.
+ */
+std::string ArtPack::store(const std::string &name, const std::string &data) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!opened && open() != 0)
+        return "";
+    for (int attempt = 0;; attempt++) {
+        std::string key = attempt > 0 ? name + "-" + std::to_string(attempt) : name;
+        auto it = entries.find(key);
+        if (it != entries.end()) {
+            std::string existing;
+            if (it->second.length == data.size() && readEntry(it->second, existing) && existing == data)
+                return ART_PACK_PREFIX + key;
+            continue;
+        }
+        return append(key, data) == 0 ? ART_PACK_PREFIX + key : "";
+    }
+}
+
+/**
+ * @brief Reads a copy of art by name, for the scanner.
+ *
+ * @details Records appended by another process since the pack was opened
+ *          are picked up on a miss.
+ *
+ * @param[out] data Set to the art.
+ *
+ * @return Whether the art was found.
+ */
+bool ArtPack::read(const std::string &name, std::string &data) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!opened && open() != 0)
+        return false;
+    auto it = entries.find(name);
+    if (it == entries.end()) {
+        if (recoverRecords() != 0)
+            return false;
+        it = entries.find(name);
+        if (it == entries.end())
+            return false;
+    }
+    return readEntry(it->second, data);
+}
+
+/**
+ * @brief Looks up art by name without copying it, for artPackGet.
+ *
+ * @details Records appended by another process since the pack was opened
+ *          are picked up on a miss.
+ *
+ * @param[out] data Set to the art, inside a mapping of the pack.
+ * @param[out] length Set to the length of the art.
+ *
+ * @return Whether the art was found.
+ */
+bool ArtPack::find(const std::string &name, const unsigned char *&data, uint64_t &length) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!opened && open() != 0)
+        return false;
+    if (locate(name, data, length))
+        return true;
+    return recoverRecords() == 0 && locate(name, data, length);
+}
+
+/**
+ * @brief Gives back a pointer handed out by find(), unmapping its mapping
+ *        once nothing points into it and a newer one replaced it.
+ *
+ * @return Whether the pointer lies in a mapping of this pack.
+ */
+bool ArtPack::release(const unsigned char *data) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (Mapping &mapping : mappings) {
+        const unsigned char *start = mapping.file->data();
+        if (start != NULL && data >= start && data < start + mapping.file->size()) {
+            if (mapping.users > 0)
+                mapping.users--;
+            dropMappings();
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Forgets every record not in `live`, saves the index, and compacts
+ *        the pack once more than half of it is dead.
+ *
+ * @param[in] live The names still referred to, without ART_PACK_PREFIX.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int ArtPack::collect(const std::unordered_set<std::string> &live) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!opened && open() != 0)
+        return -1;
+    for (auto it = entries.begin(); it != entries.end();) {
+        if (live.count(it->first) == 0) {
+            live_bytes -= sizeof(PackRecordHeader) + it->first.size() + it->second.length;
+            it = entries.erase(it);
+        } else
+            ++it;
+    }
+    uint64_t waste = pack_size - live_bytes;
+    if (waste > live_bytes && waste >= PACK_COMPACT_MIN_WASTE)
+        return compact();
+    return saveIndex();
+}
+
+/**
+ * @brief Copies the live records to a pack of the next generation, then
+ *        switches the index over to it.
+ *
+ * @details The new pack is written under a temporary name and renamed when
+ *          complete, and the index is saved last, so a crash at any point
+ *          leaves either the old or the new generation whole.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int ArtPack::compact() {
+    std::vector<std::pair<std::string, Entry>> ordered(entries.begin(), entries.end());
+    std::sort(ordered.begin(), ordered.end(), [](const auto &a, const auto &b) { return a.second.offset < b.second.offset; });
+
+    uint64_t next_generation = generation + 1;
+    std::filesystem::path temporary = std::filesystem::u8path(packPath(next_generation) + ".tmp");
+    std::unordered_map<std::string, Entry> compacted;
+    uint64_t compacted_size = 0;
+    {
+        std::ofstream pack(temporary, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+        std::string data;
+        for (auto &item : ordered) {
+            if (!readEntry(item.second, data))
+                return -1;
+            uint64_t length = data.size();
+            PackRecordHeader header = {PACK_RECORD_MAGIC, (uint32_t)item.first.size(), length, xxh64(data.data(), length)};
+            pack.write((const char *)&header, sizeof(header));
+            pack.write(item.first.data(), item.first.size());
+            pack.write(data.data(), length);
+            compacted[item.first] = {compacted_size + sizeof(header) + item.first.size(), length};
+            compacted_size += sizeof(header) + item.first.size() + length;
+        }
+        if (!pack.good()) {
+            logError("Unable to write art pack %s\n", temporary.u8string().c_str());
+            return -1;
+        }
+    }
+    std::error_code error;
+    std::filesystem::rename(temporary, std::filesystem::u8path(packPath(next_generation)), error);
+    if (error) {
+        logError("Unable to replace art pack: %s\n", error.message().c_str());
+        return -1;
+    }
+
+    std::string old_pack = packPath(generation);
+    uint64_t old_size = pack_size;
+    writer.close();
+    reader.reset();
+    generation = next_generation;
+    pack_size = compacted_size;
+    live_bytes = compacted_size;
+    entries.swap(compacted);
+    if (saveIndex() != 0)
+        return -1;
+    dropMappings();
+    std::filesystem::remove(std::filesystem::u8path(old_pack), error);  // retried by dropMappings() and open() if still mapped
+    log("Compacted the art pack from %llu to %llu bytes.\n", (unsigned long long)old_size, (unsigned long long)pack_size);
+    return 0;
+}
+
+// One pack per album art directory, and the directories whose new art goes
+// into their pack.
+static std::mutex packs_mutex;
+static std::unordered_map<std::string, std::unique_ptr<ArtPack>> packs;
+static std::unordered_set<std::string> packing_directories;
+
+/**
+ * @brief Returns the pack of an album art directory.
+ *
+ * @param[in] album_art_directory The album art directory.
+ * @param[in] create Whether to create the pack if the directory has none yet.
+ *
+ * @return The pack, or NULL if there is none and create is false.
+ */
+ArtPack *getArtPack(const std::string &album_art_directory, bool create) {
+    std::lock_guard<std::mutex> lock(packs_mutex);
+    auto it = packs.find(album_art_directory);
+    if (it != packs.end())
+        return it->second.get();
+    std::filesystem::path directory = std::filesystem::u8path(album_art_directory) / "pack";
+    std::error_code error;
+    if (!create && !std::filesystem::is_directory(directory, error))
+        return NULL;
+    ArtPack *pack = new ArtPack(directory.u8string());
+    packs[album_art_directory].reset(pack);
+    return pack;
+}
+
+/**
+ * @brief Chooses whether art stored in a directory from now on goes into
+ *        its pack or into loose files. Art already stored stays where it is.
+ */
+void setArtPacking(const std::string &album_art_directory, bool enabled) {
+    std::lock_guard<std::mutex> lock(packs_mutex);
+    if (enabled)
+        packing_directories.insert(album_art_directory);
+    else
+        packing_directories.erase(album_art_directory);
+}
+
+bool artPackingEnabled(const std::string &album_art_directory) {
+    std::lock_guard<std::mutex> lock(packs_mutex);
+    return packing_directories.count(album_art_directory) > 0;
+}
+
+/**
+ * @brief Reads packed album art without copying it.
+ *
+ * @param[in] album_art_directory The album art directory.
+ * @param[in] location The location of the art, as stored in the database.
+ * @param[out] length Set to the length of the art.
+ *
+ * @return A pointer to the art inside a read-only mapping of the pack, valid
+ *         until it is passed to artPackRelease, or NULL if it is not found.
+ */
+const unsigned char *artPackGet(const char *album_art_directory, const char *location, uint64_t *length) {
+    std::string name = location;
+    if (name.compare(0, strlen(ART_PACK_PREFIX), ART_PACK_PREFIX) == 0)
+        name.erase(0, strlen(ART_PACK_PREFIX));
+    ArtPack *pack = getArtPack(album_art_directory, false);
+    const unsigned char *data;
+    uint64_t found_length;
+    if (pack == NULL || !pack->find(name, data, found_length))
+        return NULL;
+    if (length != NULL)
+        *length = found_length;
+    return data;
+}
+
+/**
+ * @brief Releases art returned by artPackGet, once it is no longer used.
+ *        Every pointer returned must be released exactly once, so that the
+ *        mappings of older generations of the pack can be dropped.
+ *
+ * @param[in] data The pointer returned by artPackGet. NULL is ignored.
+ */
+void artPackRelease(const unsigned char *data) {
+    if (data == NULL)
+        return;
+    std::vector<ArtPack *> all;
+    {
+        std::lock_guard<std::mutex> lock(packs_mutex);
+        for (auto &pack : packs)
+            all.push_back(pack.second.get());
+    }
+    for (ArtPack *pack : all)
+        if (pack->release(data))
+            return;
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "formats.hpp"
+
+#define ART_PACK_PREFIX "pack:"  // marks art locations that live in the pack
+
+/**
+ * @brief A read-only memory mapping of a whole file.
+ */
+class MappedFile {
+   public:
+    MappedFile() = default;
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    int map(const std::string &path, uint64_t reserve = 0);
+    const unsigned char *data() const { return address; }
+    uint64_t size() const { return length; }  // mapped bytes, which may run past the end of the file
+
+   private:
+    const unsigned char *address = NULL;
+    uint64_t length = 0;
+#ifdef _WIN32
+    void *file = NULL;
+    void *mapping = NULL;
+#endif
+};
+
+/**
+ * @brief Album art packed into one append-only file, with an index from art
+ *        names to their place in it.
+ *
+ * @details The pack lives in the "pack" subdirectory of the album art
+ *          directory, as art-<generation>.pack and art.idx. Every record of
+ *          the pack carries its own name and length, so a pack whose index
+ *          is stale or missing is recovered by reading the records past the
+ *          indexed end. Compaction writes the live records to the next
+ *          generation and switches the index over to it.
+ *
+ *          The scanner reads records with positioned reads, through read().
+ *          Only find(), for artPackGet, hands out pointers into a memory
+ *          mapping of the pack, and counts them until they are given back
+ *          to release(). A mapping stays until nothing points into it and a
+ *          newer one replaces it, and the pack of an old generation is
+ *          removed once it is no longer mapped. Each mapping reserves room
+ *          for the pack to double, so a growing pack is mapped again only a
+ *          few times per generation.
+ */
+class ArtPack {
+   public:
+    explicit ArtPack(const std::string &directory);
+
+    int open();
+    std::string store(const std::string &name, const std::string &data);
+    bool read(const std::string &name, std::string &data);
+    bool find(const std::string &name, const unsigned char *&data, uint64_t &length);
+    bool release(const unsigned char *data);
+    int collect(const std::unordered_set<std::string> &live);
+
+   private:
+    struct Entry {
+        uint64_t offset;  // of the data, in the pack
+        uint64_t length;
+    };
+
+    struct Mapping {
+        std::unique_ptr<MappedFile> file;
+        uint64_t generation;  // of the pack mapped
+        uint64_t users;       // pointers from find() not released yet
+    };
+
+    std::string packPath(uint64_t generation) const;
+    std::string indexPath() const;
+    int loadIndex();
+    int recoverRecords();
+    int saveIndex();
+    int compact();
+    bool readEntry(const Entry &entry, std::string &data);
+    bool locate(const std::string &name, const unsigned char *&data, uint64_t &length);
+    void dropMappings();
+    int append(const std::string &name, const std::string &data);
+
+    std::mutex mutex;
+    std::string directory;  // the pack directory
+    bool opened = false;
+    uint64_t generation = 1;
+    uint64_t pack_size = 0;  // bytes of the pack holding whole records
+    uint64_t live_bytes = 0;
+    std::unordered_map<std::string, Entry> entries;
+    std::ofstream writer;
+    std::unique_ptr<PositionedFile> reader;  // the pack of reader_generation, as long as it was when opened
+    uint64_t reader_generation = 0;
+    std::vector<Mapping> mappings;  // the last one is the newest
+};
+
+ArtPack *getArtPack(const std::string &album_art_directory, bool create);
+void setArtPacking(const std::string &album_art_directory, bool enabled);
+bool artPackingEnabled(const std::string &album_art_directory);
+
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) const unsigned char *artPackGet(const char *album_art_directory, const char *location, uint64_t *length);
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) void artPackRelease(const unsigned char *data);
@@ -0,0 +1,284 @@
+#include "art_store.hpp"
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+
+#include "art_pack.hpp"
+#include "misc.hpp"
+
+static const uint64_t k_prime1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t k_prime2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t k_prime3 = 0x165667B19E3779F9ULL;
+static const uint64_t k_prime4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t k_prime5 = 0x27D4EB2F165667C5ULL;
+
+static uint64_t rotateLeft(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static uint64_t read64(const unsigned char *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;  // little endian, like every platform the app ships on
+}
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint64_t round64(uint64_t accumulator, uint64_t input) {
+    accumulator += input * k_prime2;
+    accumulator = rotateLeft(accumulator, 31);
+    return accumulator * k_prime1;
+}
+
+static uint64_t mergeRound(uint64_t accumulator, uint64_t value) {
+    accumulator ^= round64(0, value);
+    return accumulator * k_prime1 + k_prime4;
+}
+
+/**
+ * @brief Computes the XXH64 hash of a buffer.
+ *
+ * @details A plain implementation of the reference algorithm, so that art
+ *          names stay the same across platforms and releases. The hash of
+ *          the empty input with seed 0 is 0xEF46DB3751D8E999.
+ *
+ * @param[in] data The bytes to hash.
+ * @param[in] length The number of bytes.
+ * @param[in] seed The seed.
+ *
+ * @return The hash.
+ */
+uint64_t xxh64(const void *data, size_t length, uint64_t seed) {
+    const unsigned char *p = (const unsigned char *)data;
+    const unsigned char *end = p + length;
+    uint64_t hash;
+
+    if (length >= 32) {
+        uint64_t v1 = seed + k_prime1 + k_prime2;
+        uint64_t v2 = seed + k_prime2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - k_prime1;
+        do {
+            v1 = round64(v1, read64(p));
+            v2 = round64(v2, read64(p + 8));
+            v3 = round64(v3, read64(p + 16));
+            v4 = round64(v4, read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+        hash = rotateLeft(v1, 1) + rotateLeft(v2, 7) + rotateLeft(v3, 12) + rotateLeft(v4, 18);
+        hash = mergeRound(hash, v1);
+        hash = mergeRound(hash, v2);
+        hash = mergeRound(hash, v3);
+        hash = mergeRound(hash, v4);
+    } else
+        hash = seed + k_prime5;
+
+    hash += length;
+    for (; p + 8 <= end; p += 8)
+        hash = rotateLeft(hash ^ round64(0, read64(p)), 27) * k_prime1 + k_prime4;
+    if (p + 4 <= end) {
+        hash = rotateLeft(hash ^ (read32(p) * k_prime1), 23) * k_prime2 + k_prime3;
+        p += 4;
+    }
+    for (; p < end; p++)
+        hash = rotateLeft(hash ^ (*p * k_prime5), 11) * k_prime1;
+
+    hash ^= hash >> 33;
+    hash *= k_prime2;
+    hash ^= hash >> 29;
+    hash *= k_prime3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+static bool isHexDigit(char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+}
+
+/**
+ * @brief Tells whether a file has the contents given.
+ */
+static bool fileHasContents(const std::filesystem::path &path, const std::string &contents) {
+    std::error_code error;
+    if (std::filesystem::file_size(path, error) != contents.size() || error)
+        return false;
+    std::ifstream file(path, std::ios_base::in | std::ios_base::binary);
+    std::string existing((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    return existing == contents;
+}
+
+/**
+ * @brief Returns a temporary name for art being stored under name, such as
+ *        "3fa09c5e1b7d2640.1234-7.tmp", that no other thread or process uses.
+ */
+static std::string temporaryArtName(const std::string &name) {
+    static std::atomic<unsigned long long> next_temporary{0};
+#ifdef _WIN32
+    int pid = _getpid();
+#else
+    int pid = getpid();
+#endif
+    return name + "." + std::to_string(pid) + "-" + std::to_string(next_temporary++) + ".tmp";
+}
+
+/**
+ * @brief Saves image bytes under a name derived from their XXH64 hash, unless
+ *        the same bytes are already stored.
+ *
+ * @details Art lives in 256 shard directories named after the first two hex
+ *          digits of the hash, as in "3f/3fa09c5e1b7d2640", so that no
+ *          directory grows too large. An existing file with the right name is
+ *          compared byte for byte, and a hash collision gets a "-1", "-2"...
+ *          suffix. New files are written under a temporary name of their own,
+ *          unique to the process and the call, and renamed into place, so a
+ *          stored name never refers to a partial file. When two threads store
+ *          the same art at once, both end up with the same name.
+ *
+ *          When packing is enabled for the directory, the art goes into its
+ *          pack under the same name instead, and the location returned starts
+ *          with ART_PACK_PREFIX.
+ *
+ *          Safe to call from several threads. Art no album refers to any more
+ *          is removed by deleteUselessAlbumArt.
+ *
+ * @param[in] image_data The raw image bytes.
+ * @param[in] directory The album art directory.
+ *
+ * @return The location of the art relative to the directory, or an empty
+ *         string if there was nothing to save or it could not be saved.
+ */
+std::string storeArt(const std::string &image_data, const std::string &directory) {
+    if (image_data.empty())
+        return "";
+
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)xxh64(image_data.data(), image_data.size()));
+    std::string shard(hex, 2);
+    if (artPackingEnabled(directory))
+        return getArtPack(directory, true)->store(shard + "/" + hex, image_data);
+    std::filesystem::path shard_path = std::filesystem::u8path(directory) / shard;
+    std::error_code error;
+    std::filesystem::create_directories(shard_path, error);
+
+    for (int attempt = 0;; attempt++) {
+        std::string name = hex;
+        if (attempt > 0)
+            name += "-" + std::to_string(attempt);
+        std::filesystem::path path = shard_path / name;
+        if (std::filesystem::exists(path, error)) {
+            if (fileHasContents(path, image_data))
+                return shard + "/" + name;
+            continue;
+        }
+
+        std::filesystem::path temporary = shard_path / temporaryArtName(name);
+        {
+            std::ofstream image_file(temporary, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+            image_file.write(image_data.data(), image_data.size());
+            if (!image_file.good()) {
+                logError("Unable to write album art to %s\n", temporary.u8string().c_str());
+                image_file.close();
+                std::filesystem::remove(temporary, error);
+                return "";
+            }
+        }
+        std::filesystem::rename(temporary, path, error);
+        if (error) {
+            std::error_code remove_error;
+            std::filesystem::remove(temporary, remove_error);
+            // Another thread may have just stored the same art under this
+            // name, and on some platforms a rename cannot replace it.
+            std::error_code exists_error;
+            if (std::filesystem::exists(path, exists_error) && fileHasContents(path, image_data))
+                return shard + "/" + name;
+            logError("Unable to store album art %s: %s\n", path.u8string().c_str(), error.message().c_str());
+            return "";
+        }
+        return shard + "/" + name;
+    }
+}
+
+/**
+ * @brief Reads stored art, from the pack or from a loose file.
+ *
+ * @param[in] location The location of the art, as returned by storeArt.
+ * @param[in] directory The album art directory.
+ * @param[out] data Set to the art.
+ *
+ * @return 0 on success, -1 if the art could not be read.
+ */
+int loadArt(const std::string &location, const std::string &directory, std::string &data) {
+    if (location.compare(0, strlen(ART_PACK_PREFIX), ART_PACK_PREFIX) == 0) {
+        ArtPack *pack = getArtPack(directory, false);
+        if (pack == NULL || !pack->read(location.substr(strlen(ART_PACK_PREFIX)), data))
+            return -1;
+        return 0;
+    }
+    std::ifstream file(std::filesystem::u8path(directory) / std::filesystem::u8path(location), std::ios_base::in | std::ios_base::binary);
+    if (!file)
+        return -1;
+    data.assign((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    return 0;
+}
+
+/**
+ * @brief Tells whether a location relative to the album art directory has
+ *        the shape of a file written by the scanner: a stored blob, a
+ *        leftover temporary file, or a random numeric name from before the
+ *        art store existed. Only such files are ever garbage collected.
+ */
+bool isStoredArtName(const std::string &location) {
+    if (location.find('/') == std::string::npos) {
+        if (location.empty())
+            return false;
+        for (char c : location) {
+            if (c < '0' || c > '9')
+                return false;
+        }
+        return true;
+    }
+    if (location.size() < 3 + 16 || location[2] != '/' || location.compare(0, 2, location, 3, 2) != 0)
+        return false;
+    for (size_t i = 3; i < 3 + 16; i++) {
+        if (!isHexDigit(location[i]))
+            return false;
+    }
+    std::string rest = location.substr(3 + 16);
+    if (endsWith(rest, ".tmp")) {
+        rest.resize(rest.size() - 4);
+        // The process id and counter of temporaryArtName, which older
+        // versions did not add.
+        size_t dot = rest.rfind('.');
+        if (dot != std::string::npos) {
+            std::string unique = rest.substr(dot + 1);
+            size_t dash = unique.find('-');
+            if (dash == std::string::npos || dash == 0 || dash + 1 == unique.size() ||
+                unique.find_first_not_of("0123456789-") != std::string::npos || unique.find('-', dash + 1) != std::string::npos)
+                return false;
+            rest.resize(dot);
+        }
+    }
+    if (rest.empty())
+        return true;
+    if (rest[0] != '-' || rest.size() == 1)
+        return false;
+    for (size_t i = 1; i < rest.size(); i++) {
+        if (rest[i] < '0' || rest[i] > '9')
+            return false;
+    }
+    return true;
+}
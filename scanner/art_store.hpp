@@ -0,0 +1,11 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+uint64_t xxh64(const void *data, size_t length, uint64_t seed = 0);
+
+std::string storeArt(const std::string &image_data, const std::string &directory);
+int loadArt(const std::string &location, const std::string &directory, std::string &data);
+bool isStoredArtName(const std::string &location);
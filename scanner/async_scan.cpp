@@ -0,0 +1,189 @@
+#include "async_scan.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+
+#include "misc.hpp"
+#include "project_dbs_ffi.hpp"
+#include "scan_progress.hpp"
+
+/**
+ * @brief A scan started by scanStart, running on its own thread.
+ */
+struct AsyncScan {
+    ScanConfig config;
+    ScanProgress progress;
+    std::thread thread;
+    int result = 0;
+};
+
+static std::mutex scans_mutex;
+static int next_handle = 1;
+
+static void cancelScans();
+
+/**
+ * @brief Returns the scans by handle, until scanFinish releases them. Like
+ *        the logger, the map is never destroyed, as destroying a scan whose
+ *        thread is still running ends the process; cancelScans stops them at
+ *        exit instead.
+ */
+static std::unordered_map<int, std::unique_ptr<AsyncScan>> &scans() {
+    static std::unordered_map<int, std::unique_ptr<AsyncScan>> *instance = [] {
+        auto *created = new std::unordered_map<int, std::unique_ptr<AsyncScan>>();
+        atexit(cancelScans);
+        return created;
+    }();
+    return *instance;
+}
+
+/**
+ * @brief Cancels the scans never passed to scanFinish and waits for them to
+ *        stop, so that the process can exit while one is running.
+ */
+static void cancelScans() {
+    std::lock_guard<std::mutex> lock(scans_mutex);
+    for (auto &entry : scans())
+        entry.second->progress.cancel = true;
+    for (auto &entry : scans()) {
+        if (!entry.second->thread.joinable())
+            continue;
+#ifdef _WIN32
+        // Windows ends the other threads before running atexit handlers in a
+        // DLL, and joining them there can deadlock on the loader lock.
+        entry.second->thread.detach();
+#else
+        entry.second->thread.join();
+#endif
+    }
+}
+
+static const char *stateName(int state) {
+    switch (state) {
+        case ScanPending:
+            return "pending";
+        case ScanRunning:
+            return "running";
+        case ScanFinished:
+            return "finished";
+        case ScanFailed:
+            return "failed";
+        case ScanCancelled:
+            return "cancelled";
+    }
+    return "unknown";
+}
+
+/**
+ * @brief Starts a scan in the background and returns at once.
+ *
+ * @param[in] input The same input JSON as for update().
+ *
+ * @return A handle for scanPoll, scanCancel and scanFinish, or -1 on failure.
+ */
+int scanStart(const char *input) {
+    std::unique_ptr<AsyncScan> scan(new AsyncScan());
+    if (parseInputJSON(input, scan->config) != 0)
+        return -1;
+
+    std::lock_guard<std::mutex> lock(scans_mutex);
+    int handle = next_handle++;
+    AsyncScan *running = scan.get();
+    try {
+        running->thread = std::thread([running] { running->result = runScan(running->config, &running->progress); });
+    } catch (const std::system_error &e) {
+        logError("Unable to start a scan thread: %s\n", e.what());
+        return -1;
+    }
+    scans()[handle] = std::move(scan);
+    return handle;
+}
+
+/**
+ * @brief Reads the progress of a scan without waiting for it.
+ *
+ * @param[in] handle The handle returned by scanStart.
+ * @param[out] status The progress so far.
+ *
+ * @return 0 on success, -1 if the handle is unknown.
+ */
+int scanPoll(int handle, ScanStatus *status) {
+    std::lock_guard<std::mutex> lock(scans_mutex);
+    auto it = scans().find(handle);
+    if (it == scans().end() || status == NULL)
+        return -1;
+    ScanProgress &progress = it->second->progress;
+    status->discovered = progress.discovered;
+    status->queued = progress.queued;
+    status->parsed = progress.parsed;
+    status->inserted = progress.inserted;
+    status->failed = progress.failed;
+    status->bytes_read = progress.bytes_read;
+    status->state = progress.state;
+    status->reserved = 0;
+    return 0;
+}
+
+/**
+ * @brief Asks a scan to stop as soon as it can. Songs already read are still
+ *        written, but no songs are deleted. Call scanFinish afterwards.
+ *
+ * @param[in] handle The handle returned by scanStart.
+ *
+ * @return 0 on success, -1 if the handle is unknown.
+ */
+int scanCancel(int handle) {
+    std::lock_guard<std::mutex> lock(scans_mutex);
+    auto it = scans().find(handle);
+    if (it == scans().end())
+        return -1;
+    it->second->progress.cancel = true;
+    return 0;
+}
+
+/**
+ * @brief Waits for a scan to end, releases its handle and returns its
+ *        outcome.
+ *
+ * @details The outcome is a JSON object with the final counters, the state
+ *          ("finished", "failed" or "cancelled"), "failed_files", the first
+ *          few files that could not be read or stored, and the timings of the
+ *          scan's stages, formats and slowest files (see ScanStats::toJSON).
+ *
+ * @param[in] handle The handle returned by scanStart.
+ *
+ * @return The JSON string, to be released with scanFreeString, or NULL if the
+ *         handle is unknown.
+ */
+char *scanFinish(int handle) {
+    std::unique_ptr<AsyncScan> scan;
+    {
+        std::lock_guard<std::mutex> lock(scans_mutex);
+        auto it = scans().find(handle);
+        if (it == scans().end())
+            return NULL;
+        scan = std::move(it->second);
+        scans().erase(it);
+    }
+    scan->thread.join();
+
+    nlohmann::json result = scanReport(scan->progress);
+    result["state"] = stateName(scan->progress.state);
+    result["result"] = scan->result;
+    return strdup(result.dump().c_str());
+}
+
+/**
+ * @brief Releases a string returned by this library, such as the result of
+ *        scanFinish or autocompleteQuery.
+ */
+void scanFreeString(char *string) {
+    free(string);
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdint>
+
+/**
+ * @brief A snapshot of a scan's progress, laid out for FFI.
+ *
+ * @details The counters have the meaning given in ScanProgress, and state is
+ *          a ScanState.
+ */
+struct ScanStatus {
+    uint64_t discovered;
+    uint64_t queued;
+    uint64_t parsed;
+    uint64_t inserted;
+    uint64_t failed;
+    uint64_t bytes_read;
+    int32_t state;
+    int32_t reserved;  // keeps the size a multiple of 8 on every ABI
+};
+
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) int scanStart(const char *input);
+
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) int scanPoll(int handle, ScanStatus *status);
+
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) int scanCancel(int handle);
+
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) char *scanFinish(int handle);
+
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) void scanFreeString(char *string);
@@ -1,9 +1,16 @@
 #include "database_functions.hpp"
 
+#include <algorithm>
+#include <cstring>
 #include <filesystem>
+#include <unordered_map>
 #include <unordered_set>
 
+#include "art_pack.hpp"
+#include "art_store.hpp"
+#include "migrations.hpp"
 #include "misc.hpp"
+#include "name_indexes.hpp"
 #include "tag_functions.hpp"
 
 /**
@@ -23,7 +30,7 @@ int createDatabase(const char *db_path) {
 
     rc = sqlite3_open(db_path, &db);
     if (rc != SQLITE_OK) {
-        log("Can't open database %s: %s\n", db_path, sqlite3_errmsg(db));
+        logError("Can't open database %s: %s\n", db_path, sqlite3_errmsg(db));
         sqlite3_close(db);
         return -1;
     }
@@ -34,8 +41,8 @@ int createDatabase(const char *db_path) {
     sqlite3_db_config(db, SQLITE_DBCONFIG_RESET_DATABASE, 0, 0);
 
     // Creating tables
-    if (createTables(db) != 0) {
-        log("Unable to create tables for new database @ %s\n", db_path);
+    if (migrateDatabase(db) != 0) {
+        logError("Unable to create tables for new database @ %s\n", db_path);
         sqlite3_close(db);
         return -1;
     }
@@ -49,7 +56,8 @@ int createDatabase(const char *db_path) {
  *        k_create array of strings.
  *
  * @details This function should be called after a database has been created
- *          with createDatabase.
+ *          with createDatabase. It creates the version 1 schema; later
+ *          changes are applied on top of it by migrateDatabase.
  *
  * @param[in] db The database to create tables in.
  *
@@ -60,7 +68,7 @@ int createTables(sqlite3 *db) {
     char *error_message;
     const char *k_create[] = {
         "CREATE TABLE Albums ( 	id INTEGER PRIMARY KEY AUTOINCREMENT, 	title VARCHAR(512), 	album_art_location VARCHAR(2048) );",
-        "CREATE TABLE Songs ( 	id INTEGER PRIMARY KEY AUTOINCREMENT, 	title VARCHAR(512), 	track_number INTEGER, 	disc_number INTEGER, 	rating SMALLINT DEFAULT 0, 	album_id INTEGER, 	location VARCHAR(2048), 	FOREIGN KEY (album_id) REFERENCES Albums(id) ON DELETE CASCADE );",
+        "CREATE TABLE Songs ( 	id INTEGER PRIMARY KEY AUTOINCREMENT, 	title VARCHAR(512), 	track_number INTEGER, 	disc_number INTEGER, 	rating SMALLINT DEFAULT 0, 	album_id INTEGER, 	location VARCHAR(2048), 	play_count INTEGER DEFAULT 0, 	FOREIGN KEY (album_id) REFERENCES Albums(id) ON DELETE CASCADE );",
         "CREATE TABLE Artists ( 	id INTEGER PRIMARY KEY AUTOINCREMENT, 	name VARCHAR(512), 	description VARCHAR(1024), 	photo_location VARCHAR(2048) );",
         "CREATE TABLE Genres ( 	id INTEGER PRIMARY KEY AUTOINCREMENT, 	name VARCHAR(128) );",
         "CREATE TABLE ContributingArtists ( 	song_id INTEGER, 	artist_id INTEGER, 	PRIMARY KEY (song_id, artist_id), 	FOREIGN KEY (song_id) REFERENCES Songs(id) ON DELETE CASCADE, 	FOREIGN KEY (artist_id) REFERENCES Artists(id) ON DELETE CASCADE);",
@@ -69,186 +77,304 @@ int createTables(sqlite3 *db) {
         "CREATE TABLE Playlists ( 	id INTEGER PRIMARY KEY AUTOINCREMENT, 	title VARCHAR(512) );",
         "CREATE TABLE PlaylistSongs ( 	id INTEGER PRIMARY KEY AUTOINCREMENT, 	playlist_id INTEGER, 	song_id INTEGER, 	FOREIGN KEY (playlist_id) REFERENCES Playlists(id) ON DELETE CASCADE, 	FOREIGN KEY (song_id) REFERENCES Songs(id) ON DELETE CASCADE );"};
 
-    for (i = 0; i < 9; i++) {
+    for (i = 0; i < sizeof(k_create) / sizeof(k_create[0]); i++) {
         rc = sqlite3_exec(db, k_create[i], NULL, NULL, &error_message);
         if (rc != SQLITE_OK) {
-            log("Error while creating table %d: %s\n", i, error_message);
+            logError("Error while creating table %d: %s\n", i, error_message);
             sqlite3_free(error_message);
         }
     }
     return 0;
 }
 
+/**
+ * @brief Runs a statement that returns no rows, such as BEGIN, COMMIT or a
+ *        schema change.
+ *
+ * @param[in] db The database to run the statement on.
+ * @param[in] sql_stmt The statement to run.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int execStatement(sqlite3 *db, const char *sql_stmt) {
+    char *error_message;
+    if (sqlite3_exec(db, sql_stmt, NULL, NULL, &error_message) != SQLITE_OK) {
+        logError("Error while executing %s: %s\n", sql_stmt, error_message);
+        sqlite3_free(error_message);
+        return -1;
+    }
+    return 0;
+}
+
+int beginTransaction(sqlite3 *db) {
+    return execStatement(db, "BEGIN;");
+}
+
+int commitTransaction(sqlite3 *db) {
+    return execStatement(db, "COMMIT;");
+}
+
+/**
+ * @brief Rolls back the open transaction, if there is one.
+ *
+ * @details SQLite may already have rolled back by itself after some errors,
+ *          so this is a no-op when no transaction is open.
+ *
+ * @param[in] db The database to roll back.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int rollbackTransaction(sqlite3 *db) {
+    if (sqlite3_get_autocommit(db))
+        return 0;
+    return execStatement(db, "ROLLBACK;");
+}
+
+/**
+ * @brief Commits the open transaction and keeps the cached ids it created.
+ *
+ * @param[in] ctx The scan context holding the database.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int commitScanTransaction(ScanContext &ctx) {
+    if (commitTransaction(ctx.db) != 0)
+        return -1;
+    ctx.entities.commit();
+    addToNameIndexes(ctx.db, ctx.completions);
+    ctx.completions.clear();
+    return 0;
+}
+
+/**
+ * @brief Rolls back the open transaction and drops the cached ids it created.
+ *
+ * @param[in] ctx The scan context holding the database.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int rollbackScanTransaction(ScanContext &ctx) {
+    ctx.entities.rollback();
+    ctx.completions.clear();
+    return rollbackTransaction(ctx.db);
+}
+
 /**
  * @brief Retrieves the id of an entity from the database, or creates it if it does not exist.
  *
  * @details This function is used to get the id of an entity from the database. If the entity does
- *          not exist, it will create it.
+ *          not exist, it will create it. When the entity cache of the context is loaded, it is
+ *          consulted instead of the database. A created entity is queued for the name indexes
+ *          when they follow the database.
  *
- * @param[in] db The database to query.
+ * @param[in] ctx The scan context holding the database to query.
  * @param[in] entity_type The type of entity to query for.
  * @param[in] entity_name The name of the entity to query for.
  *
  * @return The id of the entity. If the entity does not exist and cannot be created, -1 is returned.
  */
-int getEntityId(sqlite3 *db, EntityType entity_type, const std::string &entity_name) {
-    int entity_id = 0, rc;
-    char *sql_stmt, *error_message;
-    const char *table_name, *column_name;
+int getEntityId(ScanContext &ctx, EntityType entity_type, std::string_view entity_name) {
+    CachedStatement select_statement, insert_statement;
+    const char *table_name;
+    CompletionKind completion_kind;
 
     switch (entity_type) {
         case EntityType::Album:
             table_name = "Albums";
-            column_name = "title";
+            select_statement = SelectAlbumIdByTitle;
+            insert_statement = InsertAlbum;
+            completion_kind = CompleteAlbum;
             break;
         case EntityType::Artist:
             table_name = "Artists";
-            column_name = "name";
+            select_statement = SelectArtistIdByName;
+            insert_statement = InsertArtist;
+            completion_kind = CompleteArtist;
             break;
         case EntityType::Genre:
             table_name = "Genres";
-            column_name = "name";
+            select_statement = SelectGenreIdByName;
+            insert_statement = InsertGenre;
+            completion_kind = CompleteGenre;
             break;
         default:
             return -1;
     }
 
+    sqlite3_stmt *stmt;
+    sqlite3_int64 entity_id;
+    int rc;
+
     // Try to find entity id
-    sql_stmt = sqlite3_mprintf("SELECT id FROM %s WHERE %s = \"%s\";", table_name, column_name, escapeDQ(entity_name).c_str());
-    rc = sqlite3_exec(db, sql_stmt, &__getEntityIdInternalCallback, &entity_id, &error_message);
-    if (rc != SQLITE_OK) {
-        log("Error while executing query to get %s id of %s: %s\n", table_name, entity_name.c_str(), error_message);
-        sqlite3_free(sql_stmt);
-        sqlite3_free(error_message);
-        return -1;
+    if (ctx.entities.isLoaded()) {
+        entity_id = ctx.entities.find(entity_type, entity_name);
+        rc = entity_id != 0 ? SQLITE_ROW : SQLITE_DONE;
+    } else {
+        stmt = ctx.statements.get(select_statement);
+        if (stmt == NULL)
+            return -1;
+        sqlite3_bind_text(stmt, 1, entity_name.data(), entity_name.size(), SQLITE_TRANSIENT);
+        rc = stepForId(stmt, entity_id);
+        if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+            logError("Error while executing query to get %s id of %.*s: %s\n", table_name, (int)entity_name.size(), entity_name.data(), sqlite3_errmsg(ctx.db));
+            return -1;
+        }
     }
-    sqlite3_free(sql_stmt);
 
     // If entity does not exist, create it
-    if (entity_id == 0) {
-        // Creating the entity
-        sql_stmt = sqlite3_mprintf("INSERT INTO %s (id, %s) VALUES (NULL, \"%s\");", table_name, column_name, escapeDQ(entity_name).c_str());
-        rc = sqlite3_exec(db, sql_stmt, NULL, NULL, &error_message);
-        if (rc != SQLITE_OK) {
-            log("Error while executing query to create %s %s: %s\n", table_name, entity_name.c_str(), error_message);
-            sqlite3_free(sql_stmt);
-            sqlite3_free(error_message);
+    if (rc == SQLITE_DONE) {
+        stmt = ctx.statements.get(insert_statement);
+        if (stmt == NULL)
             return -1;
-        }
-        sqlite3_free(sql_stmt);
-        // Getting the entity id, after it has been created
-        sql_stmt = sqlite3_mprintf("SELECT id FROM %s WHERE %s = \"%s\";", table_name, column_name, escapeDQ(entity_name).c_str());
-        rc = sqlite3_exec(db, sql_stmt, &__getEntityIdInternalCallback, &entity_id, &error_message);
-        if (rc != SQLITE_OK) {
-            log("Error while executing query to get %s id (after creating) of %s: %s\n", table_name, entity_name.c_str(), error_message);
-            sqlite3_free(sql_stmt);
-            sqlite3_free(error_message);
+        sqlite3_bind_text(stmt, 1, entity_name.data(), entity_name.size(), SQLITE_TRANSIENT);
+        if (stepStatement(stmt) != SQLITE_DONE) {
+            logError("Error while executing query to create %s %.*s: %s\n", table_name, (int)entity_name.size(), entity_name.data(), sqlite3_errmsg(ctx.db));
             return -1;
         }
-        sqlite3_free(sql_stmt);
+        entity_id = sqlite3_last_insert_rowid(ctx.db);
+        ctx.entities.insert(entity_type, entity_name, entity_id);
+        if (ctx.track_completions)
+            ctx.completions.push_back({completion_kind, (int)entity_id, std::string(entity_name)});
     }
 
     return entity_id;
 }
 
-/**
- * Internal callback for getArtistId.
- *
- * This function is used as a callback for a SQLite query. It takes the result
- * of the query and stores it in the id parameter, which is a pointer to an int.
- *
- * \param id The id to store the result in.
- * \param argc The number of columns in the result.
- * \param argv The result of the query.
- * \param column_names The names of the columns.
- *
- * \return 0
- */
-int __getEntityIdInternalCallback(void *id, int argc, char **argv, char **column_names) {
-    if (argc > 0)
-        *(int *)id = atoi(argv[0]);
-    return 0;
-}
-
 /**
  * @brief Finds the id of an album with the given name and artist ids in the
  *        database.
  *
- * @details This function will first try to find an album with the given name
- *          and artist ids. If no such album exists, it will create one.
+ * @details Albums are identified by their album key (see makeAlbumKey), which
+ *          is looked up in the entity cache, or with a single indexed query if
+ *          the cache is not loaded. If no such album exists, it will create one,
+ *          and queue it for the name indexes when they follow the database.
  *
- * @param[in] db The SQLite database to query.
+ * @param[in] ctx The scan context holding the database to query.
  * @param[in] album_name The name of the album to find.
  * @param[in] artist_ids The ids of the artists of the album to find.
  *
  * @return The id of the album if found, -1 if an error occurred.
  */
-int getAlbumId(sqlite3 *db, const std::string &album_name, std::vector<int> &artist_ids) {
-    int rc, album_id = 0;
-    char *sql_stmt, *error_message;
-
-    std::string artist_ids_string = escapeDQ(stringifyIntVector(artist_ids));
-
-    sql_stmt = sqlite3_mprintf("SELECT A.id FROM Albums A, AlbumArtists B, Artists C WHERE A.title = \"%s\" AND A.id = B.album_id AND B.artist_id = C.id AND C.id IN %s GROUP BY A.id HAVING COUNT(DISTINCT C.id) = ( SELECT COUNT(DISTINCT D.id) FROM Artists D WHERE D.id IN %s );", escapeDQ(album_name).c_str(), artist_ids_string.c_str(), artist_ids_string.c_str());
-    rc = sqlite3_exec(db, sql_stmt, &__getEntityIdInternalCallback, &album_id, &error_message);
-    if (rc != SQLITE_OK) {
-        log("Error while executing query to get album id of %s: %s (Query was %s)\n", album_name.c_str(), error_message, sql_stmt);
-        sqlite3_free(sql_stmt);
-        sqlite3_free(error_message);
-        return -1;
-    }
-    sqlite3_free(sql_stmt);
+int getAlbumId(ScanContext &ctx, std::string_view album_name, std::vector<int> &artist_ids) {
+    std::string album_key = makeAlbumKey(album_name, artist_ids);
+    sqlite3_stmt *stmt;
+    sqlite3_int64 album_id;
+    int rc;
 
-    if (album_id == 0) {
-        sql_stmt = sqlite3_mprintf("INSERT INTO Albums (id, title) VALUES (NULL, \"%s\");", escapeDQ(album_name).c_str());
-        rc = sqlite3_exec(db, sql_stmt, NULL, NULL, &error_message);
-        if (rc != SQLITE_OK) {
-            log("Error while executing query to create album %s: %s\n", album_name.c_str(), error_message);
-            sqlite3_free(sql_stmt);
-            sqlite3_free(error_message);
+    if (ctx.entities.isLoaded()) {
+        album_id = ctx.entities.findAlbum(album_key);
+        rc = album_id != 0 ? SQLITE_ROW : SQLITE_DONE;
+    } else {
+        stmt = ctx.statements.get(SelectAlbumIdByKey);
+        if (stmt == NULL)
+            return -1;
+        sqlite3_bind_text(stmt, 1, album_key.c_str(), album_key.size(), SQLITE_TRANSIENT);
+        rc = stepForId(stmt, album_id);
+        if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+            logError("Error while executing query to get album id of %.*s: %s\n", (int)album_name.size(), album_name.data(), sqlite3_errmsg(ctx.db));
             return -1;
         }
-        sqlite3_free(sql_stmt);
+    }
 
-        sql_stmt = sqlite3_mprintf("SELECT id FROM Albums WHERE ROWID = %d;", sqlite3_last_insert_rowid(db));
-        rc = sqlite3_exec(db, sql_stmt, &__getEntityIdInternalCallback, &album_id, &error_message);
-        if (rc != SQLITE_OK) {
-            log("Error while executing query to get album id (after creating) of %s: %s\n", escapeDQ(album_name).c_str(), error_message);
-            sqlite3_free(sql_stmt);
-            sqlite3_free(error_message);
+    if (rc == SQLITE_DONE) {
+        stmt = ctx.statements.get(InsertKeyedAlbum);
+        if (stmt == NULL)
+            return -1;
+        sqlite3_bind_text(stmt, 1, album_name.data(), album_name.size(), SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 2, album_key.c_str(), album_key.size(), SQLITE_TRANSIENT);
+        if (stepStatement(stmt) != SQLITE_DONE) {
+            logError("Error while executing query to create album %.*s: %s\n", (int)album_name.size(), album_name.data(), sqlite3_errmsg(ctx.db));
             return -1;
         }
-        sqlite3_free(sql_stmt);
+        album_id = sqlite3_last_insert_rowid(ctx.db);
+        ctx.entities.insert(EntityType::Album, album_name, album_id);
+        ctx.entities.insertAlbum(album_key, album_id);
+        if (ctx.track_completions)
+            ctx.completions.push_back({CompleteAlbum, (int)album_id, std::string(album_name)});
 
         for (int i = 0; i < artist_ids.size(); i++)
-            addAlbumArtistRelationship(db, album_id, artist_ids[i]);
+            addAlbumArtistRelationship(ctx, album_id, artist_ids[i]);
     }
 
     return album_id;
 }
 
 /**
- * Converts a vector of integers to a string.
+ * @brief Gives every album without an album key its key.
  *
- * The string is a comma separated list of the integers, enclosed in
- * parentheses. For example, the vector [1, 2, 3] would be converted to
- * (1, 2, 3).
+ * @details Databases created before album keys existed get the album_key
+ *          column and its index here, and their albums are keyed from the
+ *          AlbumArtists table. Run by migrateDatabase, inside its transaction.
  *
- * \param[in] vec The vector to convert.
+ * @param[in] db The database to update.
  *
- * \return A string representation of the vector.
+ * @return 0 on success, -1 on failure.
  */
-std::string stringifyIntVector(std::vector<int> &vec) {
-    std::string result = "(";
-    if (vec.size() != 0) {
-        result += std::to_string(vec[0]);
-        for (int i = 1; i < vec.size(); i++) {
-            result += ", ";
-            result += std::to_string(vec[i]);
+int ensureAlbumKeys(sqlite3 *db) {
+    char *error_message;
+    sqlite3_stmt *stmt;
+    bool has_column = false;
+
+    if (sqlite3_prepare_v2(db, "SELECT 1 FROM pragma_table_info('Albums') WHERE name = 'album_key';", -1, &stmt, NULL) != SQLITE_OK) {
+        logError("Error while checking for the album_key column: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    has_column = sqlite3_step(stmt) == SQLITE_ROW;
+    sqlite3_finalize(stmt);
+    if (!has_column && sqlite3_exec(db, "ALTER TABLE Albums ADD COLUMN album_key VARCHAR(1024);", NULL, NULL, &error_message) != SQLITE_OK) {
+        logError("Error while adding the album_key column: %s\n", error_message);
+        sqlite3_free(error_message);
+        return -1;
+    }
+    if (sqlite3_exec(db, "CREATE INDEX IF NOT EXISTS AlbumsByKey ON Albums (album_key);", NULL, NULL, &error_message) != SQLITE_OK) {
+        logError("Error while creating the album_key index: %s\n", error_message);
+        sqlite3_free(error_message);
+        return -1;
+    }
+
+    std::vector<std::pair<sqlite3_int64, std::string>> keys;
+    if (sqlite3_prepare_v2(db, "SELECT A.id, A.title, AA.artist_id FROM Albums A LEFT JOIN AlbumArtists AA ON A.id = AA.album_id WHERE A.album_key IS NULL ORDER BY A.id;", -1, &stmt, NULL) != SQLITE_OK) {
+        logError("Error while reading albums without a key: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    sqlite3_int64 current_id = 0;
+    std::string current_title;
+    std::vector<int> artist_ids;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        sqlite3_int64 id = sqlite3_column_int64(stmt, 0);
+        if (id != current_id) {
+            if (current_id != 0)
+                keys.emplace_back(current_id, makeAlbumKey(current_title, artist_ids));
+            current_id = id;
+            const char *title = (const char *)sqlite3_column_text(stmt, 1);
+            current_title = title != NULL ? title : "";
+            artist_ids.clear();
+        }
+        if (sqlite3_column_type(stmt, 2) != SQLITE_NULL)
+            artist_ids.push_back(sqlite3_column_int64(stmt, 2));
+    }
+    if (current_id != 0)
+        keys.emplace_back(current_id, makeAlbumKey(current_title, artist_ids));
+    sqlite3_finalize(stmt);
+
+    if (keys.empty())
+        return 0;
+    if (sqlite3_prepare_v2(db, "UPDATE Albums SET album_key = ?2 WHERE id = ?1;", -1, &stmt, NULL) != SQLITE_OK) {
+        logError("Error while preparing album key update: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    for (auto &item : keys) {
+        sqlite3_bind_int64(stmt, 1, item.first);
+        sqlite3_bind_text(stmt, 2, item.second.c_str(), item.second.size(), SQLITE_TRANSIENT);
+        if (stepStatement(stmt) != SQLITE_DONE) {
+            logError("Error while setting the album key of album %lld: %s\n", (long long)item.first, sqlite3_errmsg(db));
+            sqlite3_finalize(stmt);
+            return -1;
         }
     }
-    result += ")";
-    return result;
+    sqlite3_finalize(stmt);
+    log("Added album keys to %zu albums.\n", keys.size());
+    return 0;
 }
 
 /**
@@ -259,23 +385,22 @@ std::string stringifyIntVector(std::vector<int> &vec) {
  *          album and artist. If the operation fails, it logs the error message
  *          and returns -1.
  *
- * @param[in] db A pointer to the SQLite database connection.
+ * @param[in] ctx The scan context holding the database connection.
  * @param[in] album_id The ID of the album to associate with the artist.
  * @param[in] artist_id The ID of the artist to associate with the album.
  *
  * @return 0 on success, -1 on failure.
  */
-int addAlbumArtistRelationship(sqlite3 *db, int album_id, int artist_id) {
-    char *sql_stmt, *error_message;
-    sql_stmt = sqlite3_mprintf("INSERT INTO AlbumArtists (album_id, artist_id) VALUES (%d, %d);", album_id, artist_id);
-    int rc = sqlite3_exec(db, sql_stmt, NULL, NULL, &error_message);
-    if (rc != SQLITE_OK) {
-        log("Error while executing query to add album artist relationship: %s\n", error_message);
-        sqlite3_free(sql_stmt);
-        sqlite3_free(error_message);
+int addAlbumArtistRelationship(ScanContext &ctx, int album_id, int artist_id) {
+    sqlite3_stmt *stmt = ctx.statements.get(InsertAlbumArtist);
+    if (stmt == NULL)
+        return -1;
+    sqlite3_bind_int64(stmt, 1, album_id);
+    sqlite3_bind_int64(stmt, 2, artist_id);
+    if (stepStatement(stmt) != SQLITE_DONE) {
+        logError("Error while executing query to add album artist relationship: %s\n", sqlite3_errmsg(ctx.db));
         return -1;
     }
-    sqlite3_free(sql_stmt);
     return 0;
 }
 
@@ -286,62 +411,125 @@ int addAlbumArtistRelationship(sqlite3 *db, int album_id, int artist_id) {
  * @details This function adds a song to the database, given the metadata.
  *          It completely adds all information, like album, artists, genres, etc.
  *
- * @param[in] db A pointer to the SQLite database connection.
+ * @param[in] ctx The scan context holding the database connection.
  * @param[in] metadata The metadata for the song to add.
+ * @param[in] album_art_directory The directory where album art is saved.
+ * @param[in] album_art_data Image bytes already read from the file, or NULL
+ *                           to read them here only if the album needs art.
  *
  * @return 0 on success, -1 on failure.
  */
-int addSong(sqlite3 *db, Metadata &metadata, std::string &album_art_directory) {
+int addSong(ScanContext &ctx, Metadata &metadata, std::string &album_art_directory, const std::string *album_art_data) {
+    return storeSong(ctx, 0, metadata, album_art_directory, album_art_data);
+}
+
+/**
+ * @brief Rewrites an existing song from freshly read metadata, keeping its id.
+ *
+ * @details Used when the file of a song changed. Keeping the id keeps the
+ *          song in the playlists it belongs to. The album, contributing
+ *          artists and genres are resolved again, and the old ones are left
+ *          for the deleteUseless* functions to clean up.
+ *
+ * @param[in] ctx The scan context holding the database connection.
+ * @param[in] song_id The id of the song to rewrite.
+ * @param[in] metadata The new metadata of the song.
+ * @param[in] album_art_directory The directory where album art is saved.
+ * @param[in] album_art_data Image bytes already read from the file, or NULL
+ *                           to read them here only if the album needs art.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int updateSong(ScanContext &ctx, int song_id, Metadata &metadata, std::string &album_art_directory, const std::string *album_art_data) {
+    return storeSong(ctx, song_id, metadata, album_art_directory, album_art_data);
+}
+
+/**
+ * @brief Shared part of addSong and updateSong.
+ *
+ * @param[in] song_id The id of the song to rewrite, or 0 to add a new song.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int storeSong(ScanContext &ctx, int song_id, Metadata &metadata, std::string &album_art_directory, const std::string *album_art_data) {
     std::vector<int> album_artist_ids, contrib_artist_ids, genre_ids;
     bool error = false;
+    ScanStats &stats = ctx.progress->stats;
 
-    for (int i = 0; i < metadata.album_artists.size(); i++) {
-        int id = getEntityId(db, EntityType::Artist, metadata.album_artists[i]);
-        if (id != -1)
-            album_artist_ids.push_back(id);
-        else
-            error = true;
-    }
-    for (int i = 0; i < metadata.contributing_artists.size(); i++) {
-        int id = getEntityId(db, EntityType::Artist, metadata.contributing_artists[i]);
-        if (id != -1)
-            contrib_artist_ids.push_back(id);
-        else
-            error = true;
-    }
-    for (int i = 0; i < metadata.genres.size(); i++) {
-        int id = getEntityId(db, EntityType::Genre, metadata.genres[i]);
-        if (id != -1)
-            genre_ids.push_back(id);
-        else
-            error = true;
-    }
-
-    int album_id = getAlbumId(db, metadata.album, album_artist_ids);
+    int album_id;
+    {
+        StageTimer timer(stats, StageEntities);
+        for (int i = 0; i < metadata.album_artists.size(); i++) {
+            int id = getEntityId(ctx, EntityType::Artist, metadata.album_artists[i]);
+            if (id != -1)
+                album_artist_ids.push_back(id);
+            else
+                error = true;
+        }
+        for (int i = 0; i < metadata.contributing_artists.size(); i++) {
+            int id = getEntityId(ctx, EntityType::Artist, metadata.contributing_artists[i]);
+            if (id != -1)
+                contrib_artist_ids.push_back(id);
+            else
+                error = true;
+        }
+        for (int i = 0; i < metadata.genres.size(); i++) {
+            int id = getEntityId(ctx, EntityType::Genre, metadata.genres[i]);
+            if (id != -1)
+                genre_ids.push_back(id);
+            else
+                error = true;
+        }
+        album_id = getAlbumId(ctx, metadata.album, album_artist_ids);
+    }
     if (album_id == -1) {
-        log("Unable to add album %s\n", metadata.album.c_str());
+        logError("Unable to add album %s\n", metadata.album.data());
         return -1;
     }
-    if (!hasAlbumArt(db, album_id)) {
-        std::string image_location = getImage(metadata.file_location, album_art_directory);
+    if (!hasAlbumArt(ctx, album_id)) {
+        StageTimer timer(stats, StageArt);
+        std::string image_location = album_art_data != NULL
+                                         ? saveImage(*album_art_data, album_art_directory)
+                                         : getImage(metadata.file_location, album_art_directory);
         if (image_location != "")
-            addAlbumArt(db, album_id, image_location);
+            addAlbumArt(ctx, album_id, image_location);
     }
-    int song_id = addSongEntryToTable(
-        db,
-        metadata.title,
-        metadata.track_number,
-        metadata.disc_number,
-        album_id,
-        metadata.file_location);
-    if (song_id == -1) {
-        log("Unable to add song %s\n", metadata.file_location.c_str());
+
+    StageTimer timer(stats, StageInsert);
+    if (song_id == 0) {
+        song_id = addSongEntryToTable(
+            ctx,
+            metadata.title,
+            metadata.track_number,
+            metadata.disc_number,
+            album_id,
+            metadata.file_location,
+            metadata.fingerprint,
+            metadata.audio);
+        if (song_id == -1) {
+            logError("Unable to add song %s\n", metadata.file_location.c_str());
+            return -1;
+        }
+    } else if (updateSongEntryInTable(ctx, song_id, metadata.title, metadata.track_number, metadata.disc_number, album_id, metadata.file_location, metadata.fingerprint, metadata.audio) != 0) {
+        logError("Unable to update song %s\n", metadata.file_location.c_str());
         return -1;
     }
     for (auto item : contrib_artist_ids)
-        addContribArtistRelationship(db, song_id, item);
+        addContribArtistRelationship(ctx, song_id, item);
     for (auto item : genre_ids)
-        addSongGenreRelationship(db, song_id, item);
+        addSongGenreRelationship(ctx, song_id, item);
+    if (updateSongSearch(ctx, song_id, metadata) != 0) {
+        logError("Unable to index song %s for search\n", metadata.file_location.c_str());
+        return -1;
+    }
+    if (updateSongView(ctx, song_id) != 0) {
+        logError("Unable to update the song view of %s\n", metadata.file_location.c_str());
+        return -1;
+    }
+    // Albums, artists and genres are queued for the name indexes when they
+    // are created; the ones that already existed are in them.
+    if (ctx.track_completions && !error)
+        ctx.completions.push_back({CompleteSong, song_id, metadata.title});
 
     if (errno)
         return -2;
@@ -353,47 +541,131 @@ int addSong(sqlite3 *db, Metadata &metadata, std::string &album_art_directory) {
  * @brief Adds a song entry to the database.
  *
  * @details This function will create a new entry in the Songs table with the
- *          given title, track number, disc number, album id, and location.
+ *          given title, track number, disc number, album id, location, file
+ *          fingerprint and audio properties.
  *
- * @param[in] db The SQLite database to add the song entry to.
+ * @param[in] ctx The scan context holding the database to add the song entry to.
  * @param[in] title The title of the song.
  * @param[in] track_number The track number of the song.
  * @param[in] disc_number The disc number of the song.
  * @param[in] album_id The id of the album the song belongs to.
  * @param[in] location The file location of the song.
+ * @param[in] fingerprint The fingerprint of the file of the song.
+ * @param[in] audio The audio properties of the song.
  *
  * @return The id of the newly created song entry, or -1 on failure.
  */
 int addSongEntryToTable(
-    sqlite3 *db,
-    std::string title,
+    ScanContext &ctx,
+    const std::string &title,
     int track_number,
     int disc_number,
     int album_id,
-    std::string location) {
-    char *sql_stmt, *error_message;
-    int song_id;
+    const std::string &location,
+    const FileFingerprint &fingerprint,
+    const AudioInfo &audio) {
+    sqlite3_stmt *stmt = ctx.statements.get(InsertSong);
+    if (stmt == NULL)
+        return -1;
+    sqlite3_bind_text(stmt, 1, title.c_str(), title.size(), SQLITE_TRANSIENT);
+    sqlite3_bind_int(stmt, 2, track_number);
+    sqlite3_bind_int(stmt, 3, disc_number);
+    sqlite3_bind_int64(stmt, 4, album_id);
+    sqlite3_bind_text(stmt, 5, location.c_str(), location.size(), SQLITE_TRANSIENT);
+    bindFingerprint(stmt, 6, fingerprint);
+    bindAudioInfo(stmt, 9, audio);
+    if (stepStatement(stmt) != SQLITE_DONE) {
+        logError("Unable to insert song entry of %s : %s\n", location.c_str(), sqlite3_errmsg(ctx.db));
+        return -1;
+    }
 
-    sql_stmt = sqlite3_mprintf("INSERT INTO Songs (title, track_number, disc_number, album_id, location) VALUES (\"%s\", %d, %d, %d, \"%s\");", escapeDQ(title).c_str(), track_number, disc_number, album_id, escapeDQ(location).c_str());
-    int rc = sqlite3_exec(db, sql_stmt, NULL, NULL, &error_message);
-    if (rc != SQLITE_OK) {
-        log("Unable to insert song entry of %s : %s | query was %s\n", location.c_str(), error_message, sql_stmt);
-        sqlite3_free(error_message);
-        sqlite3_free(sql_stmt);
+    return sqlite3_last_insert_rowid(ctx.db);
+}
+
+/**
+ * @brief Overwrites a song entry and drops its artist and genre links, which
+ *        the caller adds again.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int updateSongEntryInTable(
+    ScanContext &ctx,
+    int song_id,
+    const std::string &title,
+    int track_number,
+    int disc_number,
+    int album_id,
+    const std::string &location,
+    const FileFingerprint &fingerprint,
+    const AudioInfo &audio) {
+    sqlite3_stmt *stmt = ctx.statements.get(UpdateSong);
+    if (stmt == NULL)
+        return -1;
+    sqlite3_bind_text(stmt, 1, title.c_str(), title.size(), SQLITE_TRANSIENT);
+    sqlite3_bind_int(stmt, 2, track_number);
+    sqlite3_bind_int(stmt, 3, disc_number);
+    sqlite3_bind_int64(stmt, 4, album_id);
+    sqlite3_bind_text(stmt, 5, location.c_str(), location.size(), SQLITE_TRANSIENT);
+    bindFingerprint(stmt, 6, fingerprint);
+    bindAudioInfo(stmt, 9, audio);
+    sqlite3_bind_int64(stmt, 14, song_id);
+    if (stepStatement(stmt) != SQLITE_DONE) {
+        logError("Unable to update song entry of %s : %s\n", location.c_str(), sqlite3_errmsg(ctx.db));
         return -1;
     }
-    sqlite3_free(sql_stmt);
 
-    sql_stmt = sqlite3_mprintf("SELECT id FROM Songs WHERE ROWID = %d;", sqlite3_last_insert_rowid(db));
-    rc = sqlite3_exec(db, sql_stmt, __getEntityIdInternalCallback, &song_id, &error_message);
-    if (rc != SQLITE_OK) {
-        log("Unable to find song id after insertion of %s : %s\n", location.c_str(), error_message);
-        sqlite3_free(error_message);
-        sqlite3_free(sql_stmt);
+    for (CachedStatement statement : {DeleteSongContributingArtists, DeleteSongGenres}) {
+        stmt = ctx.statements.get(statement);
+        if (stmt == NULL)
+            return -1;
+        sqlite3_bind_int64(stmt, 1, song_id);
+        if (stepStatement(stmt) != SQLITE_DONE) {
+            logError("Unable to clear links of song %s : %s\n", location.c_str(), sqlite3_errmsg(ctx.db));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Stores the fingerprint of a song whose file did not change, or
+ *        whose fingerprint was never recorded.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int updateSongFingerprint(ScanContext &ctx, int song_id, const FileFingerprint &fingerprint) {
+    sqlite3_stmt *stmt = ctx.statements.get(UpdateSongFingerprint);
+    if (stmt == NULL)
+        return -1;
+    sqlite3_bind_int64(stmt, 1, song_id);
+    bindFingerprint(stmt, 2, fingerprint);
+    if (stepStatement(stmt) != SQLITE_DONE) {
+        logError("Unable to update fingerprint of song %d : %s\n", song_id, sqlite3_errmsg(ctx.db));
         return -1;
     }
+    return 0;
+}
 
-    return song_id;
+/**
+ * @brief Binds size, mtime and inode of a fingerprint to three consecutive
+ *        parameters, starting at index.
+ */
+void bindFingerprint(sqlite3_stmt *stmt, int index, const FileFingerprint &fingerprint) {
+    sqlite3_bind_int64(stmt, index, fingerprint.size);
+    sqlite3_bind_int64(stmt, index + 1, fingerprint.mtime);
+    sqlite3_bind_int64(stmt, index + 2, (sqlite3_int64)fingerprint.inode);
+}
+
+/**
+ * @brief Binds duration, bitrate, sample rate, channels and bits per sample
+ *        to five consecutive parameters, starting at index.
+ */
+void bindAudioInfo(sqlite3_stmt *stmt, int index, const AudioInfo &audio) {
+    sqlite3_bind_int(stmt, index, audio.duration_ms);
+    sqlite3_bind_int(stmt, index + 1, audio.bitrate);
+    sqlite3_bind_int(stmt, index + 2, audio.sample_rate);
+    sqlite3_bind_int(stmt, index + 3, audio.channels);
+    sqlite3_bind_int(stmt, index + 4, audio.bits_per_sample);
 }
 
 /**
@@ -403,24 +675,22 @@ int addSongEntryToTable(
  *          the ContributingArtists table. This table is used to keep track of which
  *          songs an artist contributed to.
  *
- * @param[in] db The database to query.
+ * @param[in] ctx The scan context holding the database to query.
  * @param[in] song_id The id of the song to associate with the artist.
  * @param[in] artist_id The id of the artist to associate with the song.
  *
  * @return 0 on success, -1 on failure.
  */
-int addContribArtistRelationship(sqlite3 *db, int song_id, int artist_id) {
-    char *sql_stmt, *error_message;
-
-    sql_stmt = sqlite3_mprintf("INSERT INTO ContributingArtists(song_id, artist_id) VALUES (%d, %d);", song_id, artist_id);
-    int rc = sqlite3_exec(db, sql_stmt, NULL, NULL, &error_message);
-    if (rc != SQLITE_OK) {
-        log("Error while executing query to add contrib artist relationship: %s\n", error_message);
-        sqlite3_free(sql_stmt);
-        sqlite3_free(error_message);
+int addContribArtistRelationship(ScanContext &ctx, int song_id, int artist_id) {
+    sqlite3_stmt *stmt = ctx.statements.get(InsertContributingArtist);
+    if (stmt == NULL)
+        return -1;
+    sqlite3_bind_int64(stmt, 1, song_id);
+    sqlite3_bind_int64(stmt, 2, artist_id);
+    if (stepStatement(stmt) != SQLITE_DONE) {
+        logError("Error while executing query to add contrib artist relationship: %s\n", sqlite3_errmsg(ctx.db));
         return -1;
     }
-    sqlite3_free(sql_stmt);
     return 0;
 }
 
@@ -432,24 +702,22 @@ int addContribArtistRelationship(sqlite3 *db, int song_id, int artist_id) {
  *          song and genre. If the operation fails, it logs the error message
  *          and returns -1.
  *
- * @param[in] db A pointer to the SQLite database connection.
+ * @param[in] ctx The scan context holding the database connection.
  * @param[in] song_id The ID of the song to associate with the genre.
  * @param[in] genre_id The ID of the genre to associate with the song.
  *
  * @return 0 on success, -1 on failure.
  */
-int addSongGenreRelationship(sqlite3 *db, int song_id, int genre_id) {
-    char *sql_stmt, *error_message;
-
-    sql_stmt = sqlite3_mprintf("INSERT INTO SongGenreMap(song_id, genre_id) VALUES (%d, %d);", song_id, genre_id);
-    int rc = sqlite3_exec(db, sql_stmt, NULL, NULL, &error_message);
-    if (rc != SQLITE_OK) {
-        log("Error while executing query to add song genre relationship: %s\n", error_message);
-        sqlite3_free(sql_stmt);
-        sqlite3_free(error_message);
+int addSongGenreRelationship(ScanContext &ctx, int song_id, int genre_id) {
+    sqlite3_stmt *stmt = ctx.statements.get(InsertSongGenre);
+    if (stmt == NULL)
+        return -1;
+    sqlite3_bind_int64(stmt, 1, song_id);
+    sqlite3_bind_int64(stmt, 2, genre_id);
+    if (stepStatement(stmt) != SQLITE_DONE) {
+        logError("Error while executing query to add song genre relationship: %s\n", sqlite3_errmsg(ctx.db));
         return -1;
     }
-    sqlite3_free(sql_stmt);
     return 0;
 }
 
@@ -460,85 +728,379 @@ int addSongGenreRelationship(sqlite3 *db, int song_id, int genre_id) {
  *          specified id has an album art associated with it. It will return
  *          true if the album has an album art, and false otherwise.
  *
- * @param[in] db A pointer to the SQLite database connection.
+ * @param[in] ctx The scan context holding the database connection.
  * @param[in] album_id The id of the album to check.
  *
  * @return True if the album has an album art, false otherwise. Also true in case of error.
  */
-bool hasAlbumArt(sqlite3 *db, int album_id) {
-    char *sql_stmt, *error_message;
-    int answer = 0;
-    sql_stmt = sqlite3_mprintf("SELECT 1 FROM Albums WHERE album_art_location IS NOT NULL AND id = %d;", album_id);
-    int rc = sqlite3_exec(db, sql_stmt, &__getEntityIdInternalCallback, &answer, &error_message);
-    if (rc != SQLITE_OK) {
-        log("Error while executing query to check if album has art: %s\n", error_message);
-        sqlite3_free(sql_stmt);
-        sqlite3_free(error_message);
+bool hasAlbumArt(ScanContext &ctx, int album_id) {
+    sqlite3_stmt *stmt = ctx.statements.get(SelectAlbumHasArt);
+    if (stmt == NULL)
+        return true;
+    sqlite3_bind_int64(stmt, 1, album_id);
+    sqlite3_int64 answer;
+    int rc = stepForId(stmt, answer);
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+        logError("Error while executing query to check if album has art: %s\n", sqlite3_errmsg(ctx.db));
         return true;
     }
-    sqlite3_free(sql_stmt);
     return answer == 1;
 }
 
+/**
+ * @brief Lists the albums that have album art, by makeAlbumNameKey.
+ *
+ * @param[in] db The database to read.
+ * @param[out] album_name_keys Receives the keys.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int getAlbumsWithArt(sqlite3 *db, std::unordered_set<std::string> &album_name_keys) {
+    sqlite3_stmt *stmt;
+    const char *sql =
+        "SELECT A.id, A.title, AR.name FROM Albums A "
+        "LEFT JOIN AlbumArtists AA ON AA.album_id = A.id LEFT JOIN Artists AR ON AR.id = AA.artist_id "
+        "WHERE A.album_art_location IS NOT NULL ORDER BY A.id;";
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        logError("Error while preparing query to get albums with art: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    sqlite3_int64 album_id = 0;
+    std::string title;
+    std::vector<std::string> artists;
+    auto addKey = [&] {
+        std::vector<std::string_view> names(artists.begin(), artists.end());
+        album_name_keys.insert(makeAlbumNameKey(title, NameList(names.data(), names.size())));
+    };
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (sqlite3_column_int64(stmt, 0) != album_id) {
+            if (album_id != 0)
+                addKey();
+            album_id = sqlite3_column_int64(stmt, 0);
+            title = sqlite3_column_type(stmt, 1) != SQLITE_NULL ? (const char *)sqlite3_column_text(stmt, 1) : "";
+            artists.clear();
+        }
+        if (sqlite3_column_type(stmt, 2) != SQLITE_NULL)
+            artists.push_back((const char *)sqlite3_column_text(stmt, 2));
+    }
+    if (album_id != 0)
+        addKey();
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        logError("Error while executing query to get albums with art: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    return 0;
+}
+
 /**
  * @brief Adds an album art location to the database.
  *
  * @details This function will add the location of an album art to the database
  *          for the album with the given id.
  *
- * @param[in] db A pointer to the SQLite database connection.
+ * @param[in] ctx The scan context holding the database connection.
  * @param[in] album_id The id of the album to add the album art to.
  * @param[in] album_art_location The location of the album art. (this is just the filename)
  *
  * @return 0 on success, -1 on failure.
  */
-int addAlbumArt(sqlite3 *db, int album_id, std::string album_art_location) {
-    char *sql_stmt, *error_message;
-    sql_stmt = sqlite3_mprintf("UPDATE Albums SET album_art_location = \"%s\" WHERE id = %d;", album_art_location.c_str(), album_id);
-    int rc = sqlite3_exec(db, sql_stmt, NULL, NULL, &error_message);
-    if (rc != SQLITE_OK) {
-        log("Error while executing query to add album art: %s\n", error_message);
-        sqlite3_free(sql_stmt);
-        sqlite3_free(error_message);
+int addAlbumArt(ScanContext &ctx, int album_id, const std::string &album_art_location) {
+    sqlite3_stmt *stmt = ctx.statements.get(UpdateAlbumArt);
+    if (stmt == NULL)
+        return -1;
+    sqlite3_bind_int64(stmt, 1, album_id);
+    sqlite3_bind_text(stmt, 2, album_art_location.c_str(), album_art_location.size(), SQLITE_TRANSIENT);
+    if (stepStatement(stmt) != SQLITE_DONE) {
+        logError("Error while executing query to add album art: %s\n", sqlite3_errmsg(ctx.db));
+        return -1;
+    }
+
+    stmt = ctx.statements.get(UpdateSongViewAlbumArt);
+    if (stmt == NULL)
+        return -1;
+    sqlite3_bind_int64(stmt, 1, album_id);
+    sqlite3_bind_text(stmt, 2, album_art_location.c_str(), album_art_location.size(), SQLITE_TRANSIENT);
+    if (stepStatement(stmt) != SQLITE_DONE) {
+        logError("Error while executing query to add album art to the song view: %s\n", sqlite3_errmsg(ctx.db));
         return -1;
     }
-    sqlite3_free(sql_stmt);
     return 0;
 }
 
-std::unordered_set<std::filesystem::path> getFileLocations(sqlite3 *db) {
-    std::unordered_set<std::filesystem::path> result;
-    char *sql_stmt, *error_message;
-    sql_stmt = sqlite3_mprintf("SELECT location FROM Songs;");
-    int rc = sqlite3_exec(db, sql_stmt, &__getFilesCallback, &result, &error_message);
-    if (rc != SQLITE_OK) {
-        log("Error while executing query to get files: %s\n", error_message);
-        sqlite3_free(sql_stmt);
-        sqlite3_free(error_message);
-        return {};
+/**
+ * @brief Writes the SongSearch row of a song, replacing any previous one.
+ *
+ * @details Album and contributing artists go into the same column, so that
+ *          searching for an artist finds their songs either way.
+ *
+ * @param[in] ctx The scan context holding the database.
+ * @param[in] song_id The id of the song.
+ * @param[in] metadata The metadata the song was stored from.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int updateSongSearch(ScanContext &ctx, int song_id, const Metadata &metadata) {
+    sqlite3_stmt *stmt = ctx.statements.get(DeleteSongSearch);
+    if (stmt == NULL)
+        return -1;
+    sqlite3_bind_int(stmt, 1, song_id);
+    if (stepStatement(stmt) != SQLITE_DONE) {
+        logError("Error while executing query to delete song from search: %s\n", sqlite3_errmsg(ctx.db));
+        return -1;
+    }
+
+    std::vector<std::string_view> artist_names(metadata.album_artists.begin(), metadata.album_artists.end());
+    for (std::string_view artist : metadata.contributing_artists) {
+        if (std::find(artist_names.begin(), artist_names.end(), artist) == artist_names.end())
+            artist_names.push_back(artist);
+    }
+    std::string artists, genres;
+    for (std::string_view artist : artist_names)
+        (artists += artists.empty() ? "" : ", ") += artist;
+    for (std::string_view genre : metadata.genres)
+        (genres += genres.empty() ? "" : ", ") += genre;
+
+    stmt = ctx.statements.get(InsertSongSearch);
+    if (stmt == NULL)
+        return -1;
+    sqlite3_bind_int(stmt, 1, song_id);
+    sqlite3_bind_text(stmt, 2, metadata.title.c_str(), metadata.title.size(), SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 3, metadata.album.data(), metadata.album.size(), SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 4, artists.c_str(), artists.size(), SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 5, genres.c_str(), genres.size(), SQLITE_TRANSIENT);
+    if (stepStatement(stmt) != SQLITE_DONE) {
+        logError("Error while executing query to index song for search: %s\n", sqlite3_errmsg(ctx.db));
+        return -1;
     }
-    sqlite3_free(sql_stmt);
-    return result;
+    return 0;
 }
 
-int __getFilesCallback(void *data, int argc, char **argv, char **colnames) {
-    std::unordered_set<std::filesystem::path> *ptr = (std::unordered_set<std::filesystem::path> *)data;
-    if (argc > 0)
-        ptr->insert(std::filesystem::path(std::string(argv[0])));
+/**
+ * @brief Writes the SongView row of a song from the normalized tables,
+ *        replacing any previous one.
+ *
+ * @details Called once the song, its album and its artist links are stored.
+ *          Rows go away with their song through ON DELETE CASCADE, and
+ *          addAlbumArt updates the rows of an album whose art it sets. The
+ *          artists of an album never change once it exists, since they are
+ *          part of its album key.
+ *
+ * @param[in] ctx The scan context holding the database.
+ * @param[in] song_id The id of the song.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int updateSongView(ScanContext &ctx, int song_id) {
+    sqlite3_stmt *stmt = ctx.statements.get(ReplaceSongView);
+    if (stmt == NULL)
+        return -1;
+    sqlite3_bind_int(stmt, 1, song_id);
+    if (stepStatement(stmt) != SQLITE_DONE) {
+        logError("Error while executing query to update the song view: %s\n", sqlite3_errmsg(ctx.db));
+        return -1;
+    }
     return 0;
 }
 
-int deleteSongByLocation(sqlite3 *db, const std::string &location) {
-    char *sql_stmt, *error_message;
-    sql_stmt = sqlite3_mprintf("DELETE FROM Songs WHERE location = \"%s\";", escapeDQ(location).c_str());
-    int rc = sqlite3_exec(db, sql_stmt, NULL, NULL, &error_message);
-    if (rc != SQLITE_OK) {
-        log("Error while executing query to delete song: %s\n", error_message);
-        sqlite3_free(sql_stmt);
-        sqlite3_free(error_message);
+/**
+ * @brief Counts the SongView rows that differ from what the normalized tables
+ *        say, counting missing, stale and extra rows.
+ *
+ * @param[in] db The database to check.
+ *
+ * @return The number of differing rows, or -1 on failure.
+ */
+int countSongViewMismatches(sqlite3 *db) {
+    const char *sql_stmt =
+        "SELECT (SELECT COUNT(*) FROM (SELECT * FROM SongView EXCEPT " SELECT_SONG_VIEW ")) + "
+        "(SELECT COUNT(*) FROM (" SELECT_SONG_VIEW " EXCEPT SELECT * FROM SongView));";
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, sql_stmt, -1, &stmt, NULL) != SQLITE_OK) {
+        logError("Error while preparing statement %s: %s\n", sql_stmt, sqlite3_errmsg(db));
+        return -1;
+    }
+    int mismatches = -1;
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        mismatches = sqlite3_column_int(stmt, 0);
+    else
+        logError("Error while checking the song view: %s\n", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+    return mismatches;
+}
+
+/**
+ * @brief Refills SongView from the normalized tables, creating it and its
+ *        indexes if needed. Also migration 6.
+ *
+ * @details SongView holds one row per song with the strings the frontend
+ *          displays already joined, so that song lists read one table instead
+ *          of joining five and running GROUP_CONCAT on every read.
+ *
+ * @param[in] db The database to rebuild the view of.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int rebuildSongView(sqlite3 *db) {
+    const char *k_steps[] = {
+        "DROP TABLE IF EXISTS SongView;",
+        CREATE_SONG_VIEW,
+        "CREATE INDEX SongViewByAlbum ON SongView (album_id, disc_number, track_number);",
+        "CREATE INDEX SongViewByTitle ON SongView (title);",
+        "INSERT INTO SongView " SELECT_SONG_VIEW ";"};
+
+    for (const char *sql_stmt : k_steps) {
+        if (execStatement(db, sql_stmt) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Checks that SongView agrees with the normalized tables, and
+ *        optionally rebuilds it.
+ *
+ * @param[in] db_path The path to the database file.
+ * @param[in] repair If non-zero, SongView is rebuilt when it differs.
+ *
+ * @return The number of rows that differed, or -1 on failure.
+ */
+int checkSongView(const char *db_path, int repair) {
+    sqlite3 *db;
+    if (sqlite3_open(db_path, &db) != SQLITE_OK) {
+        logError("Can't open database %s: %s\n", db_path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return -1;
+    }
+    sqlite3_busy_timeout(db, 5000);
+
+    int mismatches = countSongViewMismatches(db);
+    if (mismatches > 0 && repair) {
+        log("Rebuilding the song view of %s, %d rows differed.\n", db_path, mismatches);
+        beginTransaction(db);
+        if (rebuildSongView(db) != 0 || commitTransaction(db) != 0) {
+            rollbackTransaction(db);
+            mismatches = -1;
+        }
+    }
+    sqlite3_close(db);
+    return mismatches;
+}
+
+/**
+ * @brief Reads the id and file fingerprint of every song, keyed by location.
+ *
+ * @param[in] ctx The scan context holding the database.
+ * @param[out] songs The songs found. Songs scanned before fingerprints existed
+ *                   have has_fingerprint set to false.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int getSongFingerprints(ScanContext &ctx, std::unordered_map<std::string, StoredSong> &songs) {
+    sqlite3_stmt *stmt = ctx.statements.get(SelectSongFingerprints);
+    if (stmt == NULL)
+        return -1;
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char *location = (const char *)sqlite3_column_text(stmt, 1);
+        if (location == NULL)
+            continue;
+        StoredSong &song = songs[std::string(location, sqlite3_column_bytes(stmt, 1))];
+        song.id = sqlite3_column_int64(stmt, 0);
+        song.has_fingerprint = sqlite3_column_type(stmt, 2) != SQLITE_NULL;
+        song.fingerprint.size = sqlite3_column_int64(stmt, 2);
+        song.fingerprint.mtime = sqlite3_column_int64(stmt, 3);
+        song.fingerprint.inode = sqlite3_column_int64(stmt, 4);
+        song.has_audio_properties = sqlite3_column_int(stmt, 5) != 0;
+    }
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_DONE) {
+        logError("Error while executing query to get files: %s\n", sqlite3_errmsg(ctx.db));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads the id and file fingerprint of the song at a location.
+ *
+ * @param[in] ctx The scan context holding the database.
+ * @param[in] location The location of the song's file.
+ * @param[out] song The song found. Its id is left at 0 if there is none.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int getSongByLocation(ScanContext &ctx, const std::string &location, StoredSong &song) {
+    sqlite3_stmt *stmt = ctx.statements.get(SelectSongByLocation);
+    if (stmt == NULL)
+        return -1;
+    sqlite3_bind_text(stmt, 1, location.c_str(), location.size(), SQLITE_TRANSIENT);
+    int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) {
+        song.id = sqlite3_column_int64(stmt, 0);
+        song.has_fingerprint = sqlite3_column_type(stmt, 1) != SQLITE_NULL;
+        song.fingerprint.size = sqlite3_column_int64(stmt, 1);
+        song.fingerprint.mtime = sqlite3_column_int64(stmt, 2);
+        song.fingerprint.inode = sqlite3_column_int64(stmt, 3);
+        song.has_audio_properties = sqlite3_column_int(stmt, 4) != 0;
+    }
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+        logError("Error while executing query to get song: %s\n", sqlite3_errmsg(ctx.db));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Lists the locations of all songs below a directory.
+ *
+ * @details Uses a range on the location index rather than LIKE, so that '%'
+ *          and '_' in directory names need no escaping.
+ *
+ * @param[in] ctx The scan context holding the database.
+ * @param[in] directory The directory, without a trailing separator.
+ * @param[out] locations The locations found are appended here.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int getSongLocationsUnder(ScanContext &ctx, const std::string &directory, std::vector<std::string> &locations) {
+    sqlite3_stmt *stmt = ctx.statements.get(SelectSongLocationsInRange);
+    if (stmt == NULL)
+        return -1;
+    std::string low = directory + '/', high = directory + (char)('/' + 1);
+    sqlite3_bind_text(stmt, 1, low.c_str(), low.size(), SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 2, high.c_str(), high.size(), SQLITE_TRANSIENT);
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+        locations.emplace_back((const char *)sqlite3_column_text(stmt, 0), sqlite3_column_bytes(stmt, 0));
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_DONE) {
+        logError("Error while executing query to get songs in %s: %s\n", directory.c_str(), sqlite3_errmsg(ctx.db));
+        return -1;
+    }
+    return 0;
+}
+
+int deleteSongByLocation(ScanContext &ctx, const std::string &location) {
+    sqlite3_stmt *stmt = ctx.statements.get(DeleteSongSearchByLocation);
+    if (stmt == NULL)
+        return -1;
+    sqlite3_bind_text(stmt, 1, location.c_str(), location.size(), SQLITE_TRANSIENT);
+    if (stepStatement(stmt) != SQLITE_DONE) {
+        logError("Error while executing query to delete song from search: %s\n", sqlite3_errmsg(ctx.db));
+        return -1;
+    }
+
+    stmt = ctx.statements.get(DeleteSongByLocation);
+    if (stmt == NULL)
+        return -1;
+    sqlite3_bind_text(stmt, 1, location.c_str(), location.size(), SQLITE_TRANSIENT);
+    if (stepStatement(stmt) != SQLITE_DONE) {
+        logError("Error while executing query to delete song: %s\n", sqlite3_errmsg(ctx.db));
         return -1;
     }
-    sqlite3_free(sql_stmt);
     return 0;
 }
 
@@ -551,7 +1113,7 @@ int deleteUselessAlbums(sqlite3 *db) {
             NULL,
             NULL,
             &error_message) != SQLITE_OK) {
-        log("Error while executing query to delete useless albums: %s\n", error_message);
+        logError("Error while executing query to delete useless albums: %s\n", error_message);
         sqlite3_free(error_message);
         return -1;
     }
@@ -568,7 +1130,7 @@ int deleteUselessArtists(sqlite3 *db) {
             NULL,
             NULL,
             &error_message) != SQLITE_OK) {
-        log("Error while executing query to delete useless artists: %s\n", error_message);
+        logError("Error while executing query to delete useless artists: %s\n", error_message);
         sqlite3_free(error_message);
         return -1;
     }
@@ -585,7 +1147,7 @@ int deleteUselessGenres(sqlite3 *db) {
             NULL,
             NULL,
             &error_message) != SQLITE_OK) {
-        log("Error while executing query to delete useless genres: %s\n", error_message);
+        logError("Error while executing query to delete useless genres: %s\n", error_message);
         sqlite3_free(error_message);
         return -1;
     }
@@ -593,38 +1155,76 @@ int deleteUselessGenres(sqlite3 *db) {
     return 0;
 }
 
+/**
+ * @brief Deletes album art files that no album refers to.
+ *
+ * @details Forgets the ArtBlobs entries whose count dropped to 0, along with
+ *          the thumbnails of those that were album art, then
+ *          removes every file of the art directory that has the shape of a
+ *          file the scanner writes (see isStoredArtName) and is not in
+ *          ArtBlobs. That also sweeps files left behind by an interrupted
+ *          run. Other files are left alone. Packed art is collected by the
+ *          pack, which compacts itself once it is mostly dead.
+ *
+ *          Must be called with no scan writing to the database, outside of
+ *          any transaction: a file saved by a transaction that is still open
+ *          is not counted yet and would be deleted.
+ *
+ * @param[in] db The database the art belongs to.
+ * @param[in] album_art_directory The album art directory.
+ *
+ * @return 0 on success, -1 on failure.
+ */
 int deleteUselessAlbumArt(sqlite3 *db, std::string &album_art_directory) {
     std::list<std::string> album_art_locations;
     char *error_message;
 
-    if (sqlite3_exec(db, "SELECT album_art_location FROM Albums;", &__getAlbumArtLocationsCallback, &album_art_locations, &error_message) != SQLITE_OK) {
-        log("Error while executing query to get album art locations: %s\n", error_message);
-        sqlite3_free(error_message);
+    // Forgetting a piece of art releases its thumbnails, which are forgotten
+    // on the next round.
+    beginTransaction(db);
+    int forgotten;
+    do {
+        if (execStatement(db, "DELETE FROM ArtBlobs WHERE ref_count <= 0;") != 0) {
+            rollbackTransaction(db);
+            return -1;
+        }
+        forgotten = sqlite3_changes(db);
+    } while (forgotten > 0);
+    if (sqlite3_exec(db, "SELECT location FROM ArtBlobs;", &__getAlbumArtLocationsCallback, &album_art_locations, &error_message) != SQLITE_OK) {
+        logError("Error while executing query to get album art locations: %s\n", sqlite3_errmsg(db));
+        rollbackTransaction(db);
         return -1;
     }
-
-    std::unordered_set<std::filesystem::path> required_files;
-
-    for (auto &item : album_art_locations)
-        required_files.insert(std::filesystem::path(album_art_directory) / std::filesystem::path(item));
-
-    std::list<std::string> current_files = getFiles(album_art_directory);
-
-    for (std::list<std::string>::iterator it = current_files.begin(); it != current_files.end();) {
-        std::filesystem::path current_file = std::filesystem::path(*it);
-        if (required_files.find(current_file) != required_files.end())
-            it = current_files.erase(it);
-        else
-            ++it;
+    if (commitTransaction(db) != 0) {
+        rollbackTransaction(db);
+        return -1;
     }
 
-    for (std::string location : current_files) {
-        std::remove(
-            (std::filesystem::path(album_art_directory) / std::filesystem::path(location))
-                .generic_u8string()
-                .c_str());
+    std::unordered_set<std::string> required_files(album_art_locations.begin(), album_art_locations.end());
+    std::filesystem::path root = std::filesystem::u8path(album_art_directory);
+    int removed = 0;
+    for (const std::string &file : getFiles(album_art_directory)) {
+        std::string location = std::filesystem::u8path(file).lexically_relative(root).generic_u8string();
+        if (!isStoredArtName(location) || required_files.count(location) > 0)
+            continue;
+        std::error_code error;
+        if (std::filesystem::remove(std::filesystem::u8path(file), error))
+            removed++;
+        if (location.find('/') != std::string::npos)
+            std::filesystem::remove(std::filesystem::u8path(file).parent_path(), error);  // only if the shard is now empty
     }
+    if (removed > 0)
+        log("Deleted %d unused album art files.\n", removed);
 
+    if (ArtPack *pack = getArtPack(album_art_directory, false)) {
+        std::unordered_set<std::string> packed;
+        for (const std::string &location : album_art_locations) {
+            if (location.compare(0, strlen(ART_PACK_PREFIX), ART_PACK_PREFIX) == 0)
+                packed.insert(location.substr(strlen(ART_PACK_PREFIX)));
+        }
+        if (pack->collect(packed) != 0)
+            return -1;
+    }
     return 0;
 }
 
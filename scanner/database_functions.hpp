@@ -1,53 +1,127 @@
+#pragma once
+
 #include <sqlite3.h>
 
+#include <filesystem>
 #include <list>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#include "entity_cache.hpp"
+#include "scan_progress.hpp"
+#include "statement_cache.hpp"
 #include "tag_functions.hpp"
+#include "trie.hpp"
 
 #define CREATE_ALBUMS "CREATE TABLE Albums ( id INTEGER PRIMARY KEY, title VARCHAR(512), release_year INT );"
 #define CREATE_SONGS "CREATE TABLE Songs ( id INTEGER PRIMARY KEY, title VARCHAR(512), track_number INT, disc_number INT, album_id INT, rating SMALLINT DEFAULT -1, location VARCHAR(1024), FOREIGN KEY (album_id) REFERENCES Albums(id) );"
 #define CREATE_ARTISTS "CREATE TABLE Artists ( id INTEGER PRIMARY KEY, artist_name VARCHAR(256), about VARCHAR(10240) );"
 #define CREATE_CONTRIBUTING_ARTISTS "CREATE TABLE ContributingArtists ( song_id INT NOT NULL, artist_id INT NOT NULL, PRIMARY KEY (song_id, artist_id), FOREIGN KEY (song_id) REFERENCES Songs(id), FOREIGN KEY (artist_id) REFERENCES Artists(id) );"
 #define CREATE_ALBUM_ARTISTS "CREATE TABLE AlbumArtists ( album_id INT NOT NULL, artist_id INT NOT NULL, PRIMARY KEY (album_id, artist_id), FOREIGN KEY (album_id) REFERENCES Albums(id), FOREIGN KEY (artist_id) REFERENCES Artists(id) );"
+#define CREATE_SONG_SEARCH "CREATE VIRTUAL TABLE SongSearch USING fts5 ( title, album, artists, genres, tokenize = 'unicode61 remove_diacritics 2', prefix = '2 3' );"
+#define CREATE_SONG_VIEW "CREATE TABLE SongView ( id INTEGER PRIMARY KEY, title VARCHAR(512), track_number INTEGER, disc_number INTEGER, album_id INTEGER, album VARCHAR(512), album_artist VARCHAR(2048), contributing_artists VARCHAR(2048), location VARCHAR(2048), album_art_location VARCHAR(2048), FOREIGN KEY (id) REFERENCES Songs(id) ON DELETE CASCADE );"
 
-enum EntityType {
-    Album,
-    Artist,
-    Genre
-};
+// The SongView rows as computed from the normalized tables, in SongView column order.
+#define SELECT_SONG_VIEW \
+    "SELECT S.id, S.title, S.track_number, S.disc_number, S.album_id, A.title, " \
+    "(SELECT GROUP_CONCAT(name, ', ') FROM (SELECT R.name FROM AlbumArtists AA, Artists R WHERE AA.album_id = S.album_id AND R.id = AA.artist_id ORDER BY R.id)), " \
+    "(SELECT GROUP_CONCAT(name, ', ') FROM (SELECT R.name FROM ContributingArtists CA, Artists R WHERE CA.song_id = S.id AND R.id = CA.artist_id ORDER BY R.id)), " \
+    "S.location, A.album_art_location " \
+    "FROM Songs S LEFT JOIN Albums A ON A.id = S.album_id"
 
 extern "C" __attribute__((visibility("default"))) __attribute__((used)) int createDatabase(const char *db_path);
 
 int createTables(sqlite3 *db);
-int getEntityId(sqlite3 *db, EntityType entity_type, const std::string &artist_name);
-int __getEntityIdInternalCallback(void *id, int argc, char **argv, char **column_names);
 
-int getAlbumId(sqlite3 *db, const std::string &album_name, std::vector<int> &artist_ids);
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) int checkSongView(const char *db_path, int repair);
+
+int execStatement(sqlite3 *db, const char *sql_stmt);
+int beginTransaction(sqlite3 *db);
+int commitTransaction(sqlite3 *db);
+int rollbackTransaction(sqlite3 *db);
+
+/**
+ * @brief A song as found in the database at the start of a scan.
+ */
+struct StoredSong {
+    int id = 0;
+    bool has_fingerprint = false;
+    bool has_audio_properties = false;  // false for songs scanned before they were stored
+    FileFingerprint fingerprint;
+    bool seen = false;  // set once the scan finds its file
+};
+
+/**
+ * @brief A database connection together with the state kept for it during
+ *        one update() run.
+ */
+struct ScanContext {
+    explicit ScanContext(sqlite3 *db, ScanProgress *progress = NULL)
+        : db(db), statements(db), progress(progress != NULL ? progress : &local_progress) {}
+
+    sqlite3 *db;
+    StatementCache statements;
+    EntityCache entities;
+    ScanProgress local_progress;  // used when the caller does not follow the scan
+    ScanProgress *progress;
+    bool track_completions = false;           // whether an in-memory name index follows this database
+    std::vector<CompletionItem> completions;  // names stored since the last commit
+};
+
+int commitScanTransaction(ScanContext &ctx);
+int rollbackScanTransaction(ScanContext &ctx);
+
+int getEntityId(ScanContext &ctx, EntityType entity_type, std::string_view entity_name);
+
+int getAlbumId(ScanContext &ctx, std::string_view album_name, std::vector<int> &artist_ids);
+
+int ensureAlbumKeys(sqlite3 *db);
+
+int addAlbumArtistRelationship(ScanContext &ctx, int album_id, int artist_id);
+
+int addSong(ScanContext &ctx, Metadata &metadata, std::string &album_art_directory, const std::string *album_art_data = NULL);
+
+int updateSong(ScanContext &ctx, int song_id, Metadata &metadata, std::string &album_art_directory, const std::string *album_art_data = NULL);
+
+int storeSong(ScanContext &ctx, int song_id, Metadata &metadata, std::string &album_art_directory, const std::string *album_art_data);
+
+int addSongEntryToTable(ScanContext &ctx, const std::string &title, int track_number, int disc_number, int album_id, const std::string &location, const FileFingerprint &fingerprint, const AudioInfo &audio);
+
+int updateSongEntryInTable(ScanContext &ctx, int song_id, const std::string &title, int track_number, int disc_number, int album_id, const std::string &location, const FileFingerprint &fingerprint, const AudioInfo &audio);
+
+int updateSongSearch(ScanContext &ctx, int song_id, const Metadata &metadata);
+
+int updateSongView(ScanContext &ctx, int song_id);
+
+int countSongViewMismatches(sqlite3 *db);
+
+int rebuildSongView(sqlite3 *db);
 
-std::string stringifyIntVector(std::vector<int> &vec);
+int updateSongFingerprint(ScanContext &ctx, int song_id, const FileFingerprint &fingerprint);
 
-int addAlbumArtistRelationship(sqlite3 *db, int album_id, int artist_id);
+void bindFingerprint(sqlite3_stmt *stmt, int index, const FileFingerprint &fingerprint);
+void bindAudioInfo(sqlite3_stmt *stmt, int index, const AudioInfo &audio);
 
-int addSong(sqlite3 *db, Metadata &metadata, std::string &album_art_location);
+int addContribArtistRelationship(ScanContext &ctx, int song_id, int artist_id);
 
-int addSongEntryToTable(sqlite3 *db, std::string title, int track_number, int disc_number, int album_id, std::string location);
+int addSongGenreRelationship(ScanContext &ctx, int song_id, int genre_id);
 
-int addContribArtistRelationship(sqlite3 *db, int song_id, int artist_id);
+bool hasAlbumArt(ScanContext &ctx, int album_id);
 
-int addSongGenreRelationship(sqlite3 *db, int song_id, int genre_id);
+int getAlbumsWithArt(sqlite3 *db, std::unordered_set<std::string> &album_name_keys);
 
-bool hasAlbumArt(sqlite3 *db, int album_id);
+int addAlbumArt(ScanContext &ctx, int album_id, const std::string &album_art_location);
 
-int addAlbumArt(sqlite3 *db, int album_id, std::string album_art_location);
+int getSongFingerprints(ScanContext &ctx, std::unordered_map<std::string, StoredSong> &songs);
 
-std::unordered_set<std::filesystem::path> getFileLocations(sqlite3 *db);
+int getSongByLocation(ScanContext &ctx, const std::string &location, StoredSong &song);
 
-int __getFilesCallback(void *data, int argc, char **argv, char **colnames);
+int getSongLocationsUnder(ScanContext &ctx, const std::string &directory, std::vector<std::string> &locations);
 
-int deleteSongByLocation(sqlite3 *db, const std::string &location);
+int deleteSongByLocation(ScanContext &ctx, const std::string &location);
 
 int deleteUselessAlbums(sqlite3 *db);
 
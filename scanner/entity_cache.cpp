@@ -0,0 +1,167 @@
+#include "entity_cache.hpp"
+
+#include <algorithm>
+
+#include "misc.hpp"
+
+/**
+ * @brief Builds the key that identifies an album: its title plus the sorted,
+ *        de-duplicated ids of its album artists.
+ *
+ * @details For example, "Abbey Road" by artists 7 and 3 has the key
+ *          "Abbey Road\x1f" "3,7". The key is stored in Albums.album_key, so that
+ *          finding an album is a single indexed lookup.
+ *
+ * @param[in] album_title The title of the album.
+ * @param[in] artist_ids The ids of the album artists, in any order.
+ *
+ * @return The album key.
+ */
+std::string makeAlbumKey(std::string_view album_title, const std::vector<int> &artist_ids) {
+    std::vector<int> ids(artist_ids);
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+    std::string key(album_title);
+    key += '\x1f';
+    for (size_t i = 0; i < ids.size(); i++) {
+        if (i > 0)
+            key += ',';
+        key += std::to_string(ids[i]);
+    }
+    return key;
+}
+
+/**
+ * @brief Builds a key like makeAlbumKey's from the names of the album
+ *        artists instead of their ids, for code that has not looked the
+ *        artists up, such as the scanner's worker threads.
+ *
+ * @param[in] album_title The title of the album.
+ * @param[in] artist_names The names of the album artists, in any order.
+ *
+ * @return The album key.
+ */
+std::string makeAlbumNameKey(std::string_view album_title, const NameList &artist_names) {
+    std::vector<std::string_view> names(artist_names.begin(), artist_names.end());
+    std::sort(names.begin(), names.end());
+    names.erase(std::unique(names.begin(), names.end()), names.end());
+
+    std::string key(album_title);
+    key += '\x1f';
+    for (size_t i = 0; i < names.size(); i++) {
+        if (i > 0)
+            key += '\x1e';
+        key += names[i];
+    }
+    return key;
+}
+
+/**
+ * @brief Fills the cache from the Artists, Genres and Albums tables.
+ *
+ * @details When names repeat within a table, the lowest id wins, which is the
+ *          row a SELECT by name would have returned.
+ *
+ * @param[in] db The database to read from.
+ *
+ * @return 0 on success, -1 on failure. On failure the cache stays unloaded.
+ */
+int EntityCache::load(sqlite3 *db) {
+    const char *k_load[] = {
+        "SELECT title, id FROM Albums ORDER BY id;",
+        "SELECT name, id FROM Artists ORDER BY id;",
+        "SELECT name, id FROM Genres ORDER BY id;",
+        "SELECT album_key, id FROM Albums WHERE album_key IS NOT NULL ORDER BY id;"};
+
+    clear();
+    for (int i = 0; i < 4; i++) {
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, k_load[i], -1, &stmt, NULL) != SQLITE_OK) {
+            logError("Error while preparing entity cache query %s: %s\n", k_load[i], sqlite3_errmsg(db));
+            clear();
+            return -1;
+        }
+        int rc;
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            const char *name = (const char *)sqlite3_column_text(stmt, 0);
+            if (name != NULL)
+                names[i].emplace(storage->intern(std::string_view(name, sqlite3_column_bytes(stmt, 0))), sqlite3_column_int64(stmt, 1));
+        }
+        sqlite3_finalize(stmt);
+        if (rc != SQLITE_DONE) {
+            logError("Error while loading entity cache: %s\n", sqlite3_errmsg(db));
+            clear();
+            return -1;
+        }
+    }
+    loaded = true;
+    return 0;
+}
+
+void EntityCache::clear() {
+    for (auto &map : names)
+        map.clear();
+    pending.clear();
+    storage.reset(new StringPool());
+    loaded = false;
+}
+
+/**
+ * @brief Looks up the id of an entity by name.
+ *
+ * @return The id, or 0 if the name is not cached.
+ */
+int EntityCache::find(EntityType entity_type, std::string_view entity_name) const {
+    auto it = names[entity_type].find(entity_name);
+    return it == names[entity_type].end() ? 0 : it->second;
+}
+
+/**
+ * @brief Records a row that was just inserted in the open transaction.
+ */
+void EntityCache::insert(EntityType entity_type, std::string_view entity_name, int entity_id) {
+    insertIntoSlot(entity_type, entity_name, entity_id);
+}
+
+/**
+ * @brief Looks up the id of an album by its album key.
+ *
+ * @return The id, or 0 if the key is not cached.
+ */
+int EntityCache::findAlbum(std::string_view album_key) const {
+    auto it = names[k_album_key_slot].find(album_key);
+    return it == names[k_album_key_slot].end() ? 0 : it->second;
+}
+
+/**
+ * @brief Records an album that was just inserted in the open transaction.
+ */
+void EntityCache::insertAlbum(std::string_view album_key, int album_id) {
+    insertIntoSlot(k_album_key_slot, album_key, album_id);
+}
+
+void EntityCache::insertIntoSlot(int slot, std::string_view key, int id) {
+    if (!loaded || names[slot].count(key) > 0)
+        return;
+    key = storage->intern(key);
+    names[slot].emplace(key, id);
+    pending.emplace_back(slot, key);
+}
+
+/**
+ * @brief Keeps the names inserted since the last commit or rollback.
+ */
+void EntityCache::commit() {
+    pending.clear();
+}
+
+/**
+ * @brief Forgets the names inserted since the last commit or rollback, since
+ *        their rows no longer exist.
+ */
+void EntityCache::rollback() {
+    for (auto &item : pending)
+        names[item.first].erase(item.second);
+    pending.clear();
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <sqlite3.h>
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "string_pool.hpp"
+
+enum EntityType {
+    Album,
+    Artist,
+    Genre
+};
+
+std::string makeAlbumKey(std::string_view album_title, const std::vector<int> &artist_ids);
+std::string makeAlbumNameKey(std::string_view album_title, const NameList &artist_names);
+
+/**
+ * @brief An in-process name to id map for artists, genres and album titles.
+ *
+ * @details Once loaded, a name missing from the cache is also missing from the
+ *          database, so getEntityId can insert it straight away. Albums are
+ *          also kept by their album key (see makeAlbumKey). Names added since
+ *          the last commit are remembered, so that rolling back a transaction
+ *          can forget them as well. The names are kept in a StringPool, so
+ *          looking one up takes a view of it and allocates nothing.
+ */
+class EntityCache {
+   public:
+    EntityCache() : loaded(false) {}
+
+    int load(sqlite3 *db);
+    void clear();
+    bool isLoaded() const { return loaded; }
+
+    int find(EntityType entity_type, std::string_view entity_name) const;
+    void insert(EntityType entity_type, std::string_view entity_name, int entity_id);
+
+    int findAlbum(std::string_view album_key) const;
+    void insertAlbum(std::string_view album_key, int album_id);
+
+    void commit();
+    void rollback();
+
+   private:
+    bool loaded;
+    static const int k_album_key_slot = 3;
+
+    void insertIntoSlot(int slot, std::string_view key, int id);
+
+    std::unique_ptr<StringPool> storage;                 // holds the keys of names
+    std::unordered_map<std::string_view, int> names[4];  // indexed by EntityType, then album keys
+    std::vector<std::pair<int, std::string_view>> pending;
+};
@@ -0,0 +1,704 @@
+#include "fast_tags.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "formats.hpp"
+#include "misc.hpp"
+
+#define FAST_TAGS_MAX_TEXT (64 * 1024)        // longer text frames are left to TagLib
+#define FAST_TAGS_MAX_COMMENTS (1024 * 1024)  // so are larger Vorbis comment blocks
+#define FAST_TAGS_MAX_PICTURE (64 * 1024 * 1024)
+#define FAST_TAGS_SCAN_BLOCK (256 * 1024)  // read at a time by measureMpegStream
+
+static uint32_t readBigEndian(const unsigned char *p, int bytes) {
+    uint32_t value = 0;
+    for (int i = 0; i < bytes; i++)
+        value = (value << 8) | p[i];
+    return value;
+}
+
+static uint32_t readLittleEndian32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/**
+ * @brief Reads a synchsafe integer, 7 bits per byte.
+ *
+ * @return False if a byte has its top bit set.
+ */
+static bool readSynchsafe(const unsigned char *p, uint32_t &value) {
+    value = 0;
+    for (int i = 0; i < 4; i++) {
+        if (p[i] & 0x80)
+            return false;
+        value = (value << 7) | p[i];
+    }
+    return true;
+}
+
+/**
+ * @brief Parses a leading integer the way TagLib's String::toInt does.
+ */
+static unsigned int toInt(const std::string &text) {
+    return (unsigned int)strtol(text.c_str(), NULL, 10);
+}
+
+static bool isValidUtf8(const std::string &text) {
+    for (size_t i = 0; i < text.size();) {
+        unsigned char c = text[i];
+        int extra = c < 0x80 ? 0 : (c & 0xE0) == 0xC0 ? 1 : (c & 0xF0) == 0xE0 ? 2 : (c & 0xF8) == 0xF0 ? 3 : -1;
+        if (extra < 0 || i + extra > text.size() - 1)
+            return false;
+        for (int k = 1; k <= extra; k++) {
+            if (((unsigned char)text[i + k] & 0xC0) != 0x80)
+                return false;
+        }
+        i += extra + 1;
+    }
+    return true;
+}
+
+static void appendUtf8(std::string &out, uint32_t code_point) {
+    if (code_point < 0x80)
+        out += (char)code_point;
+    else if (code_point < 0x800) {
+        out += (char)(0xC0 | (code_point >> 6));
+        out += (char)(0x80 | (code_point & 0x3F));
+    } else if (code_point < 0x10000) {
+        out += (char)(0xE0 | (code_point >> 12));
+        out += (char)(0x80 | ((code_point >> 6) & 0x3F));
+        out += (char)(0x80 | (code_point & 0x3F));
+    } else {
+        out += (char)(0xF0 | (code_point >> 18));
+        out += (char)(0x80 | ((code_point >> 12) & 0x3F));
+        out += (char)(0x80 | ((code_point >> 6) & 0x3F));
+        out += (char)(0x80 | (code_point & 0x3F));
+    }
+}
+
+/**
+ * @brief Decodes the text of an ID3v2 text frame to UTF-8.
+ *
+ * @details Only single values are handled: TagLib 2 joins several values
+ *          with " / " in its Tag interface but with " " in its property map,
+ *          and it is not worth copying both. Text without a byte order mark
+ *          where one is required is also left to TagLib.
+ *
+ * @param[in] encoding The encoding byte of the frame.
+ * @param[in] data The bytes after the encoding byte.
+ * @param[out] text The decoded text.
+ *
+ * @return False if the frame must be read by TagLib.
+ */
+static bool decodeId3Text(unsigned char encoding, const std::string &data, std::string &text) {
+    text.clear();
+    if (encoding == 0 || encoding == 3) {
+        std::string raw = data;
+        while (!raw.empty() && raw.back() == '\0')
+            raw.pop_back();
+        if (raw.find('\0') != std::string::npos)
+            return false;
+        if (encoding == 3) {
+            text = raw;
+            return isValidUtf8(text);
+        }
+        for (unsigned char c : raw)
+            appendUtf8(text, c);
+        return true;
+    }
+    if (encoding != 1 && encoding != 2)
+        return false;
+
+    size_t units = data.size() / 2;
+    const unsigned char *p = (const unsigned char *)data.data();
+    bool big_endian = encoding == 2;
+    size_t i = 0;
+    if (encoding == 1) {
+        if (units == 0)
+            return true;
+        if (p[0] == 0xFF && p[1] == 0xFE)
+            big_endian = false;
+        else if (p[0] == 0xFE && p[1] == 0xFF)
+            big_endian = true;
+        else
+            return false;
+        i = 1;
+    }
+    while (units > i && p[2 * (units - 1)] == 0 && p[2 * (units - 1) + 1] == 0)
+        units--;
+    for (; i < units; i++) {
+        uint32_t unit = big_endian ? (p[2 * i] << 8) | p[2 * i + 1] : p[2 * i] | (p[2 * i + 1] << 8);
+        if (unit == 0)
+            return false;  // a second value
+        if (unit >= 0xD800 && unit < 0xDC00 && i + 1 < units) {
+            uint32_t low = big_endian ? (p[2 * i + 2] << 8) | p[2 * i + 3] : p[2 * i + 2] | (p[2 * i + 3] << 8);
+            if (low < 0xDC00 || low >= 0xE000)
+                return false;
+            unit = 0x10000 + ((unit - 0xD800) << 10) + (low - 0xDC00);
+            i++;
+        } else if (unit >= 0xD800 && unit < 0xE000)
+            return false;
+        appendUtf8(text, unit);
+    }
+    return true;
+}
+
+/**
+ * @brief Skips a string terminated for the given ID3v2 encoding.
+ *
+ * @return The offset just past the terminator, or npos if there is none.
+ */
+static size_t skipTerminated(unsigned char encoding, const std::string &data, size_t offset) {
+    if (encoding == 0 || encoding == 3) {
+        size_t end = data.find('\0', offset);
+        return end == std::string::npos ? end : end + 1;
+    }
+    for (size_t i = offset; i + 1 < data.size(); i += 2) {
+        if (data[i] == '\0' && data[i + 1] == '\0')
+            return i + 2;
+    }
+    return std::string::npos;
+}
+
+/**
+ * @brief Tells whether an ID3v1 or APE tag sits at the end of the file.
+ *
+ * @details TagLib merges those with the main tag for fields the main tag
+ *          lacks, so a file that has one is only read here if the main tag
+ *          has every field.
+ *
+ * @param[out] audio_end Set to where the audio ends, before those tags.
+ *
+ * @return False if the end of the file could not be read.
+ */
+static bool findTrailingTags(PositionedFile &file, bool &has_id3v1, bool &has_ape, int64_t &audio_end) {
+    has_id3v1 = has_ape = false;
+    audio_end = file.size();
+    char marker[8];
+    if (audio_end >= 128) {
+        if (!file.read(audio_end - 128, marker, 3))
+            return false;
+        if (memcmp(marker, "TAG", 3) == 0) {
+            has_id3v1 = true;
+            audio_end -= 128;
+        }
+    }
+    if (audio_end >= 32) {
+        if (!file.read(audio_end - 32, marker, 8))
+            return false;
+        has_ape = memcmp(marker, "APETAGEX", 8) == 0;
+    }
+    return true;
+}
+
+static bool missesField(const RawTags &tags) {
+    return tags.title.empty() || tags.artist.empty() || tags.album.empty() || tags.genre.empty() || tags.track_number == 0 || tags.year == 0;
+}
+
+/**
+ * @brief Looks for a Xing, Info or VBRI header in the first frame of an MPEG
+ *        stream. Such a frame describes the stream and holds no audio.
+ *
+ * @param[out] total_frames The number of audio frames, or 0 if not given.
+ * @param[out] total_size The number of bytes of audio, or 0 if not given.
+ *
+ * @return Whether the frame has one of those headers.
+ */
+static bool readVbrHeader(const std::string &frame, const MpegHeader &header, uint32_t &total_frames, uint32_t &total_size) {
+    const unsigned char *f = (const unsigned char *)frame.data();
+    size_t xing_offset = header.version == 1 ? (header.channels == 1 ? 21 : 36) : (header.channels == 1 ? 13 : 21);
+    total_frames = total_size = 0;
+    if (frame.size() >= xing_offset + 16 && (memcmp(f + xing_offset, "Xing", 4) == 0 || memcmp(f + xing_offset, "Info", 4) == 0)) {
+        uint32_t flags = readBigEndian(f + xing_offset + 4, 4);
+        if ((flags & 3) == 3) {
+            total_frames = readBigEndian(f + xing_offset + 8, 4);
+            total_size = readBigEndian(f + xing_offset + 12, 4);
+        }
+        return true;
+    }
+    if (frame.size() >= 36 + 18 && memcmp(f + 36, "VBRI", 4) == 0) {
+        total_size = readBigEndian(f + 36 + 10, 4);
+        total_frames = readBigEndian(f + 36 + 14, 4);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Reads the audio properties of an MPEG stream the way TagLib does:
+ *        from a Xing or VBRI header if the first frame has one, else from
+ *        the bitrate of the first frame and the span up to the last frame.
+ *
+ * @return False if no frame was found near either end of the stream.
+ */
+static bool readMpegProperties(PositionedFile &file, int64_t audio_start, int64_t audio_end, AudioInfo &audio) {
+    std::string block;
+    size_t block_size = (size_t)std::max<int64_t>(std::min<int64_t>(audio_end - audio_start, 8192), 0);
+    if (block_size < 4 || !file.read(audio_start, block, block_size))
+        return false;
+    const unsigned char *p = (const unsigned char *)block.data();
+
+    // The first frame is one whose successor, if it fits, is a frame too.
+    MpegHeader first;
+    int64_t first_offset = -1;
+    for (size_t i = 0; i + 4 <= block.size(); i++) {
+        if (!parseMpegHeader(p + i, first))
+            continue;
+        MpegHeader next;
+        size_t next_offset = i + first.frame_length;
+        if (next_offset + 4 <= block.size() &&
+            (!parseMpegHeader(p + next_offset, next) || next.version != first.version || next.layer != first.layer || next.sample_rate != first.sample_rate))
+            continue;
+        first_offset = audio_start + i;
+        break;
+    }
+    if (first_offset < 0)
+        return false;
+    audio.sample_rate = first.sample_rate;
+    audio.channels = first.channels;
+
+    std::string frame;
+    if (!file.read(first_offset, frame, (size_t)std::min<int64_t>(first.frame_length, audio_end - first_offset)))
+        return false;
+    uint32_t total_frames, total_size;
+    readVbrHeader(frame, first, total_frames, total_size);
+    if (total_frames > 0 && total_size > 0) {
+        double length = (double)first.samples_per_frame * 1000.0 / first.sample_rate * total_frames;
+        audio.duration_ms = (int)(length + 0.5);
+        audio.bitrate = (int)(total_size * 8.0 / length + 0.5);
+        return true;
+    }
+
+    // A constant bitrate stream: find the start of the last frame.
+    audio.bitrate = first.bitrate;
+    block_size = (size_t)std::min<int64_t>(audio_end - first_offset, 8192);
+    int64_t block_start = audio_end - block_size;
+    if (!file.read(block_start, block, block_size))
+        return false;
+    p = (const unsigned char *)block.data();
+    for (size_t i = block.size() >= 4 ? block.size() - 4 : 0;; i--) {
+        MpegHeader last;
+        if (parseMpegHeader(p + i, last) && last.version == first.version && last.layer == first.layer && last.sample_rate == first.sample_rate) {
+            int64_t stream_length = block_start + i - first_offset + last.frame_length;
+            if (stream_length > 0)
+                audio.duration_ms = (int)(stream_length * 8.0 / first.bitrate + 0.5);
+            return true;
+        }
+        if (i == 0)
+            return false;
+    }
+}
+
+static bool sameStream(const MpegHeader &a, const MpegHeader &b) {
+    return a.version == b.version && a.layer == b.layer && a.sample_rate == b.sample_rate;
+}
+
+/**
+ * @brief Measures an MPEG stream by walking every frame in it.
+ *
+ * @details Unlike readMpegProperties, this is exact for VBR files without a
+ *          Xing or VBRI header and for files whose header is wrong, at the
+ *          cost of reading the whole file. Leading ID3v2 tags and trailing
+ *          ID3v1 and APE tags are skipped. Where the frames lose sync, the
+ *          next header of the same stream that is followed by another one is
+ *          taken as the next frame. A Xing, Info or VBRI frame is not counted.
+ *
+ * @param[in] file The MP3 file.
+ * @param[out] audio Its duration, average bitrate, sample rate and channels.
+ *                   Left untouched if no frame is found.
+ *
+ * @return True if frames were found.
+ */
+bool measureMpegStream(PositionedFile &file, AudioInfo &audio) {
+    int64_t audio_start = 0;
+    unsigned char header[10];
+    uint32_t tag_size;
+    while (file.read(audio_start, header, 10) && memcmp(header, "ID3", 3) == 0 && readSynchsafe(header + 6, tag_size))
+        audio_start += 10 + tag_size + ((header[3] == 4 && (header[5] & 0x10)) ? 10 : 0);
+    bool has_id3v1, has_ape;
+    int64_t audio_end;
+    if (!findTrailingTags(file, has_id3v1, has_ape, audio_end))
+        return false;
+    if (has_ape) {
+        unsigned char footer[32];
+        if (!file.read(audio_end - 32, footer, 32))
+            return false;
+        uint32_t size = footer[12] | (footer[13] << 8) | (footer[14] << 16) | ((uint32_t)footer[15] << 24);
+        audio_end -= size + ((footer[23] & 0x80) ? 32 : 0);
+    }
+    // Tags that claim more than the file holds leave no stream to walk.
+    if (audio_end - audio_start < 4)
+        return false;
+
+    std::string block;
+    int64_t block_start = 0;
+    auto headerAt = [&](int64_t offset, MpegHeader &found) {
+        if (offset < audio_start || offset + 4 > audio_end)
+            return false;
+        if (offset < block_start || offset + 4 > block_start + (int64_t)block.size()) {
+            block_start = offset;
+            if (!file.read(offset, block, (size_t)std::min<int64_t>(audio_end - offset, FAST_TAGS_SCAN_BLOCK))) {
+                block.clear();
+                return false;
+            }
+        }
+        return parseMpegHeader((const unsigned char *)block.data() + (offset - block_start), found);
+    };
+
+    MpegHeader stream = MpegHeader();
+    bool have_stream = false, in_sync = false;
+    uint64_t samples = 0, bytes = 0;
+    for (int64_t offset = audio_start; offset + 4 <= audio_end;) {
+        MpegHeader frame, next;
+        bool valid = headerAt(offset, frame) && (!have_stream || sameStream(frame, stream));
+        if (valid && !in_sync) {
+            int64_t next_offset = offset + frame.frame_length;
+            valid = next_offset + 4 > audio_end || (headerAt(next_offset, next) && sameStream(next, frame));
+        }
+        if (!valid) {
+            in_sync = false;
+            offset++;
+            continue;
+        }
+        in_sync = true;
+        if (!have_stream) {
+            stream = frame;
+            have_stream = true;
+            std::string first;
+            uint32_t total_frames, total_size;
+            if (!file.read(offset, first, (size_t)std::max<int64_t>(std::min<int64_t>(frame.frame_length, audio_end - offset), 0)))
+                return false;
+            if (readVbrHeader(first, frame, total_frames, total_size)) {
+                offset += frame.frame_length;
+                continue;
+            }
+        }
+        samples += frame.samples_per_frame;
+        bytes += frame.frame_length;
+        offset += frame.frame_length;
+    }
+    if (samples == 0)
+        return false;
+
+    double length = samples * 1000.0 / stream.sample_rate;
+    audio.duration_ms = (int)(length + 0.5);
+    audio.bitrate = (int)(bytes * 8.0 / length + 0.5);
+    audio.sample_rate = stream.sample_rate;
+    audio.channels = stream.channels;
+    return true;
+}
+
+struct PictureSpan {
+    int64_t offset = -1;  // of the frame or block body
+    uint32_t size = 0;
+};
+
+/**
+ * @brief Reads an MP3 file that starts with an ID3v2.3 or ID3v2.4 tag.
+ */
+static FastTagsResult readMp3(PositionedFile &file, RawTags &tags, PictureSpan &picture_span) {
+    unsigned char header[10];
+    uint32_t tag_size;
+    if (!file.read(0, header, 10) || memcmp(header, "ID3", 3) != 0 || !readSynchsafe(header + 6, tag_size))
+        return FastTagsNeedTagLib;
+    int major = header[3];
+    // Unsynchronisation and extended headers are rare enough to leave to TagLib.
+    if ((major != 3 && major != 4) || (header[5] & 0xC0) != 0)
+        return FastTagsNeedTagLib;
+    int64_t tag_end = 10 + (int64_t)tag_size;
+    int64_t audio_start = tag_end + ((major == 4 && (header[5] & 0x10)) ? 10 : 0);
+    if (audio_start > file.size())
+        return FastTagsNeedTagLib;
+
+    std::unordered_set<std::string> seen;  // TagLib uses the first frame of each kind
+    for (int64_t offset = 10; offset + 10 <= tag_end;) {
+        unsigned char frame_header[10];
+        if (!file.read(offset, frame_header, 10))
+            return FastTagsNeedTagLib;
+        if (frame_header[0] == 0)
+            break;  // padding
+        for (int i = 0; i < 4; i++) {
+            if (!((frame_header[i] >= 'A' && frame_header[i] <= 'Z') || (frame_header[i] >= '0' && frame_header[i] <= '9')))
+                return FastTagsNeedTagLib;
+        }
+        uint32_t frame_size;
+        if (major == 4) {
+            if (!readSynchsafe(frame_header + 4, frame_size))
+                return FastTagsNeedTagLib;  // iTunes style sizes; TagLib guesses
+        } else
+            frame_size = readBigEndian(frame_header + 4, 4);
+        // Compressed, encrypted, grouped or unsynchronised frames.
+        if ((major == 3 && (frame_header[9] & 0xE0)) || (major == 4 && (frame_header[9] & 0x4F)))
+            return FastTagsNeedTagLib;
+        int64_t body = offset + 10;
+        if (body + frame_size > tag_end)
+            return FastTagsNeedTagLib;
+        offset = body + frame_size;
+
+        std::string id((const char *)frame_header, 4);
+        std::string *field = NULL;
+        if (id == "TIT2")
+            field = &tags.title;
+        else if (id == "TPE1")
+            field = &tags.artist;
+        else if (id == "TALB")
+            field = &tags.album;
+        else if (id == "TPE2")
+            field = &tags.album_artist;
+        else if (id == "TCON")
+            field = &tags.genre;
+        else if (id == "APIC") {
+            if (picture_span.offset < 0) {
+                picture_span.offset = body;
+                picture_span.size = frame_size;
+            }
+            continue;
+        } else if (id != "TRCK" && id != "TPOS" && id != "TXXX" && id != (major == 4 ? "TDRC" : "TYER") && !(major == 3 && id == "TDRC"))
+            continue;
+        if (frame_size > FAST_TAGS_MAX_TEXT)
+            return FastTagsNeedTagLib;
+        if (id != "TXXX" && !seen.insert(id == "TYER" ? "TDRC" : id).second)
+            continue;
+        std::string data;
+        if (frame_size == 0 || !file.read(body, data, frame_size))
+            continue;
+        unsigned char encoding = data[0];
+        data.erase(0, 1);
+
+        if (id == "TXXX") {
+            // A user frame with one of these descriptions lands in TagLib's
+            // property map next to the standard frame.
+            size_t value_start = skipTerminated(encoding, data, 0);
+            std::string description;
+            if (value_start == std::string::npos || !decodeId3Text(encoding, data.substr(0, value_start), description))
+                return FastTagsNeedTagLib;
+            std::transform(description.begin(), description.end(), description.begin(), [](unsigned char c) { return (char)std::toupper(c); });
+            if (description == "ALBUMARTIST" || description == "ALBUM ARTIST" || description == "DISCNUMBER")
+                return FastTagsNeedTagLib;
+            continue;
+        }
+        std::string text;
+        if (!decodeId3Text(encoding, data, text))
+            return FastTagsNeedTagLib;
+        if (field != NULL)
+            *field = text;
+        else if (id == "TRCK")
+            tags.track_number = toInt(text);
+        else if (id == "TPOS")
+            tags.disc_number = toInt(text);
+        else
+            tags.year = toInt(text.substr(0, 4));
+    }
+
+    // TagLib turns ID3v1 genre numbers, "(17)" or "17", and "RX" and "CR"
+    // into names.
+    if (!tags.genre.empty() && (tags.genre[0] == '(' || tags.genre.find_first_not_of("0123456789") == std::string::npos || tags.genre == "RX" || tags.genre == "CR"))
+        return FastTagsNeedTagLib;
+
+    bool has_id3v1, has_ape;
+    int64_t audio_end;
+    if (!findTrailingTags(file, has_id3v1, has_ape, audio_end) || has_ape || (has_id3v1 && missesField(tags)))
+        return FastTagsNeedTagLib;
+    if (!readMpegProperties(file, audio_start, audio_end, tags.audio))
+        return FastTagsNeedTagLib;
+    return FastTagsRead;
+}
+
+/**
+ * @brief Reads a FLAC file: STREAMINFO, the first VORBIS_COMMENT block and
+ *        the position of the first PICTURE block.
+ */
+static FastTagsResult readFlac(PositionedFile &file, RawTags &tags, PictureSpan &picture_span) {
+    char magic[4];
+    if (!file.read(0, magic, 4) || memcmp(magic, "fLaC", 4) != 0)
+        return FastTagsNeedTagLib;
+
+    int64_t offset = 4;
+    bool last = false, has_stream_info = false, has_comments = false;
+    uint64_t total_samples = 0;
+    std::vector<std::pair<std::string, std::string>> comments;
+    while (!last) {
+        unsigned char block_header[4];
+        if (!file.read(offset, block_header, 4))
+            return FastTagsNeedTagLib;
+        last = block_header[0] & 0x80;
+        int type = block_header[0] & 0x7F;
+        if (type == 127)
+            return FastTagsNeedTagLib;
+        uint32_t length = readBigEndian(block_header + 1, 3);
+        int64_t body = offset + 4;
+        offset = body + length;
+        if (offset > file.size())
+            return FastTagsNeedTagLib;
+
+        if (type == 0 && !has_stream_info) {
+            unsigned char info[34];
+            if (length < 34 || !file.read(body, info, 34))
+                return FastTagsNeedTagLib;
+            tags.audio.sample_rate = (info[10] << 12) | (info[11] << 4) | (info[12] >> 4);
+            tags.audio.channels = ((info[12] >> 1) & 7) + 1;
+            tags.audio.bits_per_sample = (((info[12] & 1) << 4) | (info[13] >> 4)) + 1;
+            total_samples = ((uint64_t)(info[13] & 0x0F) << 32) | readBigEndian(info + 14, 4);
+            has_stream_info = true;
+        } else if (type == 4 && !has_comments) {
+            std::string data;
+            if (length > FAST_TAGS_MAX_COMMENTS || !file.read(body, data, length))
+                return FastTagsNeedTagLib;
+            const unsigned char *p = (const unsigned char *)data.data();
+            size_t position = 0;
+            auto readLength = [&](uint32_t &value) {
+                if (position + 4 > data.size())
+                    return false;
+                value = readLittleEndian32(p + position);
+                position += 4;
+                return true;
+            };
+            uint32_t vendor_length, count;
+            if (!readLength(vendor_length) || position + vendor_length > data.size())
+                return FastTagsNeedTagLib;
+            position += vendor_length;
+            if (!readLength(count))
+                return FastTagsNeedTagLib;
+            for (uint32_t i = 0; i < count; i++) {
+                uint32_t comment_length;
+                if (!readLength(comment_length) || position + comment_length > data.size())
+                    return FastTagsNeedTagLib;
+                std::string comment = data.substr(position, comment_length);
+                position += comment_length;
+                size_t equals = comment.find('=');
+                if (equals == std::string::npos)
+                    continue;
+                if (!isValidUtf8(comment))
+                    return FastTagsNeedTagLib;
+                std::string key = comment.substr(0, equals);
+                std::transform(key.begin(), key.end(), key.begin(), [](unsigned char c) { return (char)std::toupper(c); });
+                comments.emplace_back(key, comment.substr(equals + 1));
+            }
+            has_comments = true;
+        } else if (type == 6 && picture_span.offset < 0) {
+            picture_span.offset = body;
+            picture_span.size = length;
+        }
+    }
+    if (!has_stream_info)
+        return FastTagsNeedTagLib;
+
+    // Repeated fields are joined differently by TagLib's Tag interface and
+    // its property map; leave them to TagLib.
+    std::unordered_map<std::string, std::string> fields;
+    for (auto &comment : comments) {
+        if (!fields.emplace(comment.first, comment.second).second &&
+            (comment.first == "TITLE" || comment.first == "ARTIST" || comment.first == "ALBUM" || comment.first == "GENRE" || comment.first == "ALBUMARTIST" || comment.first == "DISCNUMBER"))
+            return FastTagsNeedTagLib;
+    }
+    tags.title = fields["TITLE"];
+    tags.artist = fields["ARTIST"];
+    tags.album = fields["ALBUM"];
+    tags.genre = fields["GENRE"];
+    tags.album_artist = fields["ALBUMARTIST"];
+    tags.disc_number = toInt(fields["DISCNUMBER"]);
+    tags.track_number = toInt(fields.count("TRACKNUMBER") > 0 ? fields["TRACKNUMBER"] : fields["TRACKNUM"]);
+    tags.year = toInt(fields.count("DATE") > 0 ? fields["DATE"] : fields["YEAR"]);
+
+    bool has_id3v1, has_ape;
+    int64_t audio_end;
+    if (!findTrailingTags(file, has_id3v1, has_ape, audio_end) || (has_id3v1 && missesField(tags)))
+        return FastTagsNeedTagLib;
+    if (tags.audio.sample_rate > 0 && total_samples > 0) {
+        double length = total_samples * 1000.0 / tags.audio.sample_rate;
+        tags.audio.duration_ms = (int)(length + 0.5);
+        tags.audio.bitrate = (int)((audio_end - offset) * 8.0 / length + 0.5);
+    }
+    return FastTagsRead;
+}
+
+/**
+ * @brief Reads the picture data out of an ID3v2 APIC frame or a FLAC
+ *        PICTURE block.
+ */
+static bool readPicture(PositionedFile &file, const PictureSpan &span, bool flac, std::string &picture) {
+    std::string data;
+    if (span.size > FAST_TAGS_MAX_PICTURE || !file.read(span.offset, data, span.size))
+        return false;
+    if (flac) {
+        const unsigned char *p = (const unsigned char *)data.data();
+        size_t position = 4;  // picture type
+        for (int i = 0; i < 2; i++) {  // MIME type, then description
+            if (position + 4 > data.size())
+                return false;
+            position += 4 + readBigEndian(p + position, 4);
+        }
+        position += 16;  // width, height, depth, colours
+        if (position + 4 > data.size())
+            return false;
+        uint32_t length = readBigEndian(p + position, 4);
+        position += 4;
+        if (position + length > data.size())
+            return false;
+        picture = data.substr(position, length);
+        return true;
+    }
+    if (data.empty())
+        return false;
+    unsigned char encoding = data[0];
+    size_t position = data.find('\0', 1);  // MIME type, always Latin-1
+    if (position == std::string::npos)
+        return false;
+    position = skipTerminated(encoding, data, position + 2);  // picture type, then description
+    if (position == std::string::npos)
+        return false;
+    picture = data.substr(position);
+    return true;
+}
+
+/**
+ * @brief Reads the tags and audio properties of a plain MP3 or FLAC file
+ *        without TagLib, through a few bounded positioned reads.
+ *
+ * @details Only the ID3v2 tag of an MP3 file, or the metadata blocks of a
+ *          FLAC file, are read, plus a few kilobytes of audio to find the
+ *          first and last MPEG frames. Anything unusual, where TagLib would
+ *          do more than read the fields as written, is reported as
+ *          FastTagsNeedTagLib: ID3v2.2, unsynchronisation, extended headers,
+ *          compressed or encrypted frames, repeated values, numeric genres,
+ *          APE tags, and ID3v1 tags that TagLib would merge in. Audio
+ *          properties follow TagLib's arithmetic, but may differ from it by
+ *          a millisecond or a kb/s on damaged streams.
+ *
+ * @param[in] file The music file, opened by the caller, which has detected
+ *                 its format with detectFormat.
+ * @param[in] format The format of the file.
+ * @param[out] tags The fields read.
+ * @param[out] picture Set to the first embedded picture, or emptied. NULL
+ *                     never reads the picture.
+ * @param[in] want_picture Asked once the tags are read whether to read the
+ *                         picture. Empty always reads it.
+ *
+ * @return FastTagsRead, or FastTagsNeedTagLib if the file must be read with
+ *         TagLib instead.
+ */
+FastTagsResult readFastTags(PositionedFile &file, AudioFormat format, RawTags &tags, std::string *picture, const std::function<bool(const RawTags &)> &want_picture) {
+    if (picture != NULL)
+        picture->clear();
+    bool flac = format == FormatFlac;
+    if (!flac && format != FormatMp3)
+        return FastTagsNeedTagLib;
+
+    tags = RawTags();
+    PictureSpan picture_span;
+    FastTagsResult result = flac ? readFlac(file, tags, picture_span) : readMp3(file, tags, picture_span);
+    if (result != FastTagsRead)
+        return result;
+    if (picture != NULL && (!want_picture || want_picture(tags)) && picture_span.offset >= 0) {
+        if (!readPicture(file, picture_span, flac, *picture))
+            return FastTagsNeedTagLib;
+    }
+    return FastTagsRead;
+}
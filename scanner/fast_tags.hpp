@@ -0,0 +1,18 @@
+#pragma once
+
+#include <functional>
+#include <string>
+
+#include "formats.hpp"
+#include "tag_functions.hpp"
+
+/**
+ * @brief What readFastTags made of a file.
+ */
+enum FastTagsResult {
+    FastTagsRead = 0,       // tags read, and the picture if it was asked for
+    FastTagsNeedTagLib = 1  // not a plain ID3v2.3/2.4 MP3 or FLAC file; read it with TagLib
+};
+
+FastTagsResult readFastTags(PositionedFile &file, AudioFormat format, RawTags &tags, std::string *picture, const std::function<bool(const RawTags &)> &want_picture = nullptr);
+bool measureMpegStream(PositionedFile &file, AudioInfo &audio);
@@ -0,0 +1,268 @@
+#include "formats.hpp"
+
+#include <taglib/aifffile.h>
+#include <taglib/flacfile.h>
+#include <taglib/mp4file.h>
+#include <taglib/mpegfile.h>
+#include <taglib/oggflacfile.h>
+#include <taglib/opusfile.h>
+#include <taglib/vorbisfile.h>
+#include <taglib/wavfile.h>
+#include <taglib/wavpackfile.h>
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "misc.hpp"
+
+PositionedFile::PositionedFile(const std::string &path) {
+#ifdef _WIN32
+    handle = CreateFileW(std::filesystem::u8path(path).wstring().c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER file_size;
+    if (handle != INVALID_HANDLE_VALUE && GetFileSizeEx(handle, &file_size))
+        length = file_size.QuadPart;
+#else
+    fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0)
+        length = st.st_size;
+#endif
+    if (length >= 0) {
+        window.resize(std::min<int64_t>(length, FORMAT_HEAD_SIZE));
+        if (!readFromDisk(0, &window[0], window.size()))
+            length = -1;
+    }
+}
+
+PositionedFile::~PositionedFile() {
+#ifdef _WIN32
+    if (handle != NULL && handle != INVALID_HANDLE_VALUE)
+        CloseHandle(handle);
+#else
+    if (fd >= 0)
+        close(fd);
+#endif
+}
+
+/**
+ * @brief Reads exactly `count` bytes at `offset`, failing on a short read.
+ *        Bytes within the head come from memory.
+ */
+bool PositionedFile::read(int64_t offset, void *buffer, size_t count) {
+    if (offset < 0 || offset > length || count > (uint64_t)(length - offset))
+        return false;
+    if (offset + count <= window.size()) {
+        memcpy(buffer, window.data() + offset, count);
+        return true;
+    }
+    return readFromDisk(offset, (char *)buffer, count);
+}
+
+bool PositionedFile::read(int64_t offset, std::string &buffer, size_t count) {
+    if (offset < 0 || offset > length || count > (uint64_t)(length - offset))
+        return false;
+    buffer.resize(count);
+    return count == 0 || read(offset, &buffer[0], count);
+}
+
+bool PositionedFile::readFromDisk(int64_t offset, char *buffer, size_t count) {
+    while (count > 0) {
+#ifdef _WIN32
+        OVERLAPPED overlapped = {};
+        overlapped.Offset = (DWORD)offset;
+        overlapped.OffsetHigh = (DWORD)(offset >> 32);
+        DWORD done = 0;
+        if (!ReadFile(handle, buffer, (DWORD)std::min<size_t>(count, 1 << 30), &done, &overlapped) || done == 0)
+            return false;
+#else
+        ssize_t done = pread(fd, buffer, count, offset);
+        if (done <= 0)
+            return false;
+#endif
+        buffer += done;
+        offset += done;
+        count -= done;
+    }
+    return true;
+}
+
+/**
+ * @brief Parses an MPEG audio frame header.
+ *
+ * @return False if the four bytes are not a valid header.
+ */
+bool parseMpegHeader(const unsigned char *p, MpegHeader &header) {
+    static const int bitrates[2][3][16] = {
+        {{0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448, 0},
+         {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 0},
+         {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0}},
+        {{0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256, 0},
+         {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},
+         {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0}}};
+    static const int sample_rates[3][3] = {{44100, 48000, 32000}, {22050, 24000, 16000}, {11025, 12000, 8000}};
+
+    if (p[0] != 0xFF || (p[1] & 0xE0) != 0xE0)
+        return false;
+    int version_bits = (p[1] >> 3) & 3, layer_bits = (p[1] >> 1) & 3;
+    int bitrate_index = p[2] >> 4, sample_rate_index = (p[2] >> 2) & 3;
+    if (version_bits == 1 || layer_bits == 0 || bitrate_index == 0 || bitrate_index == 15 || sample_rate_index == 3)
+        return false;
+    header.version = version_bits == 3 ? 1 : version_bits == 2 ? 2 : 3;
+    header.layer = 4 - layer_bits;
+    header.bitrate = bitrates[header.version == 1 ? 0 : 1][header.layer - 1][bitrate_index];
+    header.sample_rate = sample_rates[header.version - 1][sample_rate_index];
+    header.channels = (p[3] >> 6) == 3 ? 1 : 2;
+    header.samples_per_frame = header.layer == 1 ? 384 : header.layer == 2 || header.version == 1 ? 1152 : 576;
+    int padding = (p[2] >> 1) & 1;
+    header.frame_length = header.samples_per_frame / 8 * header.bitrate * 1000 / header.sample_rate + padding * (header.layer == 1 ? 4 : 1);
+    return header.frame_length > 4;
+}
+
+template <typename T>
+static TagLib::File *openWith(const char *path, bool accurate) {
+    return new T(path, true, accurate ? TagLib::AudioProperties::Accurate : TagLib::AudioProperties::Average);
+}
+
+template <typename T>
+static int bitsPerSampleOf(const TagLib::AudioProperties *properties) {
+    const T *format_properties = dynamic_cast<const T *>(properties);
+    return format_properties != NULL ? format_properties->bitsPerSample() : 0;
+}
+
+/**
+ * @brief Returns every format the scanner reads.
+ *
+ * @details A new format needs an entry here, a case in detectFormat, and, if
+ *          the fast parser is to read it, support in readFastTags.
+ */
+const std::vector<FormatHandler> &formatHandlers() {
+    static const std::vector<FormatHandler> handlers = {
+        {FormatMp3, "mp3", {".mp3"}, true, &openWith<TagLib::MPEG::File>, NULL},
+        {FormatFlac, "flac", {".flac"}, true, &openWith<TagLib::FLAC::File>, &bitsPerSampleOf<TagLib::FLAC::Properties>},
+        {FormatOggVorbis, "vorbis", {".ogg", ".oga"}, false, &openWith<TagLib::Ogg::Vorbis::File>, NULL},
+        {FormatOggOpus, "opus", {".opus"}, false, &openWith<TagLib::Ogg::Opus::File>, NULL},
+        {FormatOggFlac, "oggflac", {}, false, &openWith<TagLib::Ogg::FLAC::File>, &bitsPerSampleOf<TagLib::FLAC::Properties>},
+        {FormatMp4, "mp4", {".m4a", ".m4b", ".mp4", ".aac", ".alac"}, false, &openWith<TagLib::MP4::File>, &bitsPerSampleOf<TagLib::MP4::Properties>},
+        {FormatWavPack, "wavpack", {".wv"}, false, &openWith<TagLib::WavPack::File>, &bitsPerSampleOf<TagLib::WavPack::Properties>},
+        {FormatWav, "wav", {".wav"}, false, &openWith<TagLib::RIFF::WAV::File>, &bitsPerSampleOf<TagLib::RIFF::WAV::Properties>},
+        {FormatAiff, "aiff", {".aif", ".aiff", ".aifc"}, false, &openWith<TagLib::RIFF::AIFF::File>, &bitsPerSampleOf<TagLib::RIFF::AIFF::Properties>}};
+    return handlers;
+}
+
+const FormatHandler *formatHandler(AudioFormat format) {
+    for (const FormatHandler &handler : formatHandlers()) {
+        if (handler.format == format)
+            return &handler;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Tells whether an MPEG frame header at `offset` of the head is
+ *        followed by another one where the first frame ends.
+ */
+static bool hasMpegFrames(const std::string &head, size_t offset) {
+    const unsigned char *p = (const unsigned char *)head.data();
+    MpegHeader first, next;
+    if (offset + 4 > head.size() || !parseMpegHeader(p + offset, first))
+        return false;
+    size_t next_offset = offset + first.frame_length;
+    if (next_offset + 4 > head.size())
+        return true;  // a single frame fills the head
+    return parseMpegHeader(p + next_offset, next) && next.version == first.version && next.layer == first.layer && next.sample_rate == first.sample_rate;
+}
+
+/**
+ * @brief Finds the format of a file from its first bytes.
+ *
+ * @details ID3v2 tags in front of the audio are skipped, since they are
+ *          found on MP3 files and sometimes on FLAC files. An MP3 file may
+ *          also start with junk before its first frame: a file named .mp3
+ *          whose head holds two consecutive MPEG frames counts as MP3, and so
+ *          does one with an ID3v2 tag and nothing else recognisable. Anything
+ *          else, whatever its name, is FormatUnknown, so misnamed files such
+ *          as pictures or cue sheets are skipped without a TagLib open.
+ *
+ * @param[in] file The file, whose head has been read.
+ * @param[in] path The path of the file, for the MP3 junk rule.
+ *
+ * @return The format of the file.
+ */
+AudioFormat detectFormat(PositionedFile &file, const std::string &path) {
+    int64_t offset = 0;
+    bool has_id3v2 = false;
+    unsigned char probe[10];
+    while (file.read(offset, probe, 10) && memcmp(probe, "ID3", 3) == 0) {
+        if ((probe[6] | probe[7] | probe[8] | probe[9]) & 0x80)
+            break;
+        uint32_t size = (probe[6] << 21) | (probe[7] << 14) | (probe[8] << 7) | probe[9];
+        offset += 10 + size + ((probe[3] == 4 && (probe[5] & 0x10)) ? 10 : 0);
+        has_id3v2 = true;
+    }
+
+    // A tag that claims to run past the end of the file leaves no audio.
+    if (offset >= file.size())
+        return FormatUnknown;
+    std::string start;
+    if (!file.read(offset, start, (size_t)std::min<int64_t>(file.size() - offset, 512)))
+        return has_id3v2 ? FormatMp3 : FormatUnknown;
+    auto startsWith = [&](size_t at, const char *magic) { return start.size() >= at + strlen(magic) && start.compare(at, strlen(magic), magic) == 0; };
+
+    if (startsWith(0, "fLaC"))
+        return FormatFlac;
+    if (startsWith(0, "OggS") && start.size() > 27) {
+        // The codec is named by the first packet of the first page.
+        size_t packet = 27 + (unsigned char)start[26];
+        if (startsWith(packet, "\x01vorbis"))
+            return FormatOggVorbis;
+        if (startsWith(packet, "OpusHead"))
+            return FormatOggOpus;
+        if (startsWith(packet, "\x7f" "FLAC") || startsWith(packet, "fLaC"))
+            return FormatOggFlac;
+        return FormatUnknown;
+    }
+    if (startsWith(4, "ftyp"))
+        return FormatMp4;
+    if (startsWith(0, "wvpk"))
+        return FormatWavPack;
+    if (startsWith(0, "RIFF") && startsWith(8, "WAVE"))
+        return FormatWav;
+    if (startsWith(0, "FORM") && (startsWith(8, "AIFF") || startsWith(8, "AIFC")))
+        return FormatAiff;
+    if (hasMpegFrames(start, 0) || has_id3v2)
+        return FormatMp3;
+    if (endsWithIgnoreCase(path.c_str(), path.size(), ".mp3")) {
+        const std::string &head = file.head();
+        for (size_t i = 0; i + 4 <= head.size(); i++) {
+            if ((unsigned char)head[i] == 0xFF && hasMpegFrames(head, i))
+                return FormatMp3;
+        }
+    }
+    return FormatUnknown;
+}
+
+/**
+ * @brief Logs how many files of each format were read, and how.
+ *
+ * @param[in] counters The counters of a scan, indexed by AudioFormat.
+ */
+void logFormatCounters(const FormatCounters *counters) {
+    for (const FormatHandler &handler : formatHandlers()) {
+        const FormatCounters &format = counters[handler.format];
+        if (format.files > 0)
+            log("%s: %llu files, %llu read by the fast parser, %llu by TagLib, %llu failed\n", handler.name, (unsigned long long)format.files,
+                (unsigned long long)format.fast, (unsigned long long)format.taglib, (unsigned long long)format.failed);
+    }
+    if (counters[FormatUnknown].files > 0)
+        log("Skipped %llu files that are not audio.\n", (unsigned long long)counters[FormatUnknown].files);
+}
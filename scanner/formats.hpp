@@ -0,0 +1,107 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace TagLib {
+class AudioProperties;
+class File;
+}
+
+#define FORMAT_HEAD_SIZE (16 * 1024)  // read in one call, for sniffing and for the fast parser
+
+/**
+ * @brief A file read through positioned reads only, with its first bytes
+ *        kept in memory.
+ */
+class PositionedFile {
+   public:
+    explicit PositionedFile(const std::string &path);
+    ~PositionedFile();
+
+    PositionedFile(const PositionedFile &) = delete;
+    PositionedFile &operator=(const PositionedFile &) = delete;
+
+    bool isOpen() const { return length >= 0; }
+    int64_t size() const { return length; }
+    const std::string &head() const { return window; }  // the first FORMAT_HEAD_SIZE bytes, or the whole file
+
+    bool read(int64_t offset, void *buffer, size_t count);
+    bool read(int64_t offset, std::string &buffer, size_t count);
+
+   private:
+    bool readFromDisk(int64_t offset, char *buffer, size_t count);
+
+#ifdef _WIN32
+    void *handle = NULL;
+#else
+    int fd = -1;
+#endif
+    int64_t length = -1;
+    std::string window;
+};
+
+/**
+ * @brief The formats the scanner reads. FormatUnknown stands for files whose
+ *        contents are not audio, whatever their name says.
+ */
+enum AudioFormat {
+    FormatUnknown = 0,
+    FormatMp3,
+    FormatFlac,
+    FormatOggVorbis,
+    FormatOggOpus,
+    FormatOggFlac,
+    FormatMp4,
+    FormatWavPack,
+    FormatWav,
+    FormatAiff,
+    FormatCount
+};
+
+/**
+ * @brief A valid MPEG audio frame header.
+ */
+struct MpegHeader {
+    int version;  // 1, 2, or 3 for MPEG 2.5
+    int layer;
+    int bitrate;  // in kb/s
+    int sample_rate;
+    int channels;
+    int samples_per_frame;
+    int frame_length;
+};
+
+bool parseMpegHeader(const unsigned char *p, MpegHeader &header);
+
+/**
+ * @brief How one format is recognised and read.
+ */
+struct FormatHandler {
+    AudioFormat format;
+    const char *name;
+    std::vector<std::string> extensions;  // lower case with the dot
+    bool fast_tags;                       // whether readFastTags can read it
+    TagLib::File *(*open)(const char *path, bool accurate);         // the TagLib reader, with audio properties
+    int (*bits_per_sample)(const TagLib::AudioProperties *properties);  // NULL for formats without one
+};
+
+/**
+ * @brief What a scan did with the files of one format. A scan keeps one per
+ *        format in its ScanStats, and extractFile counts each file in it.
+ */
+struct FormatCounters {
+    std::atomic<uint64_t> files{0};   // files found to be in the format
+    std::atomic<uint64_t> fast{0};    // of those, read by the fast parser
+    std::atomic<uint64_t> taglib{0};  // read by TagLib
+    std::atomic<uint64_t> failed{0};  // not readable, or for FormatUnknown, not audio
+};
+
+const std::vector<FormatHandler> &formatHandlers();
+const FormatHandler *formatHandler(AudioFormat format);
+AudioFormat detectFormat(PositionedFile &file, const std::string &path);
+
+void logFormatCounters(const FormatCounters *counters);
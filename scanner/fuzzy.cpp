@@ -0,0 +1,286 @@
+#include "fuzzy.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <shared_mutex>
+
+#include "misc.hpp"
+
+#define MAX_PATTERN_LENGTH 64  // query characters verified, one bit each in a uint64_t
+
+/**
+ * @brief A query prepared for Myers' algorithm: for every byte value, the
+ *        positions of the query where it occurs.
+ */
+struct MyersPattern {
+    uint64_t peq[256];
+    int length;
+
+    explicit MyersPattern(const std::string &pattern) {
+        memset(peq, 0, sizeof(peq));
+        length = std::min<size_t>(pattern.size(), MAX_PATTERN_LENGTH);
+        for (int i = 0; i < length; i++)
+            peq[(unsigned char)pattern[i]] |= (uint64_t)1 << i;
+    }
+};
+
+/**
+ * @brief Computes the smallest edit distance between the pattern and any
+ *        substring of the text, with Myers' bit-vector algorithm.
+ *
+ * @details One column of the dynamic programming matrix is kept as bit
+ *          vectors of vertical deltas, so each text character costs a
+ *          handful of word operations whatever the pattern length. The first
+ *          row is left at zero, which lets a match start anywhere in the
+ *          text.
+ *
+ * @return The distance, stopping early once it reaches 0.
+ */
+static int substringDistance(const MyersPattern &pattern, const std::string &text) {
+    uint64_t high = (uint64_t)1 << (pattern.length - 1);
+    uint64_t pv = ~(uint64_t)0, mv = 0;
+    int score = pattern.length, best = pattern.length;
+    for (unsigned char c : text) {
+        uint64_t eq = pattern.peq[c];
+        uint64_t xv = eq | mv;
+        uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+        uint64_t ph = mv | ~(xh | pv);
+        uint64_t mh = pv & xh;
+        if (ph & high)
+            score++;
+        else if (mh & high)
+            score--;
+        ph <<= 1;
+        mh <<= 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+        if (score < best && (best = score) == 0)
+            break;
+    }
+    return best;
+}
+
+/**
+ * @brief The number of edits tolerated for a query of a given length.
+ */
+static int maxDistance(size_t query_length) {
+    if (query_length < 4)
+        return 0;
+    if (query_length < 8)
+        return 1;
+    return 2;
+}
+
+static uint32_t trigram(const char *text) {
+    return ((uint32_t)(unsigned char)text[0] << 16) | ((uint32_t)(unsigned char)text[1] << 8) | (unsigned char)text[2];
+}
+
+void FuzzyIndex::clear() {
+    items.clear();
+    folded.clear();
+    postings.clear();
+    present.clear();
+}
+
+/**
+ * @brief Adds a name. It is folded and given a leading space, so that the
+ *        start of the name has trigrams of its own. Adding the same
+ *        kind and id twice does nothing.
+ */
+void FuzzyIndex::insert(int kind, int id, const std::string &name) {
+    if (name.empty() || !present.insert(((uint64_t)(uint32_t)kind << 32) | (uint32_t)id).second)
+        return;
+    uint32_t item = items.size();
+    items.push_back({kind, id, name});
+    folded.push_back(" " + foldName(name));
+
+    const std::string &padded = folded.back();
+    for (size_t i = 0; i + 3 <= padded.size(); i++) {
+        std::vector<uint32_t> &posting = postings[trigram(padded.data() + i)];
+        if (posting.empty() || posting.back() != item)
+            posting.push_back(item);
+    }
+}
+
+/**
+ * @brief Finds the names containing the query with the fewest edits.
+ *
+ * @details Up to 2 edits are tolerated, depending on the query length.
+ *          Queries shorter than 3 characters are matched at the start of
+ *          words only, and without edits. Only the first 64 characters of a
+ *          query are compared. Queries too short to keep a trigram through
+ *          their edits are verified against every name.
+ *
+ * @param[in] query The text to look for.
+ * @param[in] limit The largest number of matches to return.
+ *
+ * @return The best matches, best first. Ties go to the shorter name.
+ */
+std::vector<FuzzyMatch> FuzzyIndex::search(const std::string &query, size_t limit) const {
+    std::vector<FuzzyMatch> matches;
+    std::string pattern = foldName(query);
+    if (pattern.size() < 3)
+        pattern = " " + pattern;
+    if (pattern.size() < 3 || limit == 0)
+        return matches;
+    pattern.resize(std::min<size_t>(pattern.size(), MAX_PATTERN_LENGTH));
+
+    std::vector<uint32_t> trigrams;
+    for (size_t i = 0; i + 3 <= pattern.size(); i++)
+        trigrams.push_back(trigram(pattern.data() + i));
+    std::sort(trigrams.begin(), trigrams.end());
+    trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+
+    int max_distance = maxDistance(pattern.size());
+    int needed = (int)trigrams.size() - 3 * max_distance;
+
+    std::vector<uint32_t> candidates;
+    if (needed <= 0) {
+        // Every trigram of a short query can be broken by its edits, as in
+        // "quien" for "queen", so no name can be ruled out by them.
+        candidates.resize(items.size());
+        for (uint32_t item = 0; item < items.size(); item++)
+            candidates[item] = item;
+    } else {
+        std::vector<uint8_t> counts(items.size(), 0);  // at most 62 trigrams per query
+        for (uint32_t key : trigrams) {
+            auto it = postings.find(key);
+            if (it == postings.end())
+                continue;
+            for (uint32_t item : it->second) {
+                if (++counts[item] == needed)
+                    candidates.push_back(item);
+            }
+        }
+    }
+
+    MyersPattern prepared(pattern);
+    for (uint32_t item : candidates) {
+        const std::string &name = folded[item];
+        int distance = substringDistance(prepared, name);
+        if (distance > max_distance)
+            continue;
+        // Prefer names that the query covers more of, so that "queen" ranks
+        // the artist above every song with "queen" somewhere in its title.
+        double coverage = (double)prepared.length / std::max<size_t>(prepared.length, name.size() - 1);
+        double score = (1.0 - (double)distance / prepared.length) * (0.9 + 0.1 * coverage);
+        matches.push_back({&items[item], distance, score});
+    }
+
+    auto better = [](const FuzzyMatch &a, const FuzzyMatch &b) {
+        if (a.score != b.score)
+            return a.score > b.score;
+        if (a.item->name.size() != b.item->name.size())
+            return a.item->name.size() < b.item->name.size();
+        return a.item < b.item;
+    };
+    if (matches.size() > limit) {
+        std::partial_sort(matches.begin(), matches.begin() + limit, matches.end(), better);
+        matches.resize(limit);
+    } else
+        std::sort(matches.begin(), matches.end(), better);
+    return matches;
+}
+
+// The index served by fuzzyQuery, and the database it was built from.
+static std::shared_mutex fuzzy_mutex;
+static FuzzyIndex fuzzy_index;
+static std::string fuzzy_database;
+
+/**
+ * @brief Tells whether the fuzzy index was built from the database of a
+ *        connection, and so should follow its changes.
+ */
+bool fuzzyIndexFollows(sqlite3 *db) {
+    const char *filename = sqlite3_db_filename(db, "main");
+    std::shared_lock<std::shared_mutex> lock(fuzzy_mutex);
+    return filename != NULL && !fuzzy_database.empty() && fuzzy_database == filename;
+}
+
+/**
+ * @brief Adds names just committed to a database to the fuzzy index, if it
+ *        was built from that database.
+ */
+void addToFuzzyIndex(sqlite3 *db, const std::vector<CompletionItem> &added) {
+    if (added.empty() || !fuzzyIndexFollows(db))
+        return;
+    std::unique_lock<std::shared_mutex> lock(fuzzy_mutex);
+    for (const CompletionItem &item : added)
+        fuzzy_index.insert(item.kind, item.id, item.name);
+}
+
+/**
+ * @brief Rebuilds the fuzzy index from a database, if it was built from that
+ *        database.
+ */
+void reloadFuzzyIndex(sqlite3 *db) {
+    if (!fuzzyIndexFollows(db))
+        return;
+    FuzzyIndex rebuilt;
+    if (forEachName(db, [&](int kind, int id, const std::string &name) { rebuilt.insert(kind, id, name); }) != 0)
+        return;
+    std::unique_lock<std::shared_mutex> lock(fuzzy_mutex);
+    std::swap(fuzzy_index, rebuilt);
+}
+
+/**
+ * @brief Builds the fuzzy index from the song, album, artist and genre names
+ *        of a database.
+ *
+ * @details From then on, scans and the watcher keep the index up to date
+ *          while they write to the same database.
+ *
+ * @param[in] db_path The path to the database file.
+ *
+ * @return The number of names indexed, or -1 on failure.
+ */
+int fuzzyLoad(const char *db_path) {
+    sqlite3 *db;
+    if (sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+        logError("Can't open database %s: %s\n", db_path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return -1;
+    }
+    FuzzyIndex loaded;
+    int rc = forEachName(db, [&](int kind, int id, const std::string &name) { loaded.insert(kind, id, name); });
+    const char *filename = sqlite3_db_filename(db, "main");
+    std::string database = filename != NULL ? filename : "";
+    sqlite3_close(db);
+    if (rc != 0)
+        return -1;
+
+    std::unique_lock<std::shared_mutex> lock(fuzzy_mutex);
+    std::swap(fuzzy_index, loaded);
+    fuzzy_database = database;
+    return fuzzy_index.size();
+}
+
+/**
+ * @brief Looks up names close to a possibly misspelt query in the index
+ *        built by fuzzyLoad.
+ *
+ * @param[in] query The text typed by the user.
+ * @param[in] limit The largest number of matches to return.
+ *
+ * @return A JSON array of {"kind", "id", "name", "score"} objects, best
+ *         first, kind being a CompletionKind and score between 0 and 1. To be
+ *         released with scanFreeString.
+ */
+char *fuzzyQuery(const char *query, int limit) {
+    nlohmann::json result = nlohmann::json::array();
+    {
+        std::shared_lock<std::shared_mutex> lock(fuzzy_mutex);
+        for (const FuzzyMatch &match : fuzzy_index.search(query, std::max(limit, 0))) {
+            nlohmann::json entry;
+            entry["kind"] = match.item->kind;
+            entry["id"] = match.item->id;
+            entry["name"] = match.item->name;
+            entry["score"] = match.score;
+            result.push_back(entry);
+        }
+    }
+    return strdup(result.dump().c_str());
+}
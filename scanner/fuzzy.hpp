@@ -0,0 +1,53 @@
+#pragma once
+
+#include <sqlite3.h>
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "trie.hpp"
+
+/**
+ * @brief One result of FuzzyIndex::search.
+ */
+struct FuzzyMatch {
+    const CompletionItem *item;
+    int distance;  // edits between the query and the best matching part of the name
+    double score;  // 1 for an exact match, falling towards 0 with each edit
+};
+
+/**
+ * @brief A typo tolerant index of names, built from trigram posting lists.
+ *
+ * @details A search first counts, for every name, how many of the query's
+ *          trigrams it contains, using the posting lists. A name in which the
+ *          query appears with at most d edits shares all but at most 3d of
+ *          them, so names below that count are skipped without looking at
+ *          them; when that bound is zero, every name is a candidate. The remaining candidates are verified with Myers'
+ *          bit-parallel edit distance, which handles 64 characters of the
+ *          query per machine word. Names are folded with foldName first.
+ */
+class FuzzyIndex {
+   public:
+    void insert(int kind, int id, const std::string &name);
+    std::vector<FuzzyMatch> search(const std::string &query, size_t limit) const;
+    void clear();
+    size_t size() const { return items.size(); }
+
+   private:
+    std::vector<CompletionItem> items;
+    std::vector<std::string> folded;                              // folded name of each item, after a space
+    std::unordered_map<uint32_t, std::vector<uint32_t>> postings;  // trigram -> items, in increasing order
+    std::unordered_set<uint64_t> present;                          // kind and id of every item
+};
+
+bool fuzzyIndexFollows(sqlite3 *db);
+void addToFuzzyIndex(sqlite3 *db, const std::vector<CompletionItem> &added);
+void reloadFuzzyIndex(sqlite3 *db);
+
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) int fuzzyLoad(const char *db_path);
+
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) char *fuzzyQuery(const char *query, int limit);
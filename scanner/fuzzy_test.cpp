@@ -0,0 +1,67 @@
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "fuzzy.hpp"
+#include "trie.hpp"
+
+static int failures = 0;
+
+/**
+ * @brief Checks whether a search finds a name, and at which distance.
+ */
+static void expect(const FuzzyIndex &index, const std::string &query, const std::string &name, int distance) {
+    for (const FuzzyMatch &match : index.search(query, 10)) {
+        if (match.item->name == name) {
+            if (match.distance != distance) {
+                printf("\"%s\" finds %s at distance %d instead of %d\n", query.c_str(), name.c_str(), match.distance, distance);
+                failures++;
+            }
+            return;
+        }
+    }
+    if (distance >= 0) {
+        printf("\"%s\" does not find %s\n", query.c_str(), name.c_str());
+        failures++;
+    }
+}
+
+/**
+ * @brief Tests FuzzyIndex on a few names, most of all on short queries with
+ *        one edit, whose trigrams can all be broken by it.
+ *
+ * @return 0 if every search finds what it should, 1 otherwise.
+ */
+int main() {
+    FuzzyIndex index;
+    const char *names[] = {"Queen", "Adele", "Abba", "Bohemian Rhapsody", "Rolling in the Deep", "The Beatles", "Metallica"};
+    int id = 1;
+    for (const char *name : names)
+        index.insert(CompleteArtist, id++, name);
+
+    // Exact, and one edit at either end or in the middle of 4 and 5
+    // character queries.
+    expect(index, "queen", "Queen", 0);
+    expect(index, "quien", "Queen", 1);
+    expect(index, "qeen", "Queen", 1);
+    expect(index, "quen", "Queen", 1);
+    expect(index, "queem", "Queen", 1);
+    expect(index, "adle", "Adele", 1);
+    expect(index, "abele", "Adele", 1);
+    expect(index, "adelle", "Adele", 1);
+    expect(index, "abab", "Abba", 1);
+    expect(index, "aba", "Abba", -1);  // too short for edits
+
+    // Longer queries, inside longer names.
+    expect(index, "rapsody", "Bohemian Rhapsody", 1);
+    expect(index, "the beatels", "The Beatles", 2);
+    expect(index, "metalica", "Metallica", 1);
+    expect(index, "deep", "Rolling in the Deep", 0);
+
+    // Names more than the tolerated edits away are not found.
+    expect(index, "quxxn", "Queen", -1);
+    expect(index, "zzzz", "Abba", -1);
+
+    printf("%d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
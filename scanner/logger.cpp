@@ -0,0 +1,443 @@
+#include "logger.hpp"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#define LOG_RING_SIZE 1024       // messages waiting to be written; a power of two
+#define LOG_MESSAGE_SIZE 480     // longer messages are cut short
+#define LOG_DRAIN_INTERVAL_MS 200
+#define LOG_RATE_SITES 128       // call sites whose warnings and errors are rate-limited
+#define LOG_RATE_WINDOW_MS 10000
+#define LOG_RATE_BURST 20        // messages let through per call site and window
+
+static const char *const k_level_names[] = {"debug", "info", "warning", "error"};
+
+/**
+ * @brief A message waiting in the ring. sequence tells producers and the
+ *        consumer whose turn the slot is.
+ */
+struct LogSlot {
+    std::atomic<size_t> sequence;
+    LogLevel level;
+    unsigned int thread;
+    int64_t time_ms;
+    char text[LOG_MESSAGE_SIZE];
+};
+
+/**
+ * @brief How many warnings and errors one call site, identified by its format
+ *        string, logged in the current window.
+ */
+struct RateSite {
+    std::atomic<const char *> fmt{NULL};
+    std::atomic<int64_t> window_start{0};
+    std::atomic<unsigned int> count{0};
+    std::atomic<unsigned int> suppressed{0};
+};
+
+/**
+ * @brief Writes log messages to a file from a background thread.
+ *
+ * @details Threads that log format their message straight into a slot of a
+ *          bounded ring (Dmitry Vyukov's queue) and go on; claiming a slot is
+ *          a compare-and-swap, so logging never takes a lock or touches the
+ *          disk. If the ring is full the message is dropped and counted.
+ *
+ *          One thread drains the ring every LOG_DRAIN_INTERVAL_MS, or sooner
+ *          when the ring is filling up, and writes the messages to a file it
+ *          keeps open, rotating it when it grows past max_bytes. Everything
+ *          that writes holds write_mutex, which producers never take.
+ *
+ *          A call site that logs more than LOG_RATE_BURST warnings or errors
+ *          in LOG_RATE_WINDOW_MS, such as one message per unreadable file,
+ *          is muted for the rest of the window, and the drain thread writes
+ *          how many of its messages were left out.
+ */
+class Logger {
+   public:
+    Logger();
+
+    void push(LogLevel level, const char *fmt, va_list args);
+    void configure(const LogOptions &options);
+    void flush();
+    void shutdown();
+
+    std::atomic<int> min_level{LogInfo};
+
+   private:
+    bool allow(const char *fmt, int64_t now_ms);
+    void drainLoop();
+    void drain(bool all_suppressed);
+    void write(const LogSlot &slot);
+    void writeLine(LogLevel level, unsigned int thread, int64_t time_ms, const char *text);
+    void openFile();
+    void rotate();
+
+    std::unique_ptr<LogSlot[]> slots;
+    std::atomic<size_t> head{0};
+    size_t tail = 0;  // only moved under write_mutex
+    std::atomic<size_t> dropped{0};
+    RateSite sites[LOG_RATE_SITES];
+
+    std::mutex write_mutex;
+    LogOptions options;
+    FILE *file = NULL;
+    size_t file_size = 0;
+
+    std::mutex wake_mutex;
+    std::condition_variable wake;
+    std::atomic<bool> stopped{false};
+    std::thread thread;
+};
+
+static int64_t nowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static unsigned int threadNumber() {
+    static std::atomic<unsigned int> next{1};
+    thread_local unsigned int number = next.fetch_add(1);
+    return number;
+}
+
+Logger::Logger() : slots(new LogSlot[LOG_RING_SIZE]) {
+    for (size_t i = 0; i < LOG_RING_SIZE; i++)
+        slots[i].sequence.store(i, std::memory_order_relaxed);
+    thread = std::thread([this] { drainLoop(); });
+}
+
+/**
+ * @brief Formats a message into the ring, or drops it if the ring is full or
+ *        its call site is being rate-limited. Never blocks.
+ */
+void Logger::push(LogLevel level, const char *fmt, va_list args) {
+    int64_t now = nowMs();
+    if (level >= LogWarning && !allow(fmt, now))
+        return;
+
+    if (stopped.load(std::memory_order_acquire)) {
+        // After shutdown, during exit, there is no thread left to drain the
+        // ring, so the message is written at once.
+        char text[LOG_MESSAGE_SIZE];
+        vsnprintf(text, sizeof(text), fmt, args);
+        std::lock_guard<std::mutex> lock(write_mutex);
+        writeLine(level, threadNumber(), now, text);
+        if (file)
+            fflush(file);
+        return;
+    }
+
+    size_t pos = head.load(std::memory_order_relaxed);
+    LogSlot *slot;
+    for (;;) {
+        slot = &slots[pos & (LOG_RING_SIZE - 1)];
+        size_t sequence = slot->sequence.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0) {
+            if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            pos = head.load(std::memory_order_relaxed);
+        }
+    }
+    slot->level = level;
+    slot->thread = threadNumber();
+    slot->time_ms = now;
+    int length = vsnprintf(slot->text, LOG_MESSAGE_SIZE, fmt, args);
+    if (length >= LOG_MESSAGE_SIZE)
+        memcpy(slot->text + LOG_MESSAGE_SIZE - 5, "...\n", 5);
+    slot->sequence.store(pos + 1, std::memory_order_release);
+
+    // The drain thread wakes up on its own soon enough, unless the ring is
+    // filling up faster than that.
+    if ((pos & (LOG_RING_SIZE / 4 - 1)) == 0)
+        wake.notify_one();
+}
+
+/**
+ * @brief Counts a warning or error against its call site, and returns whether
+ *        it may be logged.
+ */
+bool Logger::allow(const char *fmt, int64_t now_ms) {
+    size_t start = ((uintptr_t)fmt >> 4) % LOG_RATE_SITES;
+    RateSite *site = NULL;
+    for (size_t i = 0; i < LOG_RATE_SITES && !site; i++) {
+        RateSite &candidate = sites[(start + i) % LOG_RATE_SITES];
+        const char *owner = candidate.fmt.load(std::memory_order_acquire);
+        if (owner == NULL && candidate.fmt.compare_exchange_strong(owner, fmt, std::memory_order_acq_rel))
+            owner = fmt;
+        if (owner == fmt)
+            site = &candidate;
+    }
+    if (!site)
+        return true;  // too many call sites to keep track of
+
+    int64_t window_start = site->window_start.load(std::memory_order_relaxed);
+    if (now_ms - window_start >= LOG_RATE_WINDOW_MS &&
+        site->window_start.compare_exchange_strong(window_start, now_ms, std::memory_order_relaxed))
+        site->count.store(0, std::memory_order_relaxed);
+    if (site->count.fetch_add(1, std::memory_order_relaxed) < LOG_RATE_BURST)
+        return true;
+    site->suppressed.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+void Logger::drainLoop() {
+    while (!stopped.load(std::memory_order_acquire)) {
+        {
+            std::unique_lock<std::mutex> lock(wake_mutex);
+            wake.wait_for(lock, std::chrono::milliseconds(LOG_DRAIN_INTERVAL_MS));
+        }
+        std::lock_guard<std::mutex> lock(write_mutex);
+        if (!stopped.load(std::memory_order_acquire))
+            drain(false);
+    }
+}
+
+/**
+ * @brief Writes the messages in the ring, then notes dropped and suppressed
+ *        messages. Needs write_mutex.
+ *
+ * @param[in] all_suppressed Whether to note messages suppressed in windows
+ *                           that are still open, as when shutting down.
+ */
+void Logger::drain(bool all_suppressed) {
+    for (;;) {
+        LogSlot &slot = slots[tail & (LOG_RING_SIZE - 1)];
+        if (slot.sequence.load(std::memory_order_acquire) != tail + 1)
+            break;  // empty, or the next message is still being formatted
+        write(slot);
+        slot.sequence.store(tail + LOG_RING_SIZE, std::memory_order_release);
+        tail++;
+    }
+
+    int64_t now = nowMs();
+    char text[LOG_MESSAGE_SIZE];
+    size_t lost = dropped.exchange(0, std::memory_order_relaxed);
+    if (lost) {
+        snprintf(text, sizeof(text), "Dropped %zu messages logged faster than they could be written.\n", lost);
+        writeLine(LogWarning, 0, now, text);
+    }
+    for (RateSite &site : sites) {
+        const char *fmt = site.fmt.load(std::memory_order_acquire);
+        if (!fmt || (!all_suppressed && now - site.window_start.load(std::memory_order_relaxed) < LOG_RATE_WINDOW_MS))
+            continue;
+        unsigned int suppressed = site.suppressed.exchange(0, std::memory_order_relaxed);
+        if (suppressed) {
+            snprintf(text, sizeof(text), "Suppressed %u more messages like: %s", suppressed, fmt);
+            writeLine(LogWarning, 0, now, text);
+        }
+    }
+    if (file)
+        fflush(file);
+}
+
+void Logger::write(const LogSlot &slot) {
+    writeLine(slot.level, slot.thread, slot.time_ms, slot.text);
+}
+
+/**
+ * @brief Writes one line as "[time] [level] [thread] message", rotating the
+ *        file first if it is full. Needs write_mutex.
+ */
+void Logger::writeLine(LogLevel level, unsigned int thread, int64_t time_ms, const char *text) {
+    if (!file)
+        openFile();
+    if (!file)
+        return;
+    if (options.max_bytes && file_size >= options.max_bytes)
+        rotate();
+
+    time_t seconds = (time_t)(time_ms / 1000);
+    struct tm local;
+#ifdef _WIN32
+    localtime_s(&local, &seconds);
+#else
+    localtime_r(&seconds, &local);
+#endif
+    char time_string[64];
+    strftime(time_string, sizeof(time_string), "%Y-%m-%d %H:%M:%S", &local);
+    size_t length = strlen(text);
+    int written = fprintf(file, "[%s.%03d] [%s] [t%u] %s%s", time_string, (int)(time_ms % 1000), k_level_names[level],
+                          thread, text, length && text[length - 1] == '\n' ? "" : "\n");
+    if (written > 0)
+        file_size += written;
+}
+
+void Logger::openFile() {
+    file = fopen(options.path.c_str(), "a");
+    struct stat st;
+    file_size = file && stat(options.path.c_str(), &st) == 0 ? (size_t)st.st_size : 0;
+}
+
+/**
+ * @brief Moves path to path.1, path.1 to path.2 and so on, dropping the
+ *        oldest, and starts a new file. Needs write_mutex.
+ */
+void Logger::rotate() {
+    fclose(file);
+    file = NULL;
+    if (options.keep_files == 0) {
+        remove(options.path.c_str());
+    } else {
+        remove((options.path + "." + std::to_string(options.keep_files)).c_str());
+        for (unsigned int i = options.keep_files; i > 1; i--)
+            rename((options.path + "." + std::to_string(i - 1)).c_str(), (options.path + "." + std::to_string(i)).c_str());
+        rename(options.path.c_str(), (options.path + ".1").c_str());
+    }
+    openFile();
+}
+
+/**
+ * @brief Writes what is already logged to the old file, then switches to the
+ *        new options.
+ */
+void Logger::configure(const LogOptions &new_options) {
+    min_level.store(new_options.level, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(write_mutex);
+    drain(false);
+    if (file && new_options.path != options.path) {
+        fclose(file);
+        file = NULL;
+    }
+    options = new_options;
+}
+
+void Logger::flush() {
+    std::lock_guard<std::mutex> lock(write_mutex);
+    drain(false);
+}
+
+/**
+ * @brief Stops the drain thread and writes everything still in the ring.
+ *        Messages logged afterwards are written at once.
+ */
+void Logger::shutdown() {
+    {
+        std::lock_guard<std::mutex> lock(write_mutex);
+        if (stopped.exchange(true))
+            return;
+    }
+    wake.notify_one();
+#ifdef _WIN32
+    // Windows ends the other threads before running atexit handlers in a DLL,
+    // and joining them there can deadlock on the loader lock.
+    thread.detach();
+#else
+    thread.join();
+#endif
+    std::lock_guard<std::mutex> lock(write_mutex);
+    drain(true);
+    if (file) {
+        fclose(file);
+        file = NULL;
+    }
+}
+
+/**
+ * @brief Returns the process's logger, starting it on first use. It is never
+ *        destroyed, so that destructors running at exit can still log.
+ */
+static Logger &logger() {
+    static Logger *instance = [] {
+        Logger *created = new Logger();
+        atexit([] { logger().shutdown(); });
+        return created;
+    }();
+    return *instance;
+}
+
+/**
+ * @brief Sets where the log is written, when it is rotated and the lowest
+ *        level logged. Messages logged before are written to the old path.
+ */
+void configureLog(const LogOptions &options) {
+    logger().configure(options);
+}
+
+/**
+ * @brief Parses "debug", "info", "warning" or "error".
+ *
+ * @return Whether name is a level.
+ */
+bool parseLogLevel(const std::string &name, LogLevel &level) {
+    for (int i = LogDebug; i <= LogError; i++) {
+        if (name == k_level_names[i]) {
+            level = (LogLevel)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Writes everything logged so far. Blocks until it is on disk, so hot
+ *        paths should not call it.
+ */
+void flushLog() {
+    logger().flush();
+}
+
+#define LOG_WITH_LEVEL(level)                                                  \
+    do {                                                                       \
+        Logger &l = logger();                                                  \
+        if ((level) < l.min_level.load(std::memory_order_relaxed))             \
+            return;                                                            \
+        va_list args;                                                          \
+        va_start(args, fmt);                                                   \
+        l.push((level), fmt, args);                                            \
+        va_end(args);                                                          \
+    } while (0)
+
+/**
+ * @brief Logs a formatted message at the info level.
+ *
+ * @details The message is formatted like printf and timestamped at once, and
+ *          written to the log file by a background thread; the caller never
+ *          waits for the disk. See Logger.
+ *
+ * @param[in] fmt The format string, followed by any additional arguments
+ *                required by the format specifiers.
+ */
+void log(const char *fmt, ...) {
+    LOG_WITH_LEVEL(LogInfo);
+}
+
+/**
+ * @brief Logs a formatted message at the given level.
+ */
+void logAt(LogLevel level, const char *fmt, ...) {
+    LOG_WITH_LEVEL(level);
+}
+
+/**
+ * @brief Logs a formatted warning, such as a file that is skipped. Repeated
+ *        warnings from one call site are rate-limited.
+ */
+void logWarning(const char *fmt, ...) {
+    LOG_WITH_LEVEL(LogWarning);
+}
+
+/**
+ * @brief Logs a formatted error. Repeated errors from one call site are
+ *        rate-limited.
+ */
+void logError(const char *fmt, ...) {
+    LOG_WITH_LEVEL(LogError);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#define LOG_LOCATION "./log.txt"  // used until configureLog is called
+
+enum LogLevel {
+    LogDebug = 0,
+    LogInfo = 1,
+    LogWarning = 2,
+    LogError = 3
+};
+
+/**
+ * @brief Where and what the logger writes.
+ */
+struct LogOptions {
+    std::string path = LOG_LOCATION;
+    size_t max_bytes = 4 * 1024 * 1024;  // the file is rotated once it grows past this, 0 = never
+    unsigned int keep_files = 3;         // rotated files kept as path.1 to path.N
+    LogLevel level = LogInfo;            // messages below this level are dropped
+};
+
+void configureLog(const LogOptions &options);
+bool parseLogLevel(const std::string &name, LogLevel &level);
+void flushLog();
+
+void log(const char *fmt, ...);
+void logAt(LogLevel level, const char *fmt, ...);
+void logWarning(const char *fmt, ...);
+void logError(const char *fmt, ...);
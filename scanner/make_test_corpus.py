@@ -0,0 +1,118 @@
+#!/usr/bin/env python3
+"""Writes the corpus the fast tag parser is tested on (see test.cpp).
+
+usage: make_test_corpus.py <directory>
+
+Every file is a small but well formed MP3 or FLAC file, tagged with mutagen.
+The files in fast/ use frames, encodings or layouts the fast parser reads
+itself, and those in taglib/ ones it has to hand over to TagLib; test.cpp
+checks that each file takes its path and that both agree with TagLib on
+every field.
+"""
+
+import os
+import struct
+import sys
+
+from mutagen.flac import FLAC, Picture
+from mutagen.id3 import APIC, ID3, TALB, TCON, TDRC, TIT2, TPE1, TPE2, TPOS, TRCK, TXXX, Encoding
+
+
+def mp3_audio(frames=200, xing=False):
+    # MPEG-1 Layer III, 128 kb/s, 44100 Hz, joint stereo: 417 bytes per frame
+    # without padding.
+    header = bytes([0xFF, 0xFB, 0x90, 0x40])
+    out = b""
+    for i in range(frames):
+        body = bytearray(417 - 4)
+        if xing and i == 0:
+            body[32:36] = b"Xing"
+            body[36:40] = struct.pack(">I", 3)
+            body[40:44] = struct.pack(">I", 1000)
+            body[44:48] = struct.pack(">I", 1000 * 300)
+        out += header + bytes(body)
+    return out
+
+
+def basic(tag, encoding=Encoding.UTF8):
+    tag.add(TIT2(encoding=encoding, text=["Tïtle ☃"]))
+    tag.add(TPE1(encoding=encoding, text=["Ärtist; Other"]))
+    tag.add(TALB(encoding=encoding, text=["Album"]))
+    tag.add(TPE2(encoding=encoding, text=["Album Artist"]))
+    tag.add(TCON(encoding=encoding, text=["Rock"]))
+    tag.add(TRCK(encoding=encoding, text=["3/12"]))
+    tag.add(TPOS(encoding=encoding, text=["2/2"]))
+
+
+def latin1(tag):
+    tag.add(TIT2(encoding=Encoding.LATIN1, text=["Caf\xe9"]))
+    tag.add(TPE1(encoding=Encoding.LATIN1, text=["A"]))
+    tag.add(TALB(encoding=Encoding.LATIN1, text=["B"]))
+    tag.add(TCON(encoding=Encoding.LATIN1, text=["Jazz"]))
+    tag.add(TRCK(encoding=Encoding.LATIN1, text=["7"]))
+    tag.add(TDRC(encoding=Encoding.LATIN1, text=["1987"]))
+
+
+def mp3(directory, name, frames, version=4, xing=False, trailer=b""):
+    path = os.path.join(directory, name)
+    with open(path, "wb") as f:
+        f.write(mp3_audio(200, xing) + trailer)
+    tag = ID3()
+    frames(tag)
+    tag.save(path, v2_version=version, padding=lambda info: 64)
+
+
+def picture(data):
+    p = Picture()
+    p.type = 3
+    p.mime = "image/jpeg"
+    p.desc = "d"
+    p.data = data
+    return p
+
+
+def flac(directory, name, comments, pictures=()):
+    path = os.path.join(directory, name)
+    rate, channels, bits, samples = 44100, 2, 16, 44100 * 183 + 77
+    info = struct.pack(">HH", 4096, 4096) + bytes(6)
+    info += struct.pack(">Q", (rate << 44) | ((channels - 1) << 41) | ((bits - 1) << 36) | samples) + bytes(16)
+    with open(path, "wb") as f:
+        f.write(b"fLaC" + bytes([0x80, 0, 0, 34]) + info + os.urandom(300000))
+    f = FLAC(path)
+    f.update(comments)
+    for p in pictures:
+        f.add_picture(p)
+    f.save()
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit(__doc__)
+    directory = os.path.join(sys.argv[1], "fast")
+    os.makedirs(directory, exist_ok=True)
+    mp3(directory, "v24_utf8.mp3", lambda t: (basic(t), t.add(TDRC(encoding=Encoding.UTF8, text=["2001-05-06"]))))
+    mp3(directory, "v24_utf16.mp3", lambda t: (basic(t, Encoding.UTF16), t.add(TDRC(encoding=Encoding.UTF16, text=["1999"]))))
+    mp3(directory, "v24_utf16be.mp3", lambda t: (basic(t, Encoding.UTF16BE), t.add(TDRC(encoding=Encoding.UTF16BE, text=["1999"]))))
+    mp3(directory, "v23_latin1.mp3", latin1, version=3)
+    mp3(directory, "v24_apic.mp3", lambda t: (basic(t), t.add(APIC(encoding=Encoding.UTF16, mime="image/jpeg", type=3, desc="cövér", data=b"\xff\xd8\xff" + os.urandom(5000)))))
+    mp3(directory, "v23_apic_xing.mp3", lambda t: (basic(t, Encoding.UTF16), t.add(APIC(encoding=Encoding.LATIN1, mime="image/png", type=3, desc="", data=b"\x89PNG" + os.urandom(200000)))), version=3, xing=True)
+    mp3(directory, "v24_txxx_other.mp3", lambda t: (basic(t), t.add(TXXX(encoding=Encoding.UTF8, desc="replaygain_track_gain", text=["-3 dB"]))))
+    mp3(directory, "v24_empty.mp3", lambda t: None)
+    mp3(directory, "v24_id3v1_full.mp3", lambda t: (basic(t), t.add(TDRC(encoding=Encoding.UTF8, text=["2001"]))), trailer=b"TAG" + bytes(125))
+    flac(directory, "basic.flac", {"TITLE": "Flac Tïtle", "ARTIST": "A & B", "ALBUM": "Al", "ALBUMARTIST": "AA", "GENRE": "Pop", "TRACKNUMBER": "4", "DISCNUMBER": "1", "date": "2010-01-01"})
+    flac(directory, "pic.flac", {"TITLE": "P"}, pictures=[picture(b"\xff\xd8\xff" + os.urandom(70000)), picture(b"second")])
+    flac(directory, "multi_track.flac", {"TRACKNUMBER": ["4", "5"], "TITLE": "x"})
+
+    directory = os.path.join(sys.argv[1], "taglib")
+    os.makedirs(directory, exist_ok=True)
+    mp3(directory, "v24_multi.mp3", lambda t: (basic(t), t.add(TIT2(encoding=Encoding.UTF8, text=["One", "Two"]))))
+    mp3(directory, "v24_numgenre.mp3", lambda t: t.add(TCON(encoding=Encoding.UTF8, text=["17"])))
+    mp3(directory, "v24_txxx.mp3", lambda t: (basic(t), t.add(TXXX(encoding=Encoding.UTF8, desc="ALBUMARTIST", text=["X"]))))
+    mp3(directory, "v24_id3v1_partial.mp3", basic, trailer=b"TAG" + bytes(125))
+    with open(os.path.join(directory, "notag.mp3"), "wb") as f:
+        f.write(mp3_audio())
+    flac(directory, "multi.flac", {"ARTIST": ["A", "B"]})
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,318 @@
+#include "migrations.hpp"
+
+#include "database_functions.hpp"
+#include "misc.hpp"
+
+/**
+ * @brief One step of the schema history. apply brings a database at
+ *        version - 1 to version.
+ */
+struct Migration {
+    int version;
+    const char *description;
+    int (*apply)(sqlite3 *db);
+};
+
+static const Migration k_migrations[] = {
+    {1, "base schema", &createBaseSchema},
+    {2, "album keys", &ensureAlbumKeys},
+    {3, "secondary indexes", &createIndexes},
+    {4, "file fingerprints", &addFileFingerprints},
+    {5, "full-text search", &createSongSearch},
+    {6, "song view", &rebuildSongView},
+    {7, "album art store", &createArtBlobs},
+    {8, "album art thumbnails", &createAlbumArtVariants},
+    {9, "audio properties", &addAudioProperties},
+};
+
+/**
+ * @brief Reads the schema version of a database from PRAGMA user_version.
+ *
+ * @param[in] db The database to read.
+ *
+ * @return The version, or -1 on failure.
+ */
+int getSchemaVersion(sqlite3 *db) {
+    sqlite3_stmt *stmt;
+    int version = -1;
+    if (sqlite3_prepare_v2(db, "PRAGMA user_version;", -1, &stmt, NULL) != SQLITE_OK) {
+        logError("Error while reading schema version: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        version = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+    return version;
+}
+
+/**
+ * @brief Applies every migration the database has not seen yet.
+ *
+ * @details Each migration runs in its own transaction together with the
+ *          PRAGMA user_version update, so a failed step leaves the database at
+ *          the previous version and is retried on the next run. A database
+ *          from a newer scanner is left alone.
+ *
+ * @param[in] db The database to migrate.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int migrateDatabase(sqlite3 *db) {
+    int version = getSchemaVersion(db);
+    if (version < 0)
+        return -1;
+    if (version > SCHEMA_VERSION) {
+        logError("Database schema version %d is newer than this scanner's (%d).\n", version, SCHEMA_VERSION);
+        return 0;
+    }
+
+    for (const Migration &migration : k_migrations) {
+        if (migration.version <= version)
+            continue;
+        if (beginTransaction(db) != 0)
+            return -1;
+        if (migration.apply(db) != 0) {
+            logError("Migration to schema version %d (%s) failed.\n", migration.version, migration.description);
+            rollbackTransaction(db);
+            return -1;
+        }
+        char sql_stmt[64];
+        snprintf(sql_stmt, sizeof(sql_stmt), "PRAGMA user_version = %d;", migration.version);
+        if (execStatement(db, sql_stmt) != 0 || commitTransaction(db) != 0) {
+            rollbackTransaction(db);
+            return -1;
+        }
+        log("Database migrated to schema version %d (%s).\n", migration.version, migration.description);
+    }
+    return 0;
+}
+
+/**
+ * @brief Migration 1: creates the tables, unless they are already there.
+ *
+ * @details Databases made before schema versions existed (by createDatabase
+ *          or by the frontend) are at version 0 but already have tables. Of
+ *          those, only the frontend's had Songs.play_count, so it is added
+ *          where missing.
+ *
+ * @param[in] db The database to migrate.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int createBaseSchema(sqlite3 *db) {
+    sqlite3_stmt *stmt;
+    bool has_songs, has_play_count;
+
+    if (sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM sqlite_master WHERE type = 'table' AND name = 'Songs';", -1, &stmt, NULL) != SQLITE_OK)
+        return -1;
+    has_songs = sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt, 0) > 0;
+    sqlite3_finalize(stmt);
+    if (!has_songs)
+        return createTables(db);
+
+    if (sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM pragma_table_info('Songs') WHERE name = 'play_count';", -1, &stmt, NULL) != SQLITE_OK)
+        return -1;
+    has_play_count = sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt, 0) > 0;
+    sqlite3_finalize(stmt);
+    if (!has_play_count)
+        return execStatement(db, "ALTER TABLE Songs ADD COLUMN play_count INTEGER DEFAULT 0;");
+    return 0;
+}
+
+/**
+ * @brief Migration 3: adds indexes for the lookups done by the scanner and
+ *        the joins done by the frontend.
+ *
+ * @details The map tables already have an index on their primary key; these
+ *          cover the reverse direction, which the frontend's joins and the
+ *          ON DELETE CASCADE clauses use.
+ *
+ * @param[in] db The database to migrate.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int createIndexes(sqlite3 *db) {
+    const char *k_indexes[] = {
+        "CREATE INDEX IF NOT EXISTS SongsByLocation ON Songs (location);",
+        "CREATE INDEX IF NOT EXISTS SongsByAlbum ON Songs (album_id);",
+        "CREATE INDEX IF NOT EXISTS ArtistsByName ON Artists (name);",
+        "CREATE INDEX IF NOT EXISTS GenresByName ON Genres (name);",
+        "CREATE INDEX IF NOT EXISTS AlbumsByTitle ON Albums (title);",
+        "CREATE INDEX IF NOT EXISTS ContributingArtistsByArtist ON ContributingArtists (artist_id);",
+        "CREATE INDEX IF NOT EXISTS AlbumArtistsByArtist ON AlbumArtists (artist_id);",
+        "CREATE INDEX IF NOT EXISTS SongGenreMapByGenre ON SongGenreMap (genre_id);",
+        "CREATE INDEX IF NOT EXISTS PlaylistSongsByPlaylist ON PlaylistSongs (playlist_id);",
+        "CREATE INDEX IF NOT EXISTS PlaylistSongsBySong ON PlaylistSongs (song_id);"};
+
+    for (const char *sql_stmt : k_indexes) {
+        if (execStatement(db, sql_stmt) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Migration 4: adds the columns that fingerprint the file of a song.
+ *
+ * @details Existing songs keep NULL fingerprints until the next update(),
+ *          which fills them in without reading any tags.
+ *
+ * @param[in] db The database to migrate.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int addFileFingerprints(sqlite3 *db) {
+    const char *k_columns[] = {
+        "ALTER TABLE Songs ADD COLUMN file_size INTEGER;",
+        "ALTER TABLE Songs ADD COLUMN file_mtime INTEGER;",
+        "ALTER TABLE Songs ADD COLUMN file_inode INTEGER;"};
+
+    for (const char *sql_stmt : k_columns) {
+        if (execStatement(db, sql_stmt) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Migration 5: creates the SongSearch full-text index and fills it
+ *        from the songs already in the database.
+ *
+ * @details SongSearch is an FTS5 table whose rowid is the song id. It holds
+ *          the title, album, artists (album and contributing) and genres of
+ *          each song. Diacritics are folded, and 2 and 3 character prefix
+ *          indexes make as-you-type prefix queries cheap. storeSong and
+ *          deleteSongByLocation keep it up to date from then on.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int createSongSearch(sqlite3 *db) {
+    if (execStatement(db, CREATE_SONG_SEARCH) != 0)
+        return -1;
+    return execStatement(
+        db,
+        "INSERT INTO SongSearch (rowid, title, album, artists, genres) "
+        "SELECT S.id, S.title, A.title, "
+        "(SELECT GROUP_CONCAT(name, ', ') FROM Artists WHERE id IN "
+        "(SELECT artist_id FROM AlbumArtists WHERE album_id = S.album_id UNION SELECT artist_id FROM ContributingArtists WHERE song_id = S.id)), "
+        "(SELECT GROUP_CONCAT(G.name, ', ') FROM Genres G, SongGenreMap SG WHERE G.id = SG.genre_id AND SG.song_id = S.id) "
+        "FROM Songs S LEFT JOIN Albums A ON A.id = S.album_id;");
+}
+
+/**
+ * @brief Migration 7: creates the ArtBlobs table, which counts the albums
+ *        referring to each album art file, and the triggers that keep the
+ *        counts up to date.
+ *
+ * @details Counting in triggers means every write to Albums.album_art_location
+ *          is accounted for, whoever makes it. Files stored before this
+ *          migration keep their names and are counted like the others.
+ *          deleteUselessAlbumArt removes the files whose count dropped to 0.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int createArtBlobs(sqlite3 *db) {
+    const char *k_steps[] = {
+        "CREATE TABLE ArtBlobs ( location VARCHAR(2048) PRIMARY KEY, ref_count INTEGER NOT NULL DEFAULT 0 );",
+        "CREATE TRIGGER AlbumArtAdded AFTER INSERT ON Albums WHEN NEW.album_art_location IS NOT NULL BEGIN "
+        "INSERT INTO ArtBlobs (location, ref_count) VALUES (NEW.album_art_location, 1) ON CONFLICT (location) DO UPDATE SET ref_count = ref_count + 1; "
+        "END;",
+        "CREATE TRIGGER AlbumArtChanged AFTER UPDATE OF album_art_location ON Albums WHEN OLD.album_art_location IS NOT NEW.album_art_location BEGIN "
+        "UPDATE ArtBlobs SET ref_count = ref_count - 1 WHERE location = OLD.album_art_location; "
+        "INSERT INTO ArtBlobs (location, ref_count) SELECT NEW.album_art_location, 1 WHERE NEW.album_art_location IS NOT NULL ON CONFLICT (location) DO UPDATE SET ref_count = ref_count + 1; "
+        "END;",
+        "CREATE TRIGGER AlbumArtRemoved AFTER DELETE ON Albums WHEN OLD.album_art_location IS NOT NULL BEGIN "
+        "UPDATE ArtBlobs SET ref_count = ref_count - 1 WHERE location = OLD.album_art_location; "
+        "END;",
+        "INSERT INTO ArtBlobs (location, ref_count) SELECT album_art_location, COUNT(*) FROM Albums WHERE album_art_location IS NOT NULL GROUP BY album_art_location;"};
+
+    for (const char *sql_stmt : k_steps) {
+        if (execStatement(db, sql_stmt) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Migration 8: creates the AlbumArtVariants table, which lists the
+ *        thumbnails made of each piece of album art.
+ *
+ * @details Thumbnails live in the art store like the art itself, and are
+ *          counted in ArtBlobs by triggers. When a piece of art is forgotten
+ *          by deleteUselessAlbumArt, its variants go with it, which in turn
+ *          releases the thumbnails. ArtBlobs.thumbnailed marks the art that
+ *          generateThumbnails already went through.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int createAlbumArtVariants(sqlite3 *db) {
+    const char *k_steps[] = {
+        "CREATE TABLE AlbumArtVariants ( art_location VARCHAR(2048), size INTEGER, width INTEGER, height INTEGER, location VARCHAR(2048) NOT NULL, PRIMARY KEY (art_location, size) );",
+        "ALTER TABLE ArtBlobs ADD COLUMN thumbnailed INTEGER NOT NULL DEFAULT 0;",
+        "CREATE INDEX AlbumsByArt ON Albums (album_art_location);",
+        "CREATE TRIGGER AlbumArtVariantAdded AFTER INSERT ON AlbumArtVariants BEGIN "
+        "INSERT INTO ArtBlobs (location, ref_count) VALUES (NEW.location, 1) ON CONFLICT (location) DO UPDATE SET ref_count = ref_count + 1; "
+        "END;",
+        "CREATE TRIGGER AlbumArtVariantRemoved AFTER DELETE ON AlbumArtVariants BEGIN "
+        "UPDATE ArtBlobs SET ref_count = ref_count - 1 WHERE location = OLD.location; "
+        "END;",
+        "CREATE TRIGGER ArtBlobForgotten AFTER DELETE ON ArtBlobs BEGIN "
+        "DELETE FROM AlbumArtVariants WHERE art_location = OLD.location; "
+        "END;"};
+
+    for (const char *sql_stmt : k_steps) {
+        if (execStatement(db, sql_stmt) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Migration 9: adds the audio property columns of songs.
+ *
+ * @details Existing songs keep NULL properties, which makes the next
+ *          update() read their files again even if their fingerprint did not
+ *          change. Songs read from then on store 0 where a property is
+ *          unknown, so they are not read again.
+ *
+ * @param[in] db The database to migrate.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int addAudioProperties(sqlite3 *db) {
+    const char *k_columns[] = {
+        "ALTER TABLE Songs ADD COLUMN duration_ms INTEGER;",
+        "ALTER TABLE Songs ADD COLUMN bitrate INTEGER;",
+        "ALTER TABLE Songs ADD COLUMN sample_rate INTEGER;",
+        "ALTER TABLE Songs ADD COLUMN channels INTEGER;",
+        "ALTER TABLE Songs ADD COLUMN bits_per_sample INTEGER;"};
+
+    for (const char *sql_stmt : k_columns) {
+        if (execStatement(db, sql_stmt) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Opens a database, creating it if needed, and brings its schema up
+ *        to date without touching its data.
+ *
+ * @details Meant for the frontend to call before it opens the database
+ *          itself, so that it never sees an old schema.
+ *
+ * @param[in] db_path The path to the database file.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int upgradeDatabase(const char *db_path) {
+    sqlite3 *db;
+    if (sqlite3_open(db_path, &db) != SQLITE_OK) {
+        logError("Can't open database %s: %s\n", db_path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return -1;
+    }
+    int rc = migrateDatabase(db);
+    sqlite3_close(db);
+    return rc;
+}
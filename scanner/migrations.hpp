@@ -0,0 +1,22 @@
+#pragma once
+
+#include <sqlite3.h>
+
+/**
+ * @brief The schema version that migrateDatabase brings databases to. Stored
+ *        in PRAGMA user_version.
+ */
+#define SCHEMA_VERSION 9
+
+int getSchemaVersion(sqlite3 *db);
+int migrateDatabase(sqlite3 *db);
+
+int createBaseSchema(sqlite3 *db);
+int createIndexes(sqlite3 *db);
+int addFileFingerprints(sqlite3 *db);
+int createSongSearch(sqlite3 *db);
+int createArtBlobs(sqlite3 *db);
+int createAlbumArtVariants(sqlite3 *db);
+int addAudioProperties(sqlite3 *db);
+
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) int upgradeDatabase(const char *db_path);
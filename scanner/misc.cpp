@@ -1,95 +1,165 @@
 #include "misc.hpp"
 
-#include <stdarg.h>
+#include <sys/stat.h>
 
+#include <algorithm>
+#include <cctype>
+#include <chrono>
 #include <filesystem>
 #include <list>
-#include <regex>
-#include <stack>
 #include <string>
+#include <string_view>
+
+#include "formats.hpp"
+#include "walker.hpp"
+
+/**
+ * @brief Splits a list of names on '&', ';' and ',' without allocating.
+ *
+ * @details Leading and trailing whitespace is removed from each name, and
+ *          names left empty are dropped. The names are views into s.
+ *
+ * @param[in] s The string to split.
+ * @param[out] names Filled with up to capacity names.
+ * @param[in] capacity The size of names.
+ *
+ * @return The number of names in s, which may be more than capacity; call
+ *         again with a larger array to get them all.
+ */
+size_t splitNames(std::string_view s, std::string_view *names, size_t capacity) {
+    const char *k_whitespace = " \t\r\n";
+    size_t count = 0, start = 0;
+    while (start <= s.size()) {
+        size_t end = s.find_first_of("&;,", start);
+        if (end == std::string_view::npos)
+            end = s.size();
+        std::string_view name = s.substr(start, end - start);
+        size_t first = name.find_first_not_of(k_whitespace);
+        if (first != std::string_view::npos) {
+            name = name.substr(first, name.find_last_not_of(k_whitespace) - first + 1);
+            if (count < capacity)
+                names[count] = name;
+            count++;
+        }
+        start = end + 1;
+    }
+    return count;
+}
 
 /**
  * @brief Splits a string on each occurrence of a delimiter and returns a vector
  *        of strings.
  *
- * @details The delimiters are specified by the regular expression "[&;,]".
- *          The function removes any leading or trailing whitespace from the
- *          resulting strings.
+ * @details The delimiters are '&', ';' and ','. The function removes any
+ *          leading or trailing whitespace from the resulting strings. See
+ *          splitNames for a version that does not allocate.
  *
  * @param[in] s The string to split.
  *
  * @return A vector of strings.
  */
 std::vector<std::string> splitString(const std::string &s) {
-    std::vector<std::string> result;
-    std::regex re("[&;,]");
-    std::sregex_token_iterator it(s.begin(), s.end(), re, -1);
-    std::sregex_token_iterator end;
-    for (; it != end; ++it) {
-        std::string str = *it;
-        str.erase(0, str.find_first_not_of(" \t\r\n"));  // remove leading whitespaces
-        str.erase(str.find_last_not_of(" \t\r\n") + 1);  // remove trailing whitespaces
-        if (str != "")
-            result.push_back(str);
-    }
-    return result;
+    std::vector<std::string_view> names(splitNames(s, NULL, 0));
+    splitNames(s, names.data(), names.size());
+    return std::vector<std::string>(names.begin(), names.end());
 }
 
 /**
  * @brief Finds all files in the given directory and all its subdirectories.
  *
- * @details This function returns a vector of strings, each containing the path
+ * @details This function returns a list of strings, each containing the path
  *          to a file found in the given root directory or its subdirectories.
+ *          Callers that only need some of the files should use walkDirectory
+ *          directly, which filters and streams them instead.
  *
  * @param[in] root The root directory to search in.
  *
- * @return A vector of strings containing file paths.
+ * @return A list of strings containing file paths.
  */
 std::list<std::string> getFiles(std::string root) {
     std::list<std::string> files;
-    std::filesystem::path curr_path(root);
-    std::stack<std::filesystem::path> directories;
-    if (std::filesystem::exists(curr_path) && std::filesystem::is_directory(curr_path))
-        directories.push(curr_path);
-    while (!directories.empty()) {
-        curr_path = directories.top();
-        directories.pop();
-        if (std::filesystem::exists(curr_path)) {
-            if (std::filesystem::is_directory(curr_path)) {
-                for (const auto &entry : std::filesystem::directory_iterator(curr_path))
-                    directories.push(entry.path());
-            } else if (std::filesystem::is_regular_file(curr_path))
-                files.push_back(curr_path.generic_u8string());
-        }
-    }
+    walkDirectory(root, WalkOptions(), [&](const std::string &path, const FileFingerprint *) { files.push_back(path); });
     return files;
 }
 
 /**
- * @brief Logs a formatted message with a timestamp to a specified log file.
+ * @brief Reads the size, modification time and inode number of a file.
  *
- * @details This function appends a timestamped message to the log file
- *          located at LOG_LOCATION. The message is formatted similarly to
- *          printf, using variadic arguments to specify the format and the
- *          values to include in the log entry. LOG_LOCATION is a macro defined
- *          in cxx_functions.hpp.
+ * @details This is a single stat call on POSIX systems. On Windows, which has
+ *          no inode numbers, the inode is left at 0.
  *
- * @param[in] fmt The format string, followed by any additional arguments
- *                required by the format specifiers.
+ * @param[in] path The path to the file.
+ * @param[out] fingerprint The fingerprint of the file.
+ *
+ * @return 0 on success, -1 on failure.
  */
-void log(const char *fmt, ...) {
-    va_list args;
-    FILE *fptr;
-    char time_string[64];
-    time_t now;
-    time(&now);
-    fptr = fopen(LOG_LOCATION, "a+");
-    strftime(time_string, sizeof(time_string), "%Y-%m-%d %H:%M:%S", localtime(&now));
-    fprintf(fptr, "[%s] ", time_string);
-    va_start(args, fmt);
-    vfprintf(fptr, fmt, args);
-    va_end(args);
-    fclose(fptr);
+int getFileFingerprint(const std::string &path, FileFingerprint &fingerprint) {
+#ifdef _WIN32
+    std::error_code ec;
+    std::filesystem::path p = std::filesystem::u8path(path);
+    fingerprint.size = std::filesystem::file_size(p, ec);
+    if (ec)
+        return -1;
+    fingerprint.mtime = std::chrono::duration_cast<std::chrono::nanoseconds>(std::filesystem::last_write_time(p, ec).time_since_epoch()).count();
+    if (ec)
+        return -1;
+    fingerprint.inode = 0;
+#else
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return -1;
+    fingerprintFromStat(st, fingerprint);
+#endif
+    return 0;
+}
+
+#ifndef _WIN32
+/**
+ * @brief Fills a fingerprint from the result of a stat call.
+ *
+ * @param[in] st The stat result.
+ * @param[out] fingerprint The fingerprint of the file.
+ */
+void fingerprintFromStat(const struct stat &st, FileFingerprint &fingerprint) {
+    fingerprint.size = st.st_size;
+#ifdef __APPLE__
+    fingerprint.mtime = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    fingerprint.mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    fingerprint.inode = st.st_ino;
+}
+#endif
+
+// The ASCII letters that the Latin-1 letters U+00C0 to U+00FF fold to, or 0
+// for the characters that are kept as they are.
+static const char k_latin1_folds[] =
+    "aaaaaaaceeeeiiii"
+    "dnooooo\0ouuuuy\0s"
+    "aaaaaaaceeeeiiii"
+    "dnooooo\0ouuuuy\0y";
+
+/**
+ * @brief Lower-cases ASCII letters and strips the accents of Latin-1 letters
+ *        in a UTF-8 string, for matching names typed by users. Other
+ *        characters are kept as they are.
+ */
+std::string foldName(const std::string &text) {
+    std::string folded;
+    folded.reserve(text.size());
+    for (size_t i = 0; i < text.size(); i++) {
+        unsigned char c = text[i];
+        if (c == 0xC3 && i + 1 < text.size() && (unsigned char)text[i + 1] >= 0x80 && (unsigned char)text[i + 1] <= 0xBF) {
+            char base = k_latin1_folds[(unsigned char)text[i + 1] - 0x80];
+            if (base != 0) {
+                folded += base;
+                i++;
+                continue;
+            }
+        }
+        folded += (c < 0x80) ? (char)std::tolower(c) : (char)c;
+    }
+    return folded;
 }
 
 /**
@@ -120,14 +190,76 @@ bool endsWith(const std::string &fullString,
                ending) == 0;
 }
 
-std::string escapeDQ(const std::string &s) {
-    std::string result;
-    for (const char &c : s) {
-        if (c == '"') {
-            result += "\"\"";
-        } else {
-            result += c;
+/**
+ * @brief Checks if a string ends with a specified substring, ignoring the
+ *        case of ASCII letters.
+ *
+ * @param[in] fullString The full string to search.
+ * @param[in] length The length of the full string.
+ * @param[in] ending The target substring to search for, in lower case.
+ *
+ * @return \c true if the full string ends with the target substring, and
+ *         \c false otherwise.
+ */
+bool endsWithIgnoreCase(const char *fullString, size_t length, const std::string &ending) {
+    if (ending.size() > length)
+        return false;
+    const char *tail = fullString + length - ending.size();
+    for (size_t i = 0; i < ending.size(); i++) {
+        if (std::tolower((unsigned char)tail[i]) != ending[i])
+            return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Returns the extensions of the files the scanner reads, in lower case
+ *        and with their leading dot: those of every format in formatHandlers.
+ */
+const std::vector<std::string> &musicExtensions() {
+    static const std::vector<std::string> extensions = [] {
+        std::vector<std::string> all;
+        for (const FormatHandler &handler : formatHandlers()) {
+            for (const std::string &extension : handler.extensions) {
+                if (std::find(all.begin(), all.end(), extension) == all.end())
+                    all.push_back(extension);
+            }
         }
+        return all;
+    }();
+    return extensions;
+}
+
+/**
+ * @brief Checks whether a path names a file the scanner reads, going by its
+ *        extension in any case.
+ */
+bool isMusicFile(const std::string &path) {
+    for (const std::string &extension : musicExtensions()) {
+        if (endsWithIgnoreCase(path.c_str(), path.size(), extension))
+            return true;
     }
-    return result;
-}
\ No newline at end of file
+    return false;
+}
+
+/**
+ * @brief Normalises a directory given by the user, removing "." and ".."
+ *        components, repeated separators and trailing separators, so that
+ *        paths joined to it with '/' match the locations stored by a scan.
+ */
+std::string normalizeDirectory(const std::string &directory) {
+    std::string normal = std::filesystem::u8path(directory).lexically_normal().u8string();
+    while (normal.size() > 1 && (normal.back() == '/' || normal.back() == '\\') && normal[normal.size() - 2] != ':')
+        normal.pop_back();
+    return normal;
+}
+
+/**
+ * @brief Joins a directory and a name with '/', the way the walker reports
+ *        files, without doubling a trailing separator.
+ */
+std::string joinPath(const std::string &directory, const char *name) {
+    if (!directory.empty() && directory.back() == '/')
+        return directory + name;
+    return directory + '/' + name;
+}
@@ -1,15 +1,46 @@
 #pragma once
 
+#include <sys/stat.h>
+
+#include <cstddef>
+#include <cstdint>
 #include <list>
 #include <string>
+#include <string_view>
 #include <vector>
 
-#define LOG_LOCATION "./log.txt"
+#include "logger.hpp"
+
+/**
+ * @brief What is remembered about a file to tell whether it changed since it
+ *        was last scanned.
+ */
+struct FileFingerprint {
+    int64_t size = -1;
+    int64_t mtime = 0;   // nanoseconds since the epoch
+    uint64_t inode = 0;  // 0 where the platform has no inode numbers
+
+    bool operator==(const FileFingerprint &other) const {
+        return size == other.size && mtime == other.mtime && inode == other.inode;
+    }
+    bool operator!=(const FileFingerprint &other) const { return !(*this == other); }
+};
 
+size_t splitNames(std::string_view s, std::string_view *names, size_t capacity);
 std::vector<std::string> splitString(const std::string &s);
 std::list<std::string> getFiles(std::string root);
-void log(const char *fmt, ...);
+int getFileFingerprint(const std::string &path, FileFingerprint &fingerprint);
+#ifndef _WIN32
+void fingerprintFromStat(const struct stat &st, FileFingerprint &fingerprint);
+#endif
+
+std::string foldName(const std::string &text);
 
 bool endsWith(const std::string &fullString, const std::string &ending);
+bool endsWithIgnoreCase(const char *fullString, size_t length, const std::string &ending);
+
+const std::vector<std::string> &musicExtensions();
+bool isMusicFile(const std::string &path);
+std::string normalizeDirectory(const std::string &directory);
+std::string joinPath(const std::string &directory, const char *name);
 
-std::string escapeDQ(const std::string &s);
@@ -0,0 +1,30 @@
+#include "name_indexes.hpp"
+
+#include "fuzzy.hpp"
+
+/**
+ * @brief Tells whether any in-memory name index (autocompletion or fuzzy
+ *        search) was built from the database of a connection. Writers only
+ *        collect the names they store when this is true.
+ */
+bool nameIndexesFollow(sqlite3 *db) {
+    return autocompleteFollows(db) || fuzzyIndexFollows(db);
+}
+
+/**
+ * @brief Adds names just committed to a database to the in-memory name
+ *        indexes built from it.
+ */
+void addToNameIndexes(sqlite3 *db, const std::vector<CompletionItem> &added) {
+    addToAutocomplete(db, added);
+    addToFuzzyIndex(db, added);
+}
+
+/**
+ * @brief Rebuilds the in-memory name indexes built from a database, after
+ *        names were changed or deleted in it.
+ */
+void reloadNameIndexes(sqlite3 *db) {
+    reloadAutocomplete(db);
+    reloadFuzzyIndex(db);
+}
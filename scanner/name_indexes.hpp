@@ -0,0 +1,11 @@
+#pragma once
+
+#include <sqlite3.h>
+
+#include <vector>
+
+#include "trie.hpp"
+
+bool nameIndexesFollow(sqlite3 *db);
+void addToNameIndexes(sqlite3 *db, const std::vector<CompletionItem> &added);
+void reloadNameIndexes(sqlite3 *db);
@@ -2,77 +2,300 @@
 
 #include <sqlite3.h>
 
+#include <algorithm>
+#include <chrono>
 #include <filesystem>
 #include <iostream>
 #include <list>
 #include <nlohmann/json.hpp>
+#include <thread>
+#include <unordered_map>
 
 #include "database_functions.hpp"
+#include "migrations.hpp"
 #include "misc.hpp"
+#include "scan_pipeline.hpp"
 #include "tag_functions.hpp"
+#include "art_pack.hpp"
+#include "formats.hpp"
+#include "thumbnails.hpp"
+#include "name_indexes.hpp"
+#include "walker.hpp"
 
-int parseInputJSON(nlohmann::json json_input, std::vector<std::string> &search_paths, std::string &database_location, std::string &album_art_directory) {
-    album_art_directory = json_input["album_art_directory"];
-    database_location = json_input["database_location"];
-    for (std::string path : json_input["search_paths"])
-        search_paths.push_back(path);
-    return 0;
+std::mutex library_write_mutex;
+
+/**
+ * @brief Points the log at "log_path", or at log.txt next to the database, and
+ *        applies "log_max_bytes", "log_files" and "log_level".
+ */
+static void configureLogFromJSON(const nlohmann::json &json_input, const std::string &database_location) {
+    LogOptions options;
+    if (json_input.contains("log_path"))
+        options.path = json_input["log_path"].get<std::string>();
+    else
+        options.path = (std::filesystem::u8path(database_location).parent_path() / "log.txt").u8string();
+    if (json_input.contains("log_max_bytes"))
+        options.max_bytes = json_input["log_max_bytes"].get<size_t>();
+    if (json_input.contains("log_files"))
+        options.keep_files = json_input["log_files"].get<unsigned int>();
+    bool known_level = true;
+    if (json_input.contains("log_level"))
+        known_level = parseLogLevel(json_input["log_level"].get<std::string>(), options.level);
+    configureLog(options);
+    if (!known_level)
+        logWarning("Unknown log_level \"%s\", logging info and above.\n", json_input["log_level"].get<std::string>().c_str());
 }
 
-int update(const char *input) {
-    nlohmann::json json_input = nlohmann::json::parse(input);
-    std::vector<std::string> search_paths;
-    std::string database_location, album_art_directory;
-    parseInputJSON(json_input, search_paths, database_location, album_art_directory);
+static void readInputJSON(nlohmann::json json_input, ScanConfig &config) {
+    config.album_art_directory = json_input["album_art_directory"];
+    config.database_location = json_input["database_location"];
+    configureLogFromJSON(json_input, config.database_location);
+    for (std::string path : json_input["search_paths"])
+        config.search_paths.push_back(normalizeDirectory(path));
+    if (json_input.contains("worker_threads"))
+        config.worker_threads = json_input["worker_threads"].get<unsigned int>();
+    if (json_input.contains("batch_size"))
+        config.batch_size = std::max(1u, json_input["batch_size"].get<unsigned int>());
+    if (json_input.contains("walker_threads"))
+        config.walker_threads = json_input["walker_threads"].get<unsigned int>();
+    if (json_input.contains("skip_hidden"))
+        config.skip_hidden = json_input["skip_hidden"].get<bool>();
+    if (json_input.contains("exclude_paths")) {
+        for (std::string path : json_input["exclude_paths"])
+            config.exclude_paths.push_back(normalizeDirectory(path));
+    }
+    if (json_input.contains("debounce_ms"))
+        config.debounce_ms = json_input["debounce_ms"].get<unsigned int>();
+    if (json_input.contains("thumbnails"))
+        config.thumbnails = json_input["thumbnails"].get<bool>();
+    if (json_input.contains("pack_artwork"))
+        config.pack_artwork = json_input["pack_artwork"].get<bool>();
+    if (json_input.contains("fast_scan"))
+        config.read_options.fast_parser = json_input["fast_scan"].get<bool>();
+    if (json_input.contains("fast_scan_check"))
+        config.read_options.check_fast_parser = json_input["fast_scan_check"].get<bool>();
+    if (json_input.contains("report_path"))
+        config.report_path = json_input["report_path"].get<std::string>();
+    if (json_input.contains("audio_properties")) {
+        std::string mode = json_input["audio_properties"];
+        if (mode == "accurate" || mode == "fast")
+            config.read_options.accurate_properties = mode == "accurate";
+        else
+            logWarning("Unknown audio_properties mode \"%s\", estimating them.\n", mode.c_str());
+    }
+    if (config.worker_threads == 0)
+        config.worker_threads = std::max(1u, std::thread::hardware_concurrency());
+    if (config.walker_threads == 0)
+        config.walker_threads = std::max(1u, std::thread::hardware_concurrency());
+}
 
-    sqlite3 *db;
-    if (sqlite3_open(database_location.c_str(), &db) != SQLITE_OK) {
-        sqlite3_close(db);
-        log("Error while opening database.\n");
+/**
+ * @brief Parses the input JSON of update(), scanStart() and watchStart().
+ *
+ * @details Errors are logged rather than thrown, since the callers are
+ *          called from Dart, where an exception would end the process.
+ *
+ * @param[in] input The input JSON.
+ * @param[out] config The settings it gives.
+ *
+ * @return 0 on success, -1 if the input is not JSON or a setting is missing
+ *         or has the wrong type.
+ */
+int parseInputJSON(const char *input, ScanConfig &config) {
+    try {
+        readInputJSON(nlohmann::json::parse(input), config);
+    } catch (const nlohmann::json::exception &e) {
+        logError("Error while parsing the input JSON: %s\n", e.what());
         return -1;
     }
+    return 0;
+}
 
-    sqlite3_exec(db, "PRAGMA foreign_keys = 1;", NULL, NULL, NULL);
+/**
+ * @brief Brings the database up to date with the files in the search paths.
+ *
+ * @details Adds songs for files that are new, re-reads files whose size,
+ *          mtime or inode changed, deletes songs whose files are gone, and
+ *          removes albums, artists and genres left without songs. Files whose
+ *          fingerprint did not change are not opened at all, unless their
+ *          song was scanned before audio properties were stored.
+ *
+ *          If ctx.progress is cancelled the run stops early. Songs already
+ *          read are kept, but nothing is deleted.
+ *
+ * @param[in] ctx The scan context holding the open database.
+ * @param[in] config The settings of this run.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int updateLibrary(ScanContext &ctx, ScanConfig &config) {
+    std::error_code error;
+    if (!std::filesystem::is_directory(std::filesystem::path(config.album_art_directory), error)) {
+        std::remove(config.album_art_directory.c_str());
+        if (!std::filesystem::create_directory(std::filesystem::path(config.album_art_directory), error)) {
+            logError("Unable to create the album art directory %s: %s\n", config.album_art_directory.c_str(), error.message().c_str());
+            return -1;
+        }
+    }
 
-    if (!std::filesystem::exists(std::filesystem::path(album_art_directory)) || !std::filesystem::is_directory(std::filesystem::path(album_art_directory))) {
-        std::remove(album_art_directory.c_str());
-        std::filesystem::create_directory(std::filesystem::path(album_art_directory));
+    ScanStats &stats = ctx.progress->stats;
+    std::unordered_map<std::string, StoredSong> existing;
+    {
+        StageTimer timer(stats, StageLoad);
+        if (getSongFingerprints(ctx, existing) != 0)
+            return -1;
+        ctx.entities.load(ctx.db);
+        ctx.track_completions = nameIndexesFollow(ctx.db);
     }
 
-    std::unordered_set<std::filesystem::path> existing = getFileLocations(db);
+    std::vector<ScanJob> jobs;
+    std::vector<std::pair<int, FileFingerprint>> unchanged;  // songs that only need their fingerprint stored
 
-    std::list<std::string> files;
+    WalkOptions walk_options;
+    walk_options.extensions = musicExtensions();
+    walk_options.exclude_paths = config.exclude_paths;
+    walk_options.skip_hidden = config.skip_hidden;
+    walk_options.fingerprints = true;
+    walk_options.threads = config.walker_threads;
+    walk_options.cancel = &ctx.progress->cancel;
 
-    for (std::string path : search_paths) {
-        for (auto &item : getFiles(path))
-            files.push_back(item);
+    // The walk calls back one file at a time, so the time spent matching
+    // files can be told apart from the time spent walking.
+    auto walk_started = std::chrono::steady_clock::now();
+    uint64_t diff_ns = 0;
+    for (std::string path : config.search_paths) {
+        walkDirectory(path, walk_options, [&](const std::string &item, const FileFingerprint *fingerprint) {
+            auto started = std::chrono::steady_clock::now();
+            ctx.progress->discovered++;
+            auto it = existing.find(item);
+            if (it == existing.end()) {
+                jobs.push_back({item, 0, *fingerprint});
+            } else {
+                StoredSong &song = it->second;
+                song.seen = true;
+                if (!song.has_audio_properties || (song.has_fingerprint && song.fingerprint != *fingerprint))
+                    jobs.push_back({item, song.id, *fingerprint});
+                else if (!song.has_fingerprint)
+                    unchanged.emplace_back(song.id, *fingerprint);
+            }
+            diff_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count();
+        });
+    }
+    stats.record(StageWalk, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - walk_started).count() - diff_ns);
+    {
+        // The walk reports files in no particular order; sort them so that new
+        // songs get the same ids on every run.
+        StageTimer timer(stats, StageDiff);
+        std::sort(jobs.begin(), jobs.end(), [](const ScanJob &a, const ScanJob &b) { return a.file_location < b.file_location; });
     }
+    stats.record(StageDiff, diff_ns);
 
-    for (std::list<std::string>::iterator it = files.begin(); it != files.end();) {
-        std::filesystem::path p(*it);
-        if (existing.find(p) != existing.end()) {
-            existing.erase(p);
-            it = files.erase(it);
-        } else
-            ++it;
+    ctx.progress->queued = jobs.size();
+    setArtPacking(config.album_art_directory, config.pack_artwork);
+    int failures = scanFiles(ctx, jobs, config.album_art_directory, config.worker_threads, config.batch_size, config.read_options);
+    if (failures > 0)
+        logWarning("%d of %zu files could not be read.\n", failures, jobs.size());
+    logFormatCounters(stats.formatCounters());
+
+    // A cancelled walk did not see every file, so nothing may be deleted.
+    if (ctx.progress->cancelled()) {
+        ctx.entities.clear();
+        return 0;
     }
 
-    for (std::string item : files) {
-        if (endsWith(item, ".mp3") || endsWith(item, ".flac")) {
-            Metadata m;
-            if (getMetadata(item, m) == 0)
-                addSong(db, m, album_art_directory);
+    // Renamed and deleted names can only be dropped from the autocompletion
+    // index by rebuilding it.
+    bool names_changed = std::any_of(jobs.begin(), jobs.end(), [](const ScanJob &job) { return job.song_id != 0; });
+
+    {
+        StageTimer timer(stats, StageCleanup);
+        beginTransaction(ctx.db);
+        for (auto &item : unchanged)
+            updateSongFingerprint(ctx, item.first, item.second);
+        for (auto &item : existing) {
+            if (!item.second.seen) {
+                deleteSongByLocation(ctx, item.first);
+                names_changed = true;
+            }
         }
+
+        deleteUselessAlbums(ctx.db);
+        deleteUselessArtists(ctx.db);
+        deleteUselessGenres(ctx.db);
+        if (commitTransaction(ctx.db) != 0)
+            rollbackTransaction(ctx.db);
+        ctx.entities.clear();
+    }
+    if (names_changed) {
+        StageTimer timer(stats, StageNameIndexes);
+        reloadNameIndexes(ctx.db);
+    }
+    if (config.thumbnails) {
+        StageTimer timer(stats, StageThumbnails);
+        generateThumbnails(ctx.db, config.album_art_directory, config.worker_threads, &ctx.progress->cancel);
+    }
+    {
+        StageTimer timer(stats, StageArtCleanup);
+        deleteUselessAlbumArt(ctx.db, config.album_art_directory);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Opens the database named in the config, brings its schema up to
+ *        date and runs updateLibrary on it.
+ *
+ * @param[in] config The settings of this run.
+ * @param[in] progress Where to count progress and look for a cancel, or NULL.
+ *                     Its state is set to running and then to how the run
+ *                     ended.
+ *
+ * @return 0 on success, including a cancelled run, -1 on failure.
+ */
+int runScan(ScanConfig &config, ScanProgress *progress) {
+    ScanProgress local_progress;
+    if (progress == NULL)
+        progress = &local_progress;
+    progress->state = ScanRunning;
+    progress->stats.begin();
+
+    sqlite3 *db;
+    if (sqlite3_open(config.database_location.c_str(), &db) != SQLITE_OK) {
+        sqlite3_close(db);
+        logError("Error while opening database.\n");
+        progress->state = ScanFailed;
+        return -1;
     }
 
-    for (std::filesystem::path item : existing)
-        deleteSongByLocation(db, item.generic_u8string());
+    sqlite3_exec(db, "PRAGMA foreign_keys = 1;", NULL, NULL, NULL);
+    sqlite3_busy_timeout(db, 5000);
+    std::lock_guard<std::mutex> lock(library_write_mutex);
+    if (migrateDatabase(db) != 0) {
+        sqlite3_close(db);
+        logError("Error while upgrading database %s.\n", config.database_location.c_str());
+        progress->state = ScanFailed;
+        return -1;
+    }
 
-    deleteUselessAlbums(db);
-    deleteUselessArtists(db);
-    deleteUselessGenres(db);
-    // deleteUselessAlbumArt(db, album_art_directory);
+    int rc;
+    {
+        ScanContext ctx(db, progress);
+        rc = updateLibrary(ctx, config);
+    }
 
     sqlite3_close(db);
-    return 0;
+    progress->stats.end();
+    logScanSummary(*progress);
+    if (!config.report_path.empty())
+        writeScanReport(*progress, config.report_path);
+    progress->state = rc != 0 ? ScanFailed : progress->cancelled() ? ScanCancelled : ScanFinished;
+    return rc;
+}
+
+int update(const char *input) {
+    ScanConfig config;
+    if (parseInputJSON(input, config) != 0)
+        return -1;
+    return runScan(config, NULL);
 }
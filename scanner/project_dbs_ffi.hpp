@@ -1,9 +1,41 @@
 #pragma once
 
+#include <mutex>
 #include <nlohmann/json.hpp>
 #include <string>
 #include <vector>
 
-int parseInputJSON(nlohmann::json json_input, std::vector<std::string> &search_paths, std::string &database_location, std::string &album_art_directory);
+#include "database_functions.hpp"
+
+/**
+ * @brief Settings for one run of update(), as given in its input JSON.
+ */
+struct ScanConfig {
+    std::vector<std::string> search_paths;
+    std::string database_location;
+    std::string album_art_directory;
+    std::vector<std::string> exclude_paths;  // directories below the search paths to leave out
+    bool skip_hidden = false;                // leave out files and directories starting with '.'
+    unsigned int walker_threads = 1;         // directory walking threads, 0 = one per core
+    unsigned int worker_threads = 1;         // tag extraction threads, 0 = one per core
+    unsigned int batch_size = 1000;          // songs written per transaction
+    unsigned int debounce_ms = 1000;         // quiet time before the watcher applies events
+    bool thumbnails = true;                  // make small copies of album art for the frontend's grids
+    bool pack_artwork = false;               // store new album art in one memory-mapped pack instead of loose files
+    TagReadOptions read_options;             // "fast_scan", "fast_scan_check" and "audio_properties" ("fast" or "accurate")
+    std::string report_path;                 // where update() writes its timings as JSON, empty for nowhere
+};
+
+/**
+ * @brief Held by whoever writes the library, so that update() and the
+ *        watcher never scan at the same time.
+ */
+extern std::mutex library_write_mutex;
+
+int parseInputJSON(const char *input, ScanConfig &config);
+
+int updateLibrary(ScanContext &ctx, ScanConfig &config);
+
+int runScan(ScanConfig &config, ScanProgress *progress);
 
 extern "C" __attribute__((visibility("default"))) __attribute__((used)) int update(const char *input);
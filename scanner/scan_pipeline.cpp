@@ -0,0 +1,202 @@
+#include "scan_pipeline.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "misc.hpp"
+
+static uint64_t elapsedNs(std::chrono::steady_clock::time_point started) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count();
+}
+
+SongBatchWriter::SongBatchWriter(ScanContext &ctx, std::string &album_art_directory, unsigned int batch_size)
+    : ctx(ctx), album_art_directory(album_art_directory), batch_size(std::max(batch_size, 1u)), failed(0) {}
+
+SongBatchWriter::~SongBatchWriter() {
+    flush();
+}
+
+/**
+ * @brief Adds or updates a song in the open batch, committing the batch once
+ *        it is full.
+ *
+ * @param[in] song_id The song to update in place, or 0 to add a new song.
+ * @param[in] metadata The metadata of the song to add.
+ * @param[in] album_art_data Image bytes already read from the file, or NULL.
+ *                           Only used on the first attempt; a retry reads the
+ *                           picture again if it is still needed.
+ */
+void SongBatchWriter::add(int song_id, Metadata &metadata, const std::string *album_art_data) {
+    if (batch.empty() && beginTransaction(ctx.db) != 0) {
+        batch.emplace_back(song_id, metadata);
+        retrySeparately();
+        return;
+    }
+    batch.emplace_back(song_id, metadata);
+    if (storeSong(ctx, song_id, metadata, album_art_directory, album_art_data) == -1) {
+        logWarning("Adding %s failed, retrying its batch of %zu songs one by one.\n", metadata.file_location.c_str(), batch.size());
+        rollbackScanTransaction(ctx);
+        retrySeparately();
+        return;
+    }
+    if (batch.size() >= batch_size)
+        flush();
+}
+
+/**
+ * @brief Commits the open batch, if any.
+ */
+void SongBatchWriter::flush() {
+    if (batch.empty())
+        return;
+    if (commit() != 0) {
+        logWarning("Committing a batch of %zu songs failed, retrying them one by one.\n", batch.size());
+        rollbackScanTransaction(ctx);
+        retrySeparately();
+        return;
+    }
+    ctx.progress->inserted += batch.size();
+    batch.clear();
+}
+
+/**
+ * @brief Commits the open transaction, timing it as StageCommit.
+ */
+int SongBatchWriter::commit() {
+    StageTimer timer(ctx.progress->stats, StageCommit);
+    return commitScanTransaction(ctx);
+}
+
+void SongBatchWriter::retrySeparately() {
+    for (auto &item : batch) {
+        if (beginTransaction(ctx.db) != 0) {
+            ctx.progress->fail(item.second.file_location);
+            failed++;
+            continue;
+        }
+        if (storeSong(ctx, item.first, item.second, album_art_directory, NULL) == -1 || commit() != 0) {
+            logError("Unable to add %s, skipping it.\n", item.second.file_location.c_str());
+            rollbackScanTransaction(ctx);
+            ctx.progress->fail(item.second.file_location);
+            failed++;
+        } else
+            ctx.progress->inserted++;
+    }
+    batch.clear();
+}
+
+/**
+ * @brief Reads the tags of the given files and adds or updates their songs
+ *        in the database.
+ *
+ * @details Progress is counted in ctx.progress. Once the scan is cancelled no
+ *          more files are read; the songs already read are still written.
+ *
+ *          Every file is opened once, by extractFile, which only copies the
+ *          picture out of files whose album has no art yet (see
+ *          AlbumArtClaims).
+ *
+ *          With more than one worker thread, TagLib extraction runs in
+ *          parallel on a pool of workers, while the
+ *          calling thread is the only one that writes to the database. Results
+ *          travel through an OrderedBoundedQueue, so songs are added in the same
+ *          order as a serial scan and get the same ids.
+ *
+ * @param[in] ctx The scan context holding the database to add the songs to.
+ * @param[in] jobs The music files to read.
+ * @param[in] album_art_directory The directory where album art is saved.
+ * @param[in] worker_threads The number of extraction threads. 0 or 1 scans
+ *                           serially on the calling thread.
+ * @param[in] batch_size The number of songs written per transaction.
+ * @param[in] read_options How to read the files.
+ *
+ * @return The number of files that could not be added. Files skipped because
+ *         of a cancel are not counted.
+ */
+int scanFiles(ScanContext &ctx, const std::vector<ScanJob> &jobs, std::string &album_art_directory, unsigned int worker_threads, unsigned int batch_size, const TagReadOptions &read_options) {
+    int failures = 0;
+    StringPool names;  // outlives the writer, whose batches point into it
+    SongBatchWriter writer(ctx, album_art_directory, batch_size);
+    AlbumArtClaims claims(ctx.db);
+
+    if (worker_threads <= 1 || jobs.size() <= 1) {
+        for (const ScanJob &job : jobs) {
+            if (ctx.progress->cancelled())
+                break;
+            Metadata m;
+            std::string album_art;
+            bool album_art_read = false;
+            auto want_picture = [&](const Metadata &metadata) { return album_art_read = claims.wanted(metadata); };
+            auto started = std::chrono::steady_clock::now();
+            int status = extractFile(job.file_location, m, names, &album_art, want_picture, read_options, ctx.progress->stats.formatCounters());
+            ctx.progress->stats.recordFile(job.file_location, m.format, elapsedNs(started), job.fingerprint.size);
+            if (status == 0) {
+                ctx.progress->parsed++;
+                ctx.progress->bytes_read += job.fingerprint.size;
+                m.fingerprint = job.fingerprint;
+                if (!album_art.empty())
+                    claims.claim(m);
+                writer.add(job.song_id, m, album_art_read ? &album_art : NULL);
+            } else {
+                ctx.progress->fail(job.file_location);
+                failures++;
+            }
+        }
+        writer.flush();
+        return failures + writer.failures();
+    }
+
+    if (worker_threads > jobs.size())
+        worker_threads = jobs.size();
+
+    OrderedBoundedQueue<ScannedFile> queue(worker_threads * 16);
+    std::atomic<size_t> next_file(0);
+    std::vector<std::thread> workers;
+
+    for (unsigned int i = 0; i < worker_threads; i++) {
+        workers.emplace_back([&] {
+            for (size_t index = next_file++; index < jobs.size(); index = next_file++) {
+                ScannedFile scanned;
+                if (ctx.progress->cancelled()) {
+                    // Keep filling the sequence so the writer is never left waiting.
+                    scanned.status = -1;
+                    scanned.skipped = true;
+                    queue.push(index, std::move(scanned));
+                    continue;
+                }
+                auto want_picture = [&](const Metadata &metadata) { return scanned.album_art_read = claims.wanted(metadata); };
+                auto started = std::chrono::steady_clock::now();
+                scanned.status = extractFile(jobs[index].file_location, scanned.metadata, names, &scanned.album_art, want_picture, read_options, ctx.progress->stats.formatCounters());
+                ctx.progress->stats.recordFile(jobs[index].file_location, scanned.metadata.format, elapsedNs(started), jobs[index].fingerprint.size);
+                if (scanned.status == 0) {
+                    ctx.progress->parsed++;
+                    ctx.progress->bytes_read += jobs[index].fingerprint.size;
+                    scanned.metadata.fingerprint = jobs[index].fingerprint;
+                    if (!scanned.album_art.empty())
+                        claims.claim(scanned.metadata);
+                }
+                queue.push(index, std::move(scanned));
+            }
+        });
+    }
+
+    for (size_t i = 0; i < jobs.size(); i++) {
+        ScannedFile scanned = queue.pop();
+        if (scanned.skipped)
+            continue;
+        if (scanned.status == 0)
+            writer.add(jobs[i].song_id, scanned.metadata, scanned.album_art_read ? &scanned.album_art : NULL);
+        else {
+            ctx.progress->fail(jobs[i].file_location);
+            failures++;
+        }
+    }
+    writer.flush();
+
+    for (std::thread &worker : workers)
+        worker.join();
+
+    return failures + writer.failures();
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "database_functions.hpp"
+#include "tag_functions.hpp"
+
+/**
+ * @brief A file the scanner has to read: either a new file or the changed
+ *        file of an existing song.
+ */
+struct ScanJob {
+    std::string file_location;
+    int song_id;  // the song to update in place, or 0 for a new file
+    FileFingerprint fingerprint;
+};
+
+/**
+ * @brief Everything a worker thread extracts from one file, ready to be
+ *        written to the database.
+ */
+struct ScannedFile {
+    Metadata metadata;
+    std::string album_art;         // raw bytes of the embedded picture, if any
+    bool album_art_read = false;  // false if the picture was skipped because the album has art
+    int status;                   // return value of extractFile
+    bool skipped = false;   // not read because the scan was cancelled
+};
+
+/**
+ * @brief The albums of a scan that have album art, or whose art has been read
+ *        from a file already, by makeAlbumNameKey.
+ *
+ * @details Shared by the threads extracting tags, so that the picture, the
+ *          largest part of most tags, is only copied out of one file per
+ *          album. A skipped picture is read again by storeSong in the rare
+ *          case it turns out to be needed after all, so the art an album ends
+ *          up with is the same as when every picture is read.
+ */
+class AlbumArtClaims {
+   public:
+    explicit AlbumArtClaims(sqlite3 *db) { getAlbumsWithArt(db, albums); }
+
+    bool wanted(const Metadata &metadata) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return albums.count(makeAlbumNameKey(metadata.album, metadata.album_artists)) == 0;
+    }
+
+    void claim(const Metadata &metadata) {
+        std::lock_guard<std::mutex> lock(mutex);
+        albums.insert(makeAlbumNameKey(metadata.album, metadata.album_artists));
+    }
+
+   private:
+    std::mutex mutex;
+    std::unordered_set<std::string> albums;
+};
+
+/**
+ * @brief A fixed-capacity queue whose items are popped in sequence order.
+ *
+ * @details Producers push items tagged with a sequence number, in any order.
+ *          A producer blocks while its item is more than `capacity` items
+ *          ahead of the consumer, and the consumer blocks until the next item
+ *          in sequence is available. This keeps memory bounded while letting
+ *          the consumer see items in exactly the order a serial loop would.
+ */
+template <typename T>
+class OrderedBoundedQueue {
+   public:
+    explicit OrderedBoundedQueue(size_t capacity) : slots(capacity), ready(capacity, false), head(0) {}
+
+    void push(size_t sequence, T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [&] { return sequence < head + slots.size(); });
+        slots[sequence % slots.size()] = std::move(item);
+        ready[sequence % slots.size()] = true;
+        not_empty.notify_all();
+    }
+
+    T pop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        size_t index = head % slots.size();
+        not_empty.wait(lock, [&] { return ready[index]; });
+        T item = std::move(slots[index]);
+        ready[index] = false;
+        head++;
+        not_full.notify_all();
+        return item;
+    }
+
+   private:
+    std::vector<T> slots;
+    std::vector<bool> ready;
+    size_t head;
+    std::mutex mutex;
+    std::condition_variable not_full, not_empty;
+};
+
+/**
+ * @brief Adds songs to the database in batches, each batch being one
+ *        transaction.
+ *
+ * @details If a song of the open batch fails, or the batch cannot be
+ *          committed, the whole batch is rolled back and then retried one song
+ *          per transaction, so only the files that really fail are lost.
+ */
+class SongBatchWriter {
+   public:
+    SongBatchWriter(ScanContext &ctx, std::string &album_art_directory, unsigned int batch_size);
+    ~SongBatchWriter();
+
+    void add(int song_id, Metadata &metadata, const std::string *album_art_data = NULL);
+    void flush();
+    int failures() const { return failed; }
+
+   private:
+    int commit();
+    void retrySeparately();
+
+    ScanContext &ctx;
+    std::string &album_art_directory;
+    unsigned int batch_size;
+    std::vector<std::pair<int, Metadata>> batch;  // song id (0 if new) and metadata
+    int failed;
+};
+
+int scanFiles(ScanContext &ctx, const std::vector<ScanJob> &jobs, std::string &album_art_directory, unsigned int worker_threads, unsigned int batch_size, const TagReadOptions &read_options);
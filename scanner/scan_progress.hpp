@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "scan_stats.hpp"
+
+/**
+ * @brief Where a scan is. The values are part of the FFI interface.
+ */
+enum ScanState {
+    ScanPending = 0,
+    ScanRunning = 1,
+    ScanFinished = 2,
+    ScanFailed = 3,
+    ScanCancelled = 4
+};
+
+/**
+ * @brief Counters updated by a running scan and read by other threads while
+ *        it runs, plus a flag asking it to stop.
+ */
+struct ScanProgress {
+    std::atomic<uint64_t> discovered{0};  // music files found by the walk
+    std::atomic<uint64_t> queued{0};      // of those, files that are new or changed and must be read
+    std::atomic<uint64_t> parsed{0};      // files whose tags were read
+    std::atomic<uint64_t> inserted{0};    // songs added or updated in the database
+    std::atomic<uint64_t> failed{0};      // files that could not be read or stored
+    std::atomic<uint64_t> bytes_read{0};  // total size of the parsed files
+    std::atomic<int> state{ScanPending};
+    std::atomic<bool> cancel{false};
+    ScanStats stats;  // where the scan spent its time
+
+    bool cancelled() const { return cancel.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Counts a failed file and remembers its location, keeping the
+     *        first MAX_ERRORS of them.
+     */
+    void fail(const std::string &location) {
+        failed++;
+        std::lock_guard<std::mutex> lock(errors_mutex);
+        if (errors.size() < MAX_ERRORS)
+            errors.push_back(location);
+    }
+
+    std::vector<std::string> failedFiles() {
+        std::lock_guard<std::mutex> lock(errors_mutex);
+        return errors;
+    }
+
+    static const size_t MAX_ERRORS = 100;
+
+   private:
+    std::mutex errors_mutex;
+    std::vector<std::string> errors;
+};
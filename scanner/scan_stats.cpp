@@ -0,0 +1,230 @@
+#include "scan_stats.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+
+#include "misc.hpp"
+#include "scan_progress.hpp"
+
+// Per item stages are reported with their latency histogram, the others with
+// their time only.
+static const struct {
+    const char *name;
+    bool per_item;
+} k_stages[StageCount] = {
+    {"load", false},
+    {"walk", false},
+    {"diff", false},
+    {"extract", true},
+    {"entities", true},
+    {"art", true},
+    {"insert", true},
+    {"commit", true},
+    {"cleanup", false},
+    {"name_indexes", false},
+    {"thumbnails", false},
+    {"art_cleanup", false},
+};
+
+static double toMs(uint64_t ns) {
+    return ns / 1e6;
+}
+
+static const char *formatName(AudioFormat format) {
+    const FormatHandler *handler = formatHandler(format);
+    return handler != NULL ? handler->name : "unknown";
+}
+
+void LatencyHistogram::record(uint64_t ns) {
+    uint64_t us = ns / 1000;
+    int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    buckets[std::min(bucket, LATENCY_BUCKETS - 1)].fetch_add(1, std::memory_order_relaxed);
+    samples.fetch_add(1, std::memory_order_relaxed);
+    total_ns.fetch_add(ns, std::memory_order_relaxed);
+    uint64_t max = max_ns.load(std::memory_order_relaxed);
+    while (ns > max && !max_ns.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {
+    }
+}
+
+/**
+ * @brief Returns a bound on the given fraction of the samples, the top of the
+ *        bucket the percentile falls in, or the largest sample if lower.
+ */
+uint64_t LatencyHistogram::percentileUs(double fraction) const {
+    uint64_t total = count();
+    if (total == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(fraction * total + 0.5);
+    uint64_t seen = 0;
+    uint64_t max_us = max_ns.load(std::memory_order_relaxed) / 1000;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += buckets[i].load(std::memory_order_relaxed);
+        if (seen >= std::max<uint64_t>(rank, 1))
+            return std::min<uint64_t>(1ull << i, max_us);
+    }
+    return max_us;
+}
+
+nlohmann::json LatencyHistogram::toJSON() const {
+    nlohmann::json json;
+    uint64_t total = count();
+    json["count"] = total;
+    json["total_ms"] = toMs(totalNs());
+    json["mean_us"] = total ? totalNs() / total / 1000 : 0;
+    json["p50_us"] = percentileUs(0.5);
+    json["p90_us"] = percentileUs(0.9);
+    json["p99_us"] = percentileUs(0.99);
+    json["max_us"] = max_ns.load(std::memory_order_relaxed) / 1000;
+    nlohmann::json histogram = nlohmann::json::array();
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        uint64_t n = buckets[i].load(std::memory_order_relaxed);
+        if (n) {
+            nlohmann::json bucket;
+            bucket["below_us"] = (uint64_t)1 << i;
+            bucket["count"] = n;
+            histogram.push_back(bucket);
+        }
+    }
+    json["histogram"] = histogram;
+    return json;
+}
+
+void ScanStats::begin() {
+    started = std::chrono::steady_clock::now();
+}
+
+void ScanStats::end() {
+    wall_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count();
+}
+
+/**
+ * @brief Records the time taken to read one file, under StageExtract, under
+ *        its format, and in the slowest files if it is one of them.
+ *
+ * @param[in] path The file.
+ * @param[in] format Its format, FormatUnknown if it is not audio.
+ * @param[in] ns The time taken by extractFile.
+ * @param[in] size The size of the file.
+ */
+void ScanStats::recordFile(const std::string &path, AudioFormat format, uint64_t ns, int64_t size) {
+    stages[StageExtract].record(ns);
+    formats[format].record(ns);
+    if (ns <= slowest_floor_ns.load(std::memory_order_relaxed))
+        return;
+
+    auto faster = [](const SlowFile &a, const SlowFile &b) { return a.ns > b.ns; };
+    std::lock_guard<std::mutex> lock(slowest_mutex);
+    slowest.push_back({path, format, ns, size});
+    std::push_heap(slowest.begin(), slowest.end(), faster);
+    if (slowest.size() > SLOWEST_FILES) {
+        std::pop_heap(slowest.begin(), slowest.end(), faster);
+        slowest.pop_back();
+    }
+    if (slowest.size() == SLOWEST_FILES)
+        slowest_floor_ns = slowest.front().ns;
+}
+
+void ScanStats::resetFormatCounters() {
+    for (FormatCounters &counters : format_counters) {
+        counters.files = 0;
+        counters.fast = 0;
+        counters.taglib = 0;
+        counters.failed = 0;
+    }
+}
+
+/**
+ * @brief Returns the timers: "wall_ms", then "stages", "formats" and
+ *        "slowest_files". Per item times are summed over the worker threads,
+ *        so they can add up to more than wall_ms.
+ */
+nlohmann::json ScanStats::toJSON() const {
+    nlohmann::json json;
+    json["wall_ms"] = toMs(wall_ns);
+
+    nlohmann::json stage_json;
+    for (int i = 0; i < StageCount; i++) {
+        if (k_stages[i].per_item)
+            stage_json[k_stages[i].name] = stages[i].toJSON();
+        else
+            stage_json[k_stages[i].name]["total_ms"] = toMs(stages[i].totalNs());
+    }
+    json["stages"] = stage_json;
+
+    nlohmann::json format_json = nlohmann::json::object();
+    for (int i = 0; i < FormatCount; i++) {
+        const FormatCounters &counters = format_counters[i];
+        if (counters.files == 0 && formats[i].count() == 0)
+            continue;
+        nlohmann::json entry = formats[i].toJSON();
+        entry["files"] = (uint64_t)counters.files;
+        entry["fast_parser"] = (uint64_t)counters.fast;
+        entry["taglib"] = (uint64_t)counters.taglib;
+        entry["failed"] = (uint64_t)counters.failed;
+        format_json[formatName((AudioFormat)i)] = entry;
+    }
+    json["formats"] = format_json;
+
+    std::vector<SlowFile> files;
+    {
+        std::lock_guard<std::mutex> lock(slowest_mutex);
+        files = slowest;
+    }
+    std::sort(files.begin(), files.end(), [](const SlowFile &a, const SlowFile &b) { return a.ns > b.ns; });
+    nlohmann::json slowest_json = nlohmann::json::array();
+    for (const SlowFile &file : files) {
+        nlohmann::json entry;
+        entry["path"] = file.path;
+        entry["format"] = formatName(file.format);
+        entry["ms"] = toMs(file.ns);
+        entry["bytes"] = file.size;
+        slowest_json.push_back(entry);
+    }
+    json["slowest_files"] = slowest_json;
+    return json;
+}
+
+/**
+ * @brief Returns the report of a scan: its counters and its timers.
+ */
+nlohmann::json scanReport(ScanProgress &progress) {
+    nlohmann::json report = progress.stats.toJSON();
+    report["discovered"] = (uint64_t)progress.discovered;
+    report["queued"] = (uint64_t)progress.queued;
+    report["parsed"] = (uint64_t)progress.parsed;
+    report["inserted"] = (uint64_t)progress.inserted;
+    report["failed"] = (uint64_t)progress.failed;
+    report["bytes_read"] = (uint64_t)progress.bytes_read;
+    report["failed_files"] = progress.failedFiles();
+    return report;
+}
+
+/**
+ * @brief Writes the report of a scan to a file as JSON.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int writeScanReport(ScanProgress &progress, const std::string &path) {
+    std::ofstream out(std::filesystem::u8path(path));
+    out << scanReport(progress).dump(2) << std::endl;
+    if (!out) {
+        logError("Unable to write the scan report to %s\n", path.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Logs one line with the time a scan took and where it went.
+ */
+void logScanSummary(const ScanProgress &progress) {
+    std::string stages;
+    for (int i = 0; i < StageCount; i++) {
+        uint64_t ms = (progress.stats.stageNs((ScanStage)i) + 500000) / 1000000;
+        if (ms > 0)
+            stages += std::string(stages.empty() ? "" : ", ") + k_stages[i].name + " " + std::to_string(ms);
+    }
+    log("Scan of %llu files took %llu ms (%s ms).\n", (unsigned long long)progress.discovered,
+        (unsigned long long)((progress.stats.wallNs() + 500000) / 1000000), stages.empty() ? "no stage over 1" : stages.c_str());
+}
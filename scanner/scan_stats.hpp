@@ -0,0 +1,119 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <vector>
+
+#include "formats.hpp"
+
+#define LATENCY_BUCKETS 32  // bucket i counts times below 2^i microseconds
+#define SLOWEST_FILES 20    // files kept in the report's slowest_files
+
+/**
+ * @brief Counts durations in power-of-two buckets of microseconds. Safe to
+ *        record from several threads at once.
+ */
+class LatencyHistogram {
+   public:
+    void record(uint64_t ns);
+
+    uint64_t count() const { return samples.load(std::memory_order_relaxed); }
+    uint64_t totalNs() const { return total_ns.load(std::memory_order_relaxed); }
+    uint64_t percentileUs(double fraction) const;
+    nlohmann::json toJSON() const;
+
+   private:
+    std::atomic<uint64_t> buckets[LATENCY_BUCKETS] = {};
+    std::atomic<uint64_t> samples{0};
+    std::atomic<uint64_t> total_ns{0};
+    std::atomic<uint64_t> max_ns{0};
+};
+
+/**
+ * @brief The parts of an update() run that are timed. Stages marked per item
+ *        are timed once per file, song or batch, the others once per run.
+ */
+enum ScanStage {
+    StageLoad = 0,      // reading the stored songs and entities
+    StageWalk,          // walking the search paths, without the diffing
+    StageDiff,          // matching walked files against stored songs
+    StageExtract,       // per file: reading tags, properties and picture
+    StageEntities,      // per song: looking up or adding artists, genres and album
+    StageArt,           // per song: storing the album art of an album without any
+    StageInsert,        // per song: writing the song, its relations and indexes
+    StageCommit,        // per batch: committing a transaction
+    StageCleanup,       // deleting songs, albums, artists and genres that are gone
+    StageNameIndexes,   // rebuilding the autocompletion indexes
+    StageThumbnails,    // making thumbnails of new album art
+    StageArtCleanup,    // deleting album art files no album uses
+    StageCount
+};
+
+/**
+ * @brief Timers and counters of one scan, for finding out where a slow scan
+ *        spends its time. Updated by the scanning threads with relaxed
+ *        atomics, and turned into a JSON report by scanReport.
+ */
+class ScanStats {
+   public:
+    void begin();
+    void end();
+
+    void record(ScanStage stage, uint64_t ns) { stages[stage].record(ns); }
+    void recordFile(const std::string &path, AudioFormat format, uint64_t ns, int64_t size);
+
+    FormatCounters *formatCounters() { return format_counters; }  // indexed by AudioFormat, for extractFile
+    const FormatCounters *formatCounters() const { return format_counters; }
+    void resetFormatCounters();
+
+    uint64_t stageNs(ScanStage stage) const { return stages[stage].totalNs(); }
+    uint64_t wallNs() const { return wall_ns.load(std::memory_order_relaxed); }
+
+    nlohmann::json toJSON() const;
+
+   private:
+    struct SlowFile {
+        std::string path;
+        AudioFormat format;
+        uint64_t ns;
+        int64_t size;
+    };
+
+    LatencyHistogram stages[StageCount];
+    LatencyHistogram formats[FormatCount];  // StageExtract by format
+    FormatCounters format_counters[FormatCount];
+    std::chrono::steady_clock::time_point started;
+    std::atomic<uint64_t> wall_ns{0};
+
+    mutable std::mutex slowest_mutex;
+    std::vector<SlowFile> slowest;              // a min-heap on ns
+    std::atomic<uint64_t> slowest_floor_ns{0};  // what a file must beat once slowest is full
+};
+
+/**
+ * @brief Times the scope it lives in as one sample of a stage.
+ */
+class StageTimer {
+   public:
+    StageTimer(ScanStats &stats, ScanStage stage) : stats(stats), stage(stage), start(std::chrono::steady_clock::now()) {}
+    ~StageTimer() { stats.record(stage, elapsedNs()); }
+
+    uint64_t elapsedNs() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+   private:
+    ScanStats &stats;
+    ScanStage stage;
+    std::chrono::steady_clock::time_point start;
+};
+
+struct ScanProgress;
+
+nlohmann::json scanReport(ScanProgress &progress);
+int writeScanReport(ScanProgress &progress, const std::string &path);
+void logScanSummary(const ScanProgress &progress);
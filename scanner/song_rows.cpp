@@ -0,0 +1,128 @@
+#include "song_rows.hpp"
+
+#include <sqlite3.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "misc.hpp"
+
+// The ids come in as one JSON array, so that a single prepared statement
+// serves any number of them.
+static const char *k_song_rows_sql =
+    "SELECT V.id, V.album_id, V.track_number, V.disc_number, V.title, V.album, V.album_artist, V.contributing_artists, V.location, V.album_art_location "
+    "FROM json_each(?1) I LEFT JOIN SongView V ON V.id = I.value "
+    "ORDER BY I.key;";
+
+/**
+ * @brief Copies a text column into the string arena.
+ *
+ * @param[out] offset Set to the offset of the copy, or -1 if the column is NULL.
+ * @param[out] length Set to the length of the copy in bytes.
+ */
+static void appendColumn(sqlite3_stmt *stmt, int column, std::string &arena, int32_t &offset, int32_t &length) {
+    const char *text = (const char *)sqlite3_column_text(stmt, column);
+    if (text == NULL) {
+        offset = -1;
+        length = 0;
+        return;
+    }
+    length = sqlite3_column_bytes(stmt, column);
+    offset = arena.size();
+    arena.append(text, length);
+    arena.push_back('\0');
+}
+
+/**
+ * @brief Reads the details of many songs with one query.
+ *
+ * @details Meant to replace one getSong query per song when
+ *          filling a list: the rows come back as fixed-layout structs that
+ *          can be read in place through a Pointer, with no conversion per
+ *          field.
+ *
+ * @param[in] db_path The path to the database file.
+ * @param[in] ids The ids of the songs to read.
+ * @param[in] count The number of ids.
+ *
+ * @return The rows, to be released with freeSongRows, or NULL on failure.
+ */
+SongRows *getSongRows(const char *db_path, const int32_t *ids, int32_t count) {
+    if (count < 0 || (count > 0 && ids == NULL))
+        return NULL;
+
+    std::string id_list = "[";
+    for (int32_t i = 0; i < count; i++) {
+        if (i > 0)
+            id_list += ',';
+        id_list += std::to_string(ids[i]);
+    }
+    id_list += ']';
+
+    sqlite3 *db;
+    if (sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+        logError("Can't open database %s: %s\n", db_path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return NULL;
+    }
+    sqlite3_busy_timeout(db, 5000);
+
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, k_song_rows_sql, -1, &stmt, NULL) != SQLITE_OK) {
+        logError("Error while preparing statement %s: %s\n", k_song_rows_sql, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return NULL;
+    }
+    sqlite3_bind_text(stmt, 1, id_list.c_str(), id_list.size(), SQLITE_STATIC);
+
+    std::vector<SongRow> rows;
+    rows.reserve(count);
+    std::string arena;
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        SongRow row;
+        bool found = sqlite3_column_type(stmt, 0) != SQLITE_NULL;
+        row.id = found ? sqlite3_column_int(stmt, 0) : -1;
+        row.album_id = found ? sqlite3_column_int(stmt, 1) : -1;
+        row.track_number = found ? sqlite3_column_int(stmt, 2) : -1;
+        row.disc_number = found ? sqlite3_column_int(stmt, 3) : -1;
+        appendColumn(stmt, 4, arena, row.title_offset, row.title_length);
+        appendColumn(stmt, 5, arena, row.album_offset, row.album_length);
+        appendColumn(stmt, 6, arena, row.album_artists_offset, row.album_artists_length);
+        appendColumn(stmt, 7, arena, row.contributing_artists_offset, row.contributing_artists_length);
+        appendColumn(stmt, 8, arena, row.location_offset, row.location_length);
+        appendColumn(stmt, 9, arena, row.album_art_location_offset, row.album_art_location_length);
+        rows.push_back(row);
+    }
+    if (rc != SQLITE_DONE)
+        logError("Error while reading song rows: %s\n", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    if (rc != SQLITE_DONE || arena.size() > INT32_MAX)
+        return NULL;
+
+    // The header, the rows and the arena share one block, rows first after
+    // the header so that they stay aligned.
+    size_t rows_size = rows.size() * sizeof(SongRow);
+    SongRows *result = (SongRows *)malloc(sizeof(SongRows) + rows_size + arena.size() + 1);
+    if (result == NULL)
+        return NULL;
+    result->count = rows.size();
+    result->strings_size = arena.size();
+    result->rows = (SongRow *)(result + 1);
+    result->strings = (char *)result->rows + rows_size;
+    if (rows_size > 0)
+        memcpy(result->rows, rows.data(), rows_size);
+    memcpy(result->strings, arena.data(), arena.size());
+    result->strings[arena.size()] = '\0';
+    return result;
+}
+
+/**
+ * @brief Releases the result of getSongRows.
+ */
+void freeSongRows(SongRows *rows) {
+    free(rows);
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+
+/**
+ * @brief The details of one song, laid out for FFI.
+ *
+ * @details Text fields are byte offsets into the string arena of the
+ *          SongRows they came with, each string being UTF-8 and NUL
+ *          terminated, with its length in bytes alongside. An offset of -1
+ *          stands for NULL. A requested id with no song has id -1 and every
+ *          string NULL.
+ */
+struct SongRow {
+    int32_t id;
+    int32_t album_id;
+    int32_t track_number;
+    int32_t disc_number;
+    int32_t title_offset;
+    int32_t title_length;
+    int32_t album_offset;
+    int32_t album_length;
+    int32_t album_artists_offset;
+    int32_t album_artists_length;
+    int32_t contributing_artists_offset;
+    int32_t contributing_artists_length;
+    int32_t location_offset;
+    int32_t location_length;
+    int32_t album_art_location_offset;
+    int32_t album_art_location_length;
+};
+
+/**
+ * @brief The result of getSongRows: one SongRow per requested id, in the order
+ *        of the request, and the strings they point into. Everything lives in
+ *        one allocation, released with freeSongRows.
+ */
+struct SongRows {
+    int32_t count;
+    int32_t strings_size;
+    SongRow *rows;
+    char *strings;
+};
+
+static_assert(sizeof(SongRow) == 64, "SongRow is read from Dart with a fixed layout");
+
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) SongRows *getSongRows(const char *db_path, const int32_t *ids, int32_t count);
+
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) void freeSongRows(SongRows *rows);
@@ -0,0 +1,110 @@
+#include "statement_cache.hpp"
+
+#include "database_functions.hpp"
+#include "misc.hpp"
+
+static const char *k_statement_sql[CachedStatementCount] = {
+    "SELECT id FROM Albums WHERE title = ?1;",
+    "SELECT id FROM Albums WHERE album_key = ?1;",
+    "INSERT INTO Albums (id, title) VALUES (NULL, ?1);",
+    "INSERT INTO Albums (id, title, album_key) VALUES (NULL, ?1, ?2);",
+    "SELECT id FROM Artists WHERE name = ?1;",
+    "INSERT INTO Artists (id, name) VALUES (NULL, ?1);",
+    "SELECT id FROM Genres WHERE name = ?1;",
+    "INSERT INTO Genres (id, name) VALUES (NULL, ?1);",
+    "INSERT INTO AlbumArtists (album_id, artist_id) VALUES (?1, ?2);",
+    "INSERT INTO Songs (title, track_number, disc_number, album_id, location, file_size, file_mtime, file_inode, duration_ms, bitrate, sample_rate, channels, bits_per_sample) "
+    "VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11, ?12, ?13);",
+    "UPDATE Songs SET title = ?1, track_number = ?2, disc_number = ?3, album_id = ?4, location = ?5, file_size = ?6, file_mtime = ?7, file_inode = ?8, "
+    "duration_ms = ?9, bitrate = ?10, sample_rate = ?11, channels = ?12, bits_per_sample = ?13 WHERE id = ?14;",
+    "UPDATE Songs SET file_size = ?2, file_mtime = ?3, file_inode = ?4 WHERE id = ?1;",
+    "INSERT INTO ContributingArtists (song_id, artist_id) VALUES (?1, ?2);",
+    "INSERT INTO SongGenreMap (song_id, genre_id) VALUES (?1, ?2);",
+    "DELETE FROM ContributingArtists WHERE song_id = ?1;",
+    "DELETE FROM SongGenreMap WHERE song_id = ?1;",
+    "SELECT 1 FROM Albums WHERE album_art_location IS NOT NULL AND id = ?1;",
+    "UPDATE Albums SET album_art_location = ?2 WHERE id = ?1;",
+    "DELETE FROM Songs WHERE location = ?1;",
+    "SELECT id, location, file_size, file_mtime, file_inode, duration_ms IS NOT NULL FROM Songs;",
+    "SELECT id, file_size, file_mtime, file_inode, duration_ms IS NOT NULL FROM Songs WHERE location = ?1;",
+    "SELECT location FROM Songs WHERE location >= ?1 AND location < ?2;",
+    "DELETE FROM SongSearch WHERE rowid = ?1;",
+    "INSERT INTO SongSearch (rowid, title, album, artists, genres) VALUES (?1, ?2, ?3, ?4, ?5);",
+    "DELETE FROM SongSearch WHERE rowid IN (SELECT id FROM Songs WHERE location = ?1);",
+    "INSERT OR REPLACE INTO SongView " SELECT_SONG_VIEW " WHERE S.id = ?1;",
+    "UPDATE SongView SET album_art_location = ?2 WHERE album_id = ?1;"};
+
+StatementCache::StatementCache(sqlite3 *db) : db(db) {
+    for (int i = 0; i < CachedStatementCount; i++)
+        statements[i] = NULL;
+}
+
+StatementCache::~StatementCache() {
+    for (int i = 0; i < CachedStatementCount; i++)
+        sqlite3_finalize(statements[i]);
+}
+
+/**
+ * @brief Returns the prepared statement for a query shape, ready for binding.
+ *
+ * @param[in] statement The query shape.
+ *
+ * @return The statement, or NULL if it could not be prepared.
+ */
+sqlite3_stmt *StatementCache::get(CachedStatement statement) {
+    if (statements[statement] == NULL)
+        statements[statement] = prepare(k_statement_sql[statement]);
+    return reuse(statements[statement]);
+}
+
+sqlite3_stmt *StatementCache::prepare(const char *sql_stmt) {
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v3(db, sql_stmt, -1, SQLITE_PREPARE_PERSISTENT, &stmt, NULL) != SQLITE_OK) {
+        logError("Error while preparing statement %s: %s\n", sql_stmt, sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return NULL;
+    }
+    return stmt;
+}
+
+sqlite3_stmt *StatementCache::reuse(sqlite3_stmt *stmt) {
+    if (stmt != NULL) {
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+    }
+    return stmt;
+}
+
+/**
+ * @brief Runs a statement that returns no rows, then resets it.
+ *
+ * @param[in] stmt The bound statement to run.
+ *
+ * @return SQLITE_DONE on success, the SQLite error code otherwise.
+ */
+int stepStatement(sqlite3_stmt *stmt) {
+    int rc = sqlite3_step(stmt);
+    while (rc == SQLITE_ROW)
+        rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    return rc;
+}
+
+/**
+ * @brief Runs a statement and reads the integer in the first column of its
+ *        first row, then resets it.
+ *
+ * @param[in] stmt The bound statement to run.
+ * @param[out] id The value read, or 0 if there was no row.
+ *
+ * @return SQLITE_ROW if a row was found, SQLITE_DONE if not, the SQLite error
+ *         code otherwise.
+ */
+int stepForId(sqlite3_stmt *stmt, sqlite3_int64 &id) {
+    id = 0;
+    int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW)
+        id = sqlite3_column_int64(stmt, 0);
+    sqlite3_reset(stmt);
+    return rc;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <sqlite3.h>
+
+/**
+ * @brief The query shapes used while scanning. Each one maps to one SQL
+ *        string in statement_cache.cpp.
+ */
+enum CachedStatement {
+    SelectAlbumIdByTitle,
+    SelectAlbumIdByKey,
+    InsertAlbum,
+    InsertKeyedAlbum,
+    SelectArtistIdByName,
+    InsertArtist,
+    SelectGenreIdByName,
+    InsertGenre,
+    InsertAlbumArtist,
+    InsertSong,
+    UpdateSong,
+    UpdateSongFingerprint,
+    InsertContributingArtist,
+    InsertSongGenre,
+    DeleteSongContributingArtists,
+    DeleteSongGenres,
+    SelectAlbumHasArt,
+    UpdateAlbumArt,
+    DeleteSongByLocation,
+    SelectSongFingerprints,
+    SelectSongByLocation,
+    SelectSongLocationsInRange,
+    DeleteSongSearch,
+    InsertSongSearch,
+    DeleteSongSearchByLocation,
+    ReplaceSongView,
+    UpdateSongViewAlbumArt,
+    CachedStatementCount
+};
+
+/**
+ * @brief Holds one prepared sqlite3_stmt per query shape for the lifetime of
+ *        a connection, so that no SQL is parsed more than once per run.
+ *
+ * @details Statements are prepared the first time they are asked for. get()
+ *          hands them out reset and with their bindings cleared.
+ */
+class StatementCache {
+   public:
+    explicit StatementCache(sqlite3 *db);
+    ~StatementCache();
+
+    StatementCache(const StatementCache &) = delete;
+    StatementCache &operator=(const StatementCache &) = delete;
+
+    sqlite3_stmt *get(CachedStatement statement);
+
+   private:
+    sqlite3_stmt *prepare(const char *sql_stmt);
+    sqlite3_stmt *reuse(sqlite3_stmt *stmt);
+
+    sqlite3 *db;
+    sqlite3_stmt *statements[CachedStatementCount];
+};
+
+int stepStatement(sqlite3_stmt *stmt);
+int stepForId(sqlite3_stmt *stmt, sqlite3_int64 &id);
@@ -0,0 +1,85 @@
+#include "string_pool.hpp"
+
+#include <cstring>
+#include <memory>
+#include <new>
+#include <vector>
+
+#define STRING_POOL_FIRST_BLOCK (64 * 1024)  // the arena grows geometrically from there
+
+void *StringPool::CountingResource::do_allocate(size_t size, size_t alignment) {
+    allocated += size;
+    return ::operator new(size, std::align_val_t(alignment));
+}
+
+void StringPool::CountingResource::do_deallocate(void *p, size_t size, size_t alignment) {
+    allocated -= size;
+    ::operator delete(p, size, std::align_val_t(alignment));
+}
+
+StringPool::StringPool() : arena(STRING_POOL_FIRST_BLOCK, &upstream), strings(&arena), lists(&arena) {}
+
+/**
+ * @brief Returns the pool's copy of a string, making one the first time the
+ *        string is seen.
+ */
+std::string_view StringPool::intern(std::string_view s) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = strings.find(s);
+    if (it != strings.end())
+        return *it;
+    char *copy = (char *)arena.allocate(s.size() + 1, 1);
+    memcpy(copy, s.data(), s.size());
+    copy[s.size()] = '\0';  // so that c_str-style callers can use data()
+    return *strings.insert(std::string_view(copy, s.size())).first;
+}
+
+/**
+ * @brief Returns the pool's copy of a list of strings, interning each of
+ *        them, and making a copy of the list the first time it is seen.
+ *
+ * @param[in] names The strings, which need not be interned.
+ * @param[in] count The number of strings.
+ */
+NameList StringPool::internList(const std::string_view *names, size_t count) {
+    if (count == 0)
+        return NameList();
+    std::string_view stack_items[16];
+    std::vector<std::string_view> heap_items(count > 16 ? count : 0);  // only for unusually long lists
+    std::string_view *items = count > 16 ? heap_items.data() : stack_items;
+    for (size_t i = 0; i < count; i++)
+        items[i] = intern(names[i]);
+
+    // Interned strings are unique, so a list is identified by the bytes of
+    // its items, which point into the pool.
+    std::string_view key((const char *)items, count * sizeof(std::string_view));
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = lists.find(key);
+    if (it != lists.end())
+        return it->second;
+    std::string_view *copy = (std::string_view *)arena.allocate(count * sizeof(std::string_view), alignof(std::string_view));
+    std::uninitialized_copy(items, items + count, copy);
+    NameList list(copy, count);
+    lists.emplace(std::string_view((const char *)copy, count * sizeof(std::string_view)), list);
+    return list;
+}
+
+size_t StringPool::size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return strings.size();
+}
+
+size_t StringPool::bytes() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return upstream.allocated;
+}
+
+/**
+ * @brief Returns a pool for callers outside a scan, such as getMetadata. It
+ *        lives as long as the process, and grows with the distinct names it
+ *        sees.
+ */
+StringPool &sharedStringPool() {
+    static StringPool pool;
+    return pool;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstddef>
+#include <memory_resource>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+
+/**
+ * @brief A list of strings interned in a StringPool, such as the artists of a
+ *        song. It points into the pool and is valid as long as the pool is.
+ */
+class NameList {
+   public:
+    NameList() : items(NULL), count(0) {}
+    NameList(const std::string_view *items, size_t count) : items(items), count(count) {}
+
+    const std::string_view *begin() const { return items; }
+    const std::string_view *end() const { return items + count; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const std::string_view &operator[](size_t i) const { return items[i]; }
+
+   private:
+    const std::string_view *items;
+    size_t count;
+};
+
+/**
+ * @brief Keeps one copy of each distinct string and list of strings it is
+ *        given, for the lifetime of the pool.
+ *
+ * @details Artist, genre and album names repeat across thousands of files, so
+ *          the scanner interns them instead of copying them into every
+ *          Metadata. The strings, the lists and the hash tables all live in
+ *          one monotonic arena, which is only freed with the pool; once a name
+ *          has been seen, interning it again allocates nothing.
+ *
+ *          A string or list handed out is never moved, so two interned values
+ *          are equal exactly when their data pointers are. Interning is safe
+ *          from several threads at once; reading an interned value needs no
+ *          lock.
+ */
+class StringPool {
+   public:
+    StringPool();
+
+    StringPool(const StringPool &) = delete;
+    StringPool &operator=(const StringPool &) = delete;
+
+    std::string_view intern(std::string_view s);
+    NameList internList(const std::string_view *names, size_t count);
+
+    size_t size() const;   // distinct strings
+    size_t bytes() const;  // taken from the heap by the arena
+
+   private:
+    /**
+     * @brief Counts what the arena takes from the heap.
+     */
+    class CountingResource : public std::pmr::memory_resource {
+       public:
+        size_t allocated = 0;
+
+       private:
+        void *do_allocate(size_t size, size_t alignment) override;
+        void do_deallocate(void *p, size_t size, size_t alignment) override;
+        bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override { return this == &other; }
+    };
+
+    mutable std::mutex mutex;
+    CountingResource upstream;
+    std::pmr::monotonic_buffer_resource arena;
+    std::pmr::unordered_set<std::string_view> strings;
+    std::pmr::unordered_map<std::string_view, NameList> lists;  // keyed by the bytes of their interned items
+};
+
+StringPool &sharedStringPool();
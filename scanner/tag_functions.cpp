@@ -1,21 +1,254 @@
 #include "tag_functions.hpp"
 
+#include <taglib/audioproperties.h>
 #include <taglib/fileref.h>
 #include <taglib/tag.h>
 #include <taglib/tpropertymap.h>
 
+#include <algorithm>
+#include <cstdlib>
 #include <filesystem>
-#include <fstream>
 
+#include "art_store.hpp"
+#include "fast_tags.hpp"
+#include "formats.hpp"
 #include "misc.hpp"
 
+/**
+ * @brief Splits a list of names and interns it, or the fallback name if the
+ *        list is empty.
+ */
+static NameList internNames(StringPool &names, const std::string &text, std::string_view fallback) {
+    std::string_view split[16];
+    size_t count = splitNames(text, split, 16);
+    if (count == 0)
+        return names.internList(&fallback, 1);
+    if (count <= 16)
+        return names.internList(split, count);
+    std::vector<std::string_view> all(count);
+    splitNames(text, all.data(), count);
+    return names.internList(all.data(), count);
+}
+
+/**
+ * @brief Fills a Metadata object from the fields of a file, splitting the
+ *        artist and genre lists and filling in defaults for missing names.
+ *
+ * @details The lists and the album are interned in names. Once the names of
+ *          a file have been seen, this allocates nothing for them.
+ */
+static void fillMetadata(Metadata &metadata, const std::string &file_location, const RawTags &tags, StringPool &names) {
+    metadata.file_location = std::filesystem::absolute(file_location).generic_string();
+    metadata.title = tags.title.empty() ? "Unknown Song" : tags.title;
+    metadata.contributing_artists = internNames(names, tags.artist, "Unknown Artist");
+    metadata.album = names.intern(tags.album.empty() ? "Unknown Album" : tags.album);
+    metadata.album_artists = internNames(names, tags.album_artist, "Unknown Artist");
+    metadata.genres = internNames(names, tags.genre, "Unknown Genre");
+    metadata.track_number = tags.track_number;
+    metadata.disc_number = tags.disc_number;
+    metadata.year = tags.year;
+    metadata.audio = tags.audio;
+}
+
+/**
+ * @brief The TagLib half of extractFile.
+ *
+ * @param[in] handler The format of the file, whose reader is used directly so
+ *                    TagLib does not guess it again. NULL lets TagLib guess.
+ * @param[in] accurate Whether to ask TagLib for accurate audio properties.
+ */
+static int readWithTagLib(const std::string &file_location, const FormatHandler *handler, bool accurate, RawTags &tags, std::string *picture, const std::function<bool(const RawTags &)> &want_picture) {
+    if (picture != NULL)
+        picture->clear();
+    TagLib::FileRef file_ref = handler != NULL ? TagLib::FileRef(handler->open(file_location.c_str(), accurate)) : TagLib::FileRef(file_location.c_str());
+    if (file_ref.isNull()) {
+        logError("Could not read metadata from file %s\n", file_location.c_str());
+        return -1;
+    }
+    TagLib::Tag *file_tag = file_ref.tag();
+    TagLib::PropertyMap props = file_ref.properties();
+    tags.title = file_tag->title().to8Bit(true);
+    tags.artist = file_tag->artist().to8Bit(true);
+    tags.album = file_tag->album().to8Bit(true);
+    tags.album_artist = props["ALBUMARTIST"].toString().to8Bit(true);
+    tags.genre = file_tag->genre().to8Bit(true);
+    tags.track_number = file_tag->track();
+    tags.disc_number = props["DISCNUMBER"].toString().toInt();
+    tags.year = file_tag->year();
+
+    tags.audio = AudioInfo();
+    if (TagLib::AudioProperties *audio = file_ref.audioProperties()) {
+        tags.audio.duration_ms = audio->lengthInMilliseconds();
+        tags.audio.bitrate = audio->bitrate();
+        tags.audio.sample_rate = audio->sampleRate();
+        tags.audio.channels = audio->channels();
+        if (handler != NULL && handler->bits_per_sample != NULL)
+            tags.audio.bits_per_sample = handler->bits_per_sample(audio);
+    }
+
+    if (picture != NULL && (!want_picture || want_picture(tags))) {
+        for (TagLib::VariantMap map : file_ref.complexProperties("PICTURE")) {
+            TagLib::ByteVector picture_byte_vector = map["data"].toByteVector();
+            picture->assign(picture_byte_vector.data(), picture_byte_vector.size());
+            break;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads a file again with TagLib and logs where the fast parser
+ *        disagrees with it.
+ *
+ * @param[in] picture_wanted Whether the fast parser was asked for the picture.
+ *
+ * @return The number of fields that differ, or -1 if TagLib cannot read the
+ *         file. Audio properties count as equal within 1% (at least 50 ms)
+ *         and 2 kb/s.
+ */
+static int compareWithTagLib(const std::string &file_location, const FormatHandler *handler, bool accurate, const RawTags &fast, const std::string *fast_picture, bool picture_wanted, RawTags &reference, std::string *reference_picture) {
+    if (readWithTagLib(file_location, handler, accurate, reference, reference_picture, [&](const RawTags &) { return picture_wanted; }) != 0) {
+        logWarning("Fast parser read %s, which TagLib cannot read\n", file_location.c_str());
+        return -1;
+    }
+    int differences = 0;
+    auto compareText = [&](const char *field, const std::string &a, const std::string &b) {
+        if (a != b) {
+            logWarning("Fast parser differs from TagLib on %s of %s: \"%s\" instead of \"%s\"\n", field, file_location.c_str(), a.c_str(), b.c_str());
+            differences++;
+        }
+    };
+    auto compareNumber = [&](const char *field, long a, long b, long tolerance) {
+        if (std::abs(a - b) > tolerance) {
+            logWarning("Fast parser differs from TagLib on %s of %s: %ld instead of %ld\n", field, file_location.c_str(), a, b);
+            differences++;
+        }
+    };
+    compareText("title", fast.title, reference.title);
+    compareText("artist", fast.artist, reference.artist);
+    compareText("album", fast.album, reference.album);
+    compareText("album artist", fast.album_artist, reference.album_artist);
+    compareText("genre", fast.genre, reference.genre);
+    compareNumber("track", fast.track_number, reference.track_number, 0);
+    compareNumber("disc", fast.disc_number, reference.disc_number, 0);
+    compareNumber("year", fast.year, reference.year, 0);
+    compareNumber("duration", fast.audio.duration_ms, reference.audio.duration_ms, std::max(50, reference.audio.duration_ms / 100));
+    compareNumber("bitrate", fast.audio.bitrate, reference.audio.bitrate, 2);
+    compareNumber("sample rate", fast.audio.sample_rate, reference.audio.sample_rate, 0);
+    compareNumber("channels", fast.audio.channels, reference.audio.channels, 0);
+    compareNumber("bits per sample", fast.audio.bits_per_sample, reference.audio.bits_per_sample, 0);
+    if (fast_picture != NULL && *fast_picture != *reference_picture) {
+        logWarning("Fast parser differs from TagLib on the picture of %s: %zu bytes instead of %zu\n", file_location.c_str(), fast_picture->size(), reference_picture->size());
+        differences++;
+    }
+    return differences;
+}
+
+/**
+ * @brief Reads the tags, the audio properties and optionally the embedded
+ *        picture of a music file, opening and parsing it only once.
+ *
+ * @details The picture is the largest part of most tags, so it is only copied
+ *          out when it is wanted: want_picture is asked once the tags are
+ *          read, so it can decide from the album, for example to skip albums
+ *          that already have art.
+ *
+ *          The format is found from the first bytes of the file (see
+ *          detectFormat), which are read once and shared with the fast
+ *          parser. Files that are not audio are skipped without being handed
+ *          to TagLib.
+ *
+ *          With options.fast_parser, plain MP3 and FLAC files are read by
+ *          readFastTags, and only files it cannot handle go through TagLib.
+ *          With options.check_fast_parser as well, every file the fast parser
+ *          reads is read with TagLib too, differences are logged, and
+ *          TagLib's result is kept, which makes a scan of a library a
+ *          differential test of the parser.
+ *
+ *          Audio properties are estimated from the stream headers (Xing or
+ *          VBRI frames, FLAC STREAMINFO and so on). With
+ *          options.accurate_properties, MP3 files are measured by walking
+ *          every frame (see measureMpegStream) and TagLib is asked for
+ *          accurate properties of the other formats, which costs a read of
+ *          the whole file.
+ *
+ * @param[in] file_location The path to the music file.
+ * @param[out] metadata The Metadata object to store the extracted metadata.
+ * @param[in] names The pool the album and the names of metadata are interned in.
+ * @param[out] picture Set to the raw bytes of the first embedded picture, or
+ *                     emptied if there is none or it was not wanted. NULL
+ *                     never reads the picture.
+ * @param[in] want_picture Tells whether to read the picture. Empty reads it
+ *                         whenever picture is not NULL.
+ * @param[in] options How to read the file.
+ * @param[in,out] counters The format counters of the scan, indexed by
+ *                         AudioFormat, in which the file is counted. NULL
+ *                         counts nothing.
+ *
+ * @return 0 on success, -1 on failure or if the file is not audio.
+ */
+int extractFile(const std::string &file_location, Metadata &metadata, StringPool &names, std::string *picture, const std::function<bool(const Metadata &)> &want_picture, const TagReadOptions &options, FormatCounters *counters) {
+    if (picture != NULL)
+        picture->clear();
+    PositionedFile file(file_location);
+    if (!file.isOpen()) {
+        logError("Could not open file %s\n", file_location.c_str());
+        return -1;
+    }
+    AudioFormat format = detectFormat(file, file_location);
+    metadata.format = format;
+    FormatCounters unused;
+    FormatCounters &count = counters != NULL ? counters[format] : unused;
+    count.files++;
+    const FormatHandler *handler = formatHandler(format);
+    if (handler == NULL) {
+        count.failed++;
+        logWarning("Skipping %s, which is not an audio file\n", file_location.c_str());
+        return -1;
+    }
+
+    bool picture_wanted = true;
+    std::function<bool(const RawTags &)> want_raw_picture;
+    if (want_picture) {
+        want_raw_picture = [&](const RawTags &tags) {
+            fillMetadata(metadata, file_location, tags, names);
+            return picture_wanted = want_picture(metadata);
+        };
+    }
+
+    RawTags tags;
+    if (options.fast_parser && handler->fast_tags && readFastTags(file, format, tags, picture, want_raw_picture) == FastTagsRead) {
+        count.fast++;
+        if (options.check_fast_parser) {
+            RawTags reference;
+            std::string reference_picture;
+            if (compareWithTagLib(file_location, handler, options.accurate_properties, tags, picture, picture_wanted, reference, picture != NULL ? &reference_picture : NULL) > 0) {
+                tags = reference;
+                if (picture != NULL)
+                    picture->swap(reference_picture);
+            }
+        }
+    } else if (readWithTagLib(file_location, handler, options.accurate_properties, tags, picture, want_raw_picture) == 0) {
+        count.taglib++;
+    } else {
+        count.failed++;
+        return -1;
+    }
+    if (options.accurate_properties && format == FormatMp3)
+        measureMpegStream(file, tags.audio);
+    fillMetadata(metadata, file_location, tags, names);
+    return 0;
+}
+
 /**
  * @brief Gets the metadata of a song from its file location.
  *
  * @details This function reads a music file and extracts its metadata into a
  *          Metadata object. The metadata includes the file location, title,
  *          contributing artists, album, album artists, genres, track number,
- *          disc number, and year.
+ *          disc number, year and audio properties. The picture is not read;
+ *          use extractFile to get both from one read of the file. Names are
+ *          interned in sharedStringPool().
  *
  * @param[in] file_location The path to the music file.
  * @param[out] metadata The Metadata object to store the extracted metadata.
@@ -23,33 +256,7 @@
  * @return 0 on success, -1 on failure.
  */
 int getMetadata(std::string file_location, Metadata &metadata) {
-    TagLib::FileRef file_ref(file_location.c_str());
-    if (file_ref.isNull()) {
-        log("Could not read metadata from file %s\n", file_location.c_str());
-        return -1;
-    }
-    TagLib::Tag *file_tag = file_ref.tag();
-    TagLib::PropertyMap props = file_ref.properties();
-    metadata.file_location = std::filesystem::absolute(file_location).generic_string();
-    metadata.title = file_tag->title().to8Bit(true);
-    metadata.contributing_artists = splitString(file_tag->artist().to8Bit(true));
-    metadata.album = file_tag->album().to8Bit(true);
-    metadata.album_artists = splitString(props["ALBUMARTIST"].toString().to8Bit(true));
-    metadata.genres = splitString(file_tag->genre().to8Bit(true));
-    metadata.track_number = file_tag->track();
-    metadata.disc_number = props["DISCNUMBER"].toString().toInt();
-    metadata.year = file_tag->year();
-    if (metadata.title == "")
-        metadata.title = "Unknown Song";
-    if (metadata.album == "")
-        metadata.album = "Unknown Album";
-    if (metadata.album_artists.empty())
-        metadata.album_artists.push_back("Unknown Artist");
-    if (metadata.contributing_artists.empty())
-        metadata.contributing_artists.push_back("Unknown Artist");
-    if (metadata.genres.empty())
-        metadata.genres.push_back("Unknown Genre");
-    return 0;
+    return extractFile(file_location, metadata, sharedStringPool(), NULL);
 }
 
 std::ostream &operator<<(std::ostream &s, const Metadata &m) {
@@ -71,6 +278,11 @@ std::ostream &operator<<(std::ostream &s, const Metadata &m) {
     s << "Track Number: " << m.track_number << std::endl;
     s << "Disc Number: " << m.disc_number << std::endl;
     s << "Year: " << m.year << std::endl;
+    s << "Duration: " << m.audio.duration_ms << " ms" << std::endl;
+    s << "Bitrate: " << m.audio.bitrate << " kb/s" << std::endl;
+    s << "Sample Rate: " << m.audio.sample_rate << " Hz" << std::endl;
+    s << "Channels: " << m.audio.channels << std::endl;
+    s << "Bits Per Sample: " << m.audio.bits_per_sample << std::endl;
     return s;
 }
 
@@ -78,8 +290,8 @@ std::ostream &operator<<(std::ostream &s, const Metadata &m) {
  * @brief Extracts the embedded image from a music file.
  *
  * @details This function reads a music file and extracts the first embedded image it finds
- *          (if any) from it. The image is saved in a file with a random name
- *          in the given directory.
+ *          (if any) from it. The image is saved with saveImage in the
+ *          given directory.
  *
  * @param[in] file_location The path to the music file.
  * @param[in] directory The directory where the image should be saved.
@@ -87,9 +299,23 @@ std::ostream &operator<<(std::ostream &s, const Metadata &m) {
  * @return The name of the image file, or an empty string if no image was found or error occurred.
  */
 std::string getImage(std::string file_location, std::string directory) {
+    return saveImage(getImageData(file_location), directory);
+}
+
+/**
+ * @brief Reads the bytes of the first embedded image of a music file.
+ *
+ * @details Unlike getImage, nothing is written to disk, so this is safe to
+ *          call from several threads at once.
+ *
+ * @param[in] file_location The path to the music file.
+ *
+ * @return The raw image bytes, or an empty string if no image was found or error occurred.
+ */
+std::string getImageData(std::string file_location) {
     TagLib::FileRef file_ref(file_location.c_str());
     if (file_ref.isNull()) {
-        log("Could not read file %s\n", file_location.c_str());
+        logError("Could not read file %s\n", file_location.c_str());
         return "";
     }
     TagLib::StringList complex_property_names = file_ref.complexPropertyKeys();
@@ -98,16 +324,23 @@ std::string getImage(std::string file_location, std::string directory) {
             TagLib::List<TagLib::VariantMap> property = file_ref.complexProperties(property_name);
             for (TagLib::VariantMap map : property) {
                 TagLib::ByteVector picture_byte_vector = map["data"].toByteVector();
-                std::string random_name = std::to_string(std::rand());
-                while (std::filesystem::exists(std::filesystem::path(directory) / std::filesystem::path(random_name)))
-                    random_name = std::to_string(std::rand());
-                std::ofstream image_file(std::filesystem::path(directory) / std::filesystem::path(random_name), std::ios_base::out | std::ios_base::binary);
-                image_file.write(picture_byte_vector.data(), picture_byte_vector.size());
-                image_file.close();
-                return random_name;
+                return std::string(picture_byte_vector.data(), picture_byte_vector.size());
             }
         }
     }
 
     return "";
 }
+
+/**
+ * @brief Saves image bytes to the content-addressed album art store.
+ *
+ * @param[in] image_data The raw image bytes, as returned by getImageData.
+ * @param[in] directory The directory where the image should be saved.
+ *
+ * @return The location of the image relative to the directory (see
+ *         storeArt), or an empty string if there was nothing to save.
+ */
+std::string saveImage(const std::string &image_data, std::string directory) {
+    return storeArt(image_data, directory);
+}
\ No newline at end of file
@@ -1,22 +1,74 @@
 #pragma once
 
+#include <functional>
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#include "formats.hpp"
+#include "misc.hpp"
+#include "string_pool.hpp"
+
+/**
+ * @brief The audio properties of a song, 0 where TagLib could not tell.
+ */
+struct AudioInfo {
+    int duration_ms = 0;
+    int bitrate = 0;  // in kb/s
+    int sample_rate = 0;
+    int channels = 0;
+    int bits_per_sample = 0;  // 0 for lossy formats
+};
+
+/**
+ * @brief The fields of a file as TagLib's Tag interface and property map
+ *        give them, before splitting and defaults.
+ */
+struct RawTags {
+    std::string title;
+    std::string artist;
+    std::string album;
+    std::string album_artist;
+    std::string genre;
+    unsigned int track_number = 0;
+    unsigned int disc_number = 0;
+    unsigned int year = 0;
+    AudioInfo audio;
+};
+
+/**
+ * @brief How extractFile reads files.
+ */
+struct TagReadOptions {
+    bool fast_parser = false;          // read plain MP3 and FLAC files with readFastTags instead of TagLib
+    bool check_fast_parser = false;    // read those with TagLib too, log every difference and keep TagLib's result
+    bool accurate_properties = false;  // walk every frame of MP3 files for their duration instead of estimating it
+};
+
+/**
+ * @brief The metadata of a song. The album and the name lists are interned in
+ *        the StringPool given to extractFile, and valid as long as it is.
+ */
 struct Metadata {
     std::string file_location;
     std::string title;
-    std::vector<std::string> contributing_artists;
-    std::string album;
-    std::vector<std::string> album_artists;
-    std::vector<std::string> genres;
+    NameList contributing_artists;
+    std::string_view album;
+    NameList album_artists;
+    NameList genres;
     unsigned int track_number;
     unsigned int disc_number;
     unsigned int year;
+    AudioInfo audio;
+    AudioFormat format = FormatUnknown;  // set by extractFile, even when it fails
+    FileFingerprint fingerprint;  // filled in by the scanner, not by getMetadata
 };
 
+int extractFile(const std::string &file_location, Metadata &metadata, StringPool &names, std::string *picture, const std::function<bool(const Metadata &)> &want_picture = nullptr, const TagReadOptions &options = TagReadOptions(), FormatCounters *counters = NULL);
 int getMetadata(std::string file_location, Metadata &metadata);
 std::ostream &operator<<(std::ostream &s, const Metadata &m);
 
 std::string getImage(std::string file_location, std::string directory);
+std::string getImageData(std::string file_location);
+std::string saveImage(const std::string &image_data, std::string directory);
@@ -0,0 +1,329 @@
+#include "thumbnails.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+#include "art_store.hpp"
+#include "database_functions.hpp"
+#include "misc.hpp"
+
+#ifdef SONATA_HAVE_JPEG
+#include <jpeglib.h>
+
+#include <csetjmp>
+#endif
+
+// Largest first, since each thumbnail is shrunk from the one before it.
+const int k_thumbnail_sizes[3] = {1024, 256, 64};
+
+#define THUMBNAIL_QUALITY 80
+
+#ifdef SONATA_HAVE_JPEG
+
+/**
+ * @brief A decoded picture, 3 bytes per pixel in RGB order.
+ */
+struct RgbImage {
+    int width = 0;
+    int height = 0;
+    std::vector<unsigned char> pixels;
+};
+
+/**
+ * @brief Lets libjpeg report errors by jumping back to the caller instead of
+ *        exiting the process.
+ */
+struct JpegErrorManager {
+    jpeg_error_mgr base;
+    jmp_buf jump;
+};
+
+static void jpegErrorExit(j_common_ptr cinfo) {
+    longjmp(((JpegErrorManager *)cinfo->err)->jump, 1);
+}
+
+static void jpegIgnoreMessage(j_common_ptr, int) {}
+
+/**
+ * @brief Decodes a JPEG, letting the decoder scale it down by up to 8 times
+ *        as long as its longest side stays at least min_side.
+ *
+ * @details Scaling in the DCT domain skips most of the work of a full
+ *          decode, which matters for the 3000 pixel covers some files carry.
+ *
+ * @return true on success, false if the data is not a JPEG the decoder can
+ *         turn into RGB.
+ */
+static bool decodeJpeg(const std::string &data, int min_side, RgbImage &image) {
+    jpeg_decompress_struct cinfo;
+    JpegErrorManager error;
+    cinfo.err = jpeg_std_error(&error.base);
+    error.base.error_exit = jpegErrorExit;
+    error.base.emit_message = jpegIgnoreMessage;
+    if (setjmp(error.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (unsigned char *)data.data(), data.size());
+    jpeg_read_header(&cinfo, TRUE);
+    if (cinfo.jpeg_color_space == JCS_CMYK || cinfo.jpeg_color_space == JCS_YCCK) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+
+    cinfo.out_color_space = JCS_RGB;
+    int longest = std::max(cinfo.image_width, cinfo.image_height);
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = 1;
+    for (int denominator = 8; denominator > 1; denominator /= 2) {
+        if (longest / denominator >= min_side) {
+            cinfo.scale_denom = denominator;
+            break;
+        }
+    }
+    jpeg_start_decompress(&cinfo);
+    image.width = cinfo.output_width;
+    image.height = cinfo.output_height;
+    image.pixels.resize((size_t)image.width * image.height * 3);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = &image.pixels[(size_t)cinfo.output_scanline * image.width * 3];
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return true;
+}
+
+/**
+ * @brief Encodes an RGB picture as a baseline JPEG with optimized Huffman
+ *        tables.
+ */
+static bool encodeJpeg(const RgbImage &image, std::string &data) {
+    jpeg_compress_struct cinfo;
+    JpegErrorManager error;
+    unsigned char *buffer = NULL;
+    unsigned long size = 0;
+    cinfo.err = jpeg_std_error(&error.base);
+    error.base.error_exit = jpegErrorExit;
+    error.base.emit_message = jpegIgnoreMessage;
+    if (setjmp(error.jump)) {
+        jpeg_destroy_compress(&cinfo);
+        free(buffer);
+        return false;
+    }
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &buffer, &size);
+    cinfo.image_width = image.width;
+    cinfo.image_height = image.height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, THUMBNAIL_QUALITY, TRUE);
+    cinfo.optimize_coding = TRUE;
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row = (JSAMPROW)&image.pixels[(size_t)cinfo.next_scanline * image.width * 3];
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    data.assign((const char *)buffer, size);
+    jpeg_destroy_compress(&cinfo);
+    free(buffer);
+    return true;
+}
+
+/**
+ * @brief Shrinks a picture to fit in a box x box square, keeping its aspect
+ *        ratio. Each output pixel is the average of the input pixels it
+ *        covers.
+ */
+static RgbImage shrinkImage(const RgbImage &source, int box) {
+    double scale = (double)box / std::max(source.width, source.height);
+    RgbImage result;
+    result.width = std::max(1, (int)std::lround(source.width * scale));
+    result.height = std::max(1, (int)std::lround(source.height * scale));
+    result.pixels.resize((size_t)result.width * result.height * 3);
+
+    for (int y = 0; y < result.height; y++) {
+        int y0 = (int)((int64_t)y * source.height / result.height);
+        int y1 = std::max(y0 + 1, (int)((int64_t)(y + 1) * source.height / result.height));
+        for (int x = 0; x < result.width; x++) {
+            int x0 = (int)((int64_t)x * source.width / result.width);
+            int x1 = std::max(x0 + 1, (int)((int64_t)(x + 1) * source.width / result.width));
+            uint32_t sum[3] = {0, 0, 0};
+            for (int sy = y0; sy < y1; sy++) {
+                const unsigned char *pixel = &source.pixels[((size_t)sy * source.width + x0) * 3];
+                for (int sx = x0; sx < x1; sx++, pixel += 3) {
+                    sum[0] += pixel[0];
+                    sum[1] += pixel[1];
+                    sum[2] += pixel[2];
+                }
+            }
+            uint32_t count = (uint32_t)(y1 - y0) * (x1 - x0);
+            unsigned char *out = &result.pixels[((size_t)y * result.width + x) * 3];
+            for (int c = 0; c < 3; c++)
+                out[c] = (sum[c] + count / 2) / count;
+        }
+    }
+    return result;
+}
+
+#endif
+
+/**
+ * @brief Makes the thumbnails of a piece of album art.
+ *
+ * @details The art is decoded once, then shrunk to each of k_thumbnail_sizes
+ *          that is smaller than it, every thumbnail from the previous one.
+ *          Thumbnails are saved as JPEG in the art store, so identical ones
+ *          are shared. Only JPEG art gets thumbnails; other formats, and
+ *          builds without libjpeg, get none.
+ *
+ * @param[in] art_location The location of the art, relative to the directory.
+ * @param[in] directory The album art directory.
+ * @param[out] thumbnails The thumbnails made, largest first.
+ *
+ * @return 0 on success, including when no thumbnail was needed, -1 if the art
+ *         could not be read or decoded.
+ */
+int makeThumbnails(const std::string &art_location, const std::string &directory, std::vector<Thumbnail> &thumbnails) {
+    thumbnails.clear();
+#ifdef SONATA_HAVE_JPEG
+    std::string data;
+    if (loadArt(art_location, directory, data) != 0) {
+        logError("Unable to open album art %s\n", art_location.c_str());
+        return -1;
+    }
+    if (data.size() < 3 || (unsigned char)data[0] != 0xFF || (unsigned char)data[1] != 0xD8 || (unsigned char)data[2] != 0xFF)
+        return 0;
+
+    RgbImage image;
+    if (!decodeJpeg(data, k_thumbnail_sizes[0], image)) {
+        logError("Unable to decode album art %s\n", art_location.c_str());
+        return -1;
+    }
+    for (int size : k_thumbnail_sizes) {
+        if (std::max(image.width, image.height) <= size)
+            continue;
+        image = shrinkImage(image, size);
+        std::string encoded;
+        if (!encodeJpeg(image, encoded))
+            return -1;
+        std::string location = storeArt(encoded, directory);
+        if (location.empty())
+            return -1;
+        thumbnails.push_back({size, image.width, image.height, location});
+    }
+#else
+    (void)art_location;
+    (void)directory;
+#endif
+    return 0;
+}
+
+/**
+ * @brief Makes the thumbnails of every piece of album art that has none yet,
+ *        and records them in AlbumArtVariants.
+ *
+ * @details The art is read, decoded and shrunk on a pool of threads, then all
+ *          variants are written in one transaction. Art that failed, or that
+ *          needs no thumbnails, is marked done too, so that it is not read
+ *          again on every scan. Builds without libjpeg do nothing and leave
+ *          the art for a build that can.
+ *
+ * @param[in] db The database the art belongs to.
+ * @param[in] directory The album art directory.
+ * @param[in] threads The number of threads to use.
+ * @param[in] cancel Stops the work once it becomes true. May be NULL.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int generateThumbnails(sqlite3 *db, const std::string &directory, unsigned int threads, const std::atomic<bool> *cancel) {
+#ifndef SONATA_HAVE_JPEG
+    return 0;
+#endif
+    std::vector<std::string> sources;
+    sqlite3_stmt *stmt;
+    const char *select_sql =
+        "SELECT location FROM ArtBlobs B WHERE thumbnailed = 0 AND ref_count > 0 "
+        "AND EXISTS (SELECT 1 FROM Albums WHERE album_art_location = B.location);";
+    if (sqlite3_prepare_v2(db, select_sql, -1, &stmt, NULL) != SQLITE_OK) {
+        logError("Error while preparing statement %s: %s\n", select_sql, sqlite3_errmsg(db));
+        return -1;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+        sources.push_back((const char *)sqlite3_column_text(stmt, 0));
+    sqlite3_finalize(stmt);
+    if (sources.empty())
+        return 0;
+
+    std::vector<std::vector<Thumbnail>> results(sources.size());
+    std::vector<char> done(sources.size(), false);
+    std::atomic<size_t> next(0);
+    auto work = [&]() {
+        size_t index;
+        while ((index = next++) < sources.size()) {
+            if (cancel != NULL && *cancel)
+                return;
+            makeThumbnails(sources[index], directory, results[index]);
+            done[index] = true;
+        }
+    };
+    std::vector<std::thread> pool;
+    for (unsigned int i = 1; i < std::min<size_t>(std::max(1u, threads), sources.size()); i++)
+        pool.emplace_back(work);
+    work();
+    for (std::thread &thread : pool)
+        thread.join();
+
+    sqlite3_stmt *insert, *mark;
+    const char *insert_sql = "INSERT OR REPLACE INTO AlbumArtVariants (art_location, size, width, height, location) VALUES (?1, ?2, ?3, ?4, ?5);";
+    const char *mark_sql = "UPDATE ArtBlobs SET thumbnailed = 1 WHERE location = ?1;";
+    if (sqlite3_prepare_v2(db, insert_sql, -1, &insert, NULL) != SQLITE_OK) {
+        logError("Error while preparing statement %s: %s\n", insert_sql, sqlite3_errmsg(db));
+        return -1;
+    }
+    if (sqlite3_prepare_v2(db, mark_sql, -1, &mark, NULL) != SQLITE_OK) {
+        logError("Error while preparing statement %s: %s\n", mark_sql, sqlite3_errmsg(db));
+        sqlite3_finalize(insert);
+        return -1;
+    }
+
+    bool error = false;
+    int made = 0;
+    beginTransaction(db);
+    for (size_t i = 0; i < sources.size() && !error; i++) {
+        if (!done[i])
+            continue;
+        for (const Thumbnail &thumbnail : results[i]) {
+            sqlite3_reset(insert);
+            sqlite3_bind_text(insert, 1, sources[i].c_str(), sources[i].size(), SQLITE_TRANSIENT);
+            sqlite3_bind_int(insert, 2, thumbnail.size);
+            sqlite3_bind_int(insert, 3, thumbnail.width);
+            sqlite3_bind_int(insert, 4, thumbnail.height);
+            sqlite3_bind_text(insert, 5, thumbnail.location.c_str(), thumbnail.location.size(), SQLITE_TRANSIENT);
+            if (sqlite3_step(insert) != SQLITE_DONE)
+                error = true;
+            made++;
+        }
+        sqlite3_reset(mark);
+        sqlite3_bind_text(mark, 1, sources[i].c_str(), sources[i].size(), SQLITE_TRANSIENT);
+        if (sqlite3_step(mark) != SQLITE_DONE)
+            error = true;
+    }
+    if (error)
+        logError("Error while recording thumbnails: %s\n", sqlite3_errmsg(db));
+    sqlite3_finalize(insert);
+    sqlite3_finalize(mark);
+    if (error || commitTransaction(db) != 0) {
+        rollbackTransaction(db);
+        return -1;
+    }
+    if (made > 0)
+        log("Made %d thumbnails of %zu album art files.\n", made, sources.size());
+    return 0;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <sqlite3.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+/**
+ * @brief A smaller copy of a piece of album art.
+ */
+struct Thumbnail {
+    int size;  // the box the copy fits in, one of k_thumbnail_sizes
+    int width;
+    int height;
+    std::string location;  // relative to the album art directory
+};
+
+extern const int k_thumbnail_sizes[3];
+
+int makeThumbnails(const std::string &art_location, const std::string &directory, std::vector<Thumbnail> &thumbnails);
+int generateThumbnails(sqlite3 *db, const std::string &directory, unsigned int threads, const std::atomic<bool> *cancel);
@@ -0,0 +1,295 @@
+#include "trie.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <shared_mutex>
+
+#include "misc.hpp"
+
+static bool isSeparator(char c) {
+    return c == ' ' || c == '-' || c == '/' || c == '(' || c == '[' || c == '&' || c == ',' || c == '.' || c == '"' || c == '\'' || c == '_';
+}
+
+Trie::Trie() {
+    clear();
+}
+
+void Trie::clear() {
+    nodes.assign(1, {0, 0, k_none, k_none, k_none});
+    links.clear();
+    items.clear();
+    labels.clear();
+    present.clear();
+}
+
+/**
+ * @brief Adds a name under each of its words. Adding the same kind and id
+ *        twice does nothing.
+ */
+void Trie::insert(int kind, int id, const std::string &name) {
+    if (name.empty() || !present.insert(((uint64_t)(uint32_t)kind << 32) | (uint32_t)id).second)
+        return;
+    uint32_t item = items.size();
+    items.push_back({kind, id, name});
+
+    std::string key = foldName(name);
+    for (size_t i = 0; i < key.size(); i++) {
+        if (!isSeparator(key[i]) && (i == 0 || isSeparator(key[i - 1])))
+            insertKey(key.data() + i, key.size() - i, item);
+    }
+}
+
+void Trie::insertKey(const char *key, size_t length, uint32_t item) {
+    uint32_t node = 0;
+    size_t position = 0;
+    while (position < length) {
+        uint32_t child = findChild(node, key[position]);
+        if (child == k_none) {
+            node = addChild(node, key + position, length - position);
+            break;
+        }
+        const Node &edge = nodes[child];
+        uint32_t common = 0;
+        while (common < edge.label_length && position + common < length && labels[edge.label_offset + common] == key[position + common])
+            common++;
+        if (common < edge.label_length)
+            splitNode(child, common);
+        node = child;
+        position += common;
+    }
+    for (uint32_t link = nodes[node].items; link != k_none; link = links[link].next) {
+        if (links[link].item == item)
+            return;
+    }
+    links.push_back({item, nodes[node].items});
+    nodes[node].items = links.size() - 1;
+}
+
+uint32_t Trie::findChild(uint32_t node, unsigned char first) const {
+    for (uint32_t child = nodes[node].child; child != k_none; child = nodes[child].sibling) {
+        unsigned char label = labels[nodes[child].label_offset];
+        if (label == first)
+            return child;
+        if (label > first)
+            break;
+    }
+    return k_none;
+}
+
+uint32_t Trie::addChild(uint32_t parent, const char *label, size_t length) {
+    uint32_t node = nodes.size();
+    nodes.push_back({(uint32_t)labels.size(), (uint32_t)length, k_none, k_none, k_none});
+    labels.append(label, length);
+
+    unsigned char first = label[0];
+    uint32_t *slot = &nodes[parent].child;
+    while (*slot != k_none && (unsigned char)labels[nodes[*slot].label_offset] < first)
+        slot = &nodes[*slot].sibling;
+    nodes[node].sibling = *slot;
+    *slot = node;
+    return node;
+}
+
+/**
+ * @brief Cuts the edge leading to a node after `at` characters. The node keeps
+ *        the first part of the label, and a new child takes the rest together
+ *        with the node's children and items.
+ */
+void Trie::splitNode(uint32_t node, uint32_t at) {
+    Node tail = nodes[node];
+    tail.label_offset += at;
+    tail.label_length -= at;
+    tail.sibling = k_none;
+    uint32_t tail_index = nodes.size();
+    nodes.push_back(tail);
+
+    nodes[node].label_length = at;
+    nodes[node].child = tail_index;
+    nodes[node].items = k_none;
+}
+
+/**
+ * @brief Finds up to `limit` names with a word starting with `prefix`, in
+ *        the order of their matching keys.
+ */
+std::vector<const CompletionItem *> Trie::complete(const std::string &prefix, size_t limit) const {
+    std::vector<const CompletionItem *> found;
+    std::string key = foldName(prefix);
+    uint32_t node = 0;
+    size_t position = 0;
+    while (position < key.size()) {
+        uint32_t child = findChild(node, key[position]);
+        if (child == k_none)
+            return found;
+        const Node &edge = nodes[child];
+        uint32_t common = 0;
+        while (common < edge.label_length && position + common < key.size() && labels[edge.label_offset + common] == key[position + common])
+            common++;
+        if (position + common < key.size() && common < edge.label_length)
+            return found;
+        node = child;
+        position += common;
+    }
+    collect(node, limit, found);
+    return found;
+}
+
+void Trie::collect(uint32_t node, size_t limit, std::vector<const CompletionItem *> &found) const {
+    for (uint32_t link = nodes[node].items; link != k_none && found.size() < limit; link = links[link].next) {
+        const CompletionItem *item = &items[links[link].item];
+        if (std::find(found.begin(), found.end(), item) == found.end())
+            found.push_back(item);
+    }
+    for (uint32_t child = nodes[node].child; child != k_none && found.size() < limit; child = nodes[child].sibling)
+        collect(child, limit, found);
+}
+
+/**
+ * @brief Reads the titles of all songs and albums and the names of all
+ *        artists and genres in a database.
+ *
+ * @param[in] db The database to read.
+ * @param[in] callback Called with the CompletionKind, id and name of each.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int forEachName(sqlite3 *db, const std::function<void(int kind, int id, const std::string &name)> &callback) {
+    const std::pair<int, const char *> k_sources[] = {
+        {CompleteArtist, "SELECT id, name FROM Artists;"},
+        {CompleteAlbum, "SELECT id, title FROM Albums;"},
+        {CompleteGenre, "SELECT id, name FROM Genres;"},
+        {CompleteSong, "SELECT id, title FROM Songs;"}};
+
+    for (auto &source : k_sources) {
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, source.second, -1, &stmt, NULL) != SQLITE_OK) {
+            logError("Error while preparing statement %s: %s\n", source.second, sqlite3_errmsg(db));
+            return -1;
+        }
+        int rc;
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            const char *name = (const char *)sqlite3_column_text(stmt, 1);
+            if (name != NULL)
+                callback(source.first, sqlite3_column_int(stmt, 0), std::string(name, sqlite3_column_bytes(stmt, 1)));
+        }
+        sqlite3_finalize(stmt);
+        if (rc != SQLITE_DONE) {
+            logError("Error while reading names: %s\n", sqlite3_errmsg(db));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Fills a trie with the names read by forEachName.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int loadTrie(sqlite3 *db, Trie &trie) {
+    trie.clear();
+    return forEachName(db, [&](int kind, int id, const std::string &name) { trie.insert(kind, id, name); });
+}
+
+// The index served by autocompleteQuery, and the database it was built from.
+static std::shared_mutex autocomplete_mutex;
+static Trie autocomplete;
+static std::string autocomplete_database;
+
+/**
+ * @brief Tells whether the autocompletion index was built from the database
+ *        of a connection, and so should follow its changes.
+ */
+bool autocompleteFollows(sqlite3 *db) {
+    const char *filename = sqlite3_db_filename(db, "main");
+    std::shared_lock<std::shared_mutex> lock(autocomplete_mutex);
+    return filename != NULL && !autocomplete_database.empty() && autocomplete_database == filename;
+}
+
+/**
+ * @brief Adds names just committed to a database to the autocompletion
+ *        index, if it was built from that database.
+ */
+void addToAutocomplete(sqlite3 *db, const std::vector<CompletionItem> &added) {
+    if (added.empty() || !autocompleteFollows(db))
+        return;
+    std::unique_lock<std::shared_mutex> lock(autocomplete_mutex);
+    for (const CompletionItem &item : added)
+        autocomplete.insert(item.kind, item.id, item.name);
+}
+
+/**
+ * @brief Rebuilds the autocompletion index from a database, if it was built
+ *        from that database. Used after songs were changed or deleted, which
+ *        the index cannot follow incrementally.
+ */
+void reloadAutocomplete(sqlite3 *db) {
+    if (!autocompleteFollows(db))
+        return;
+    Trie rebuilt;
+    if (loadTrie(db, rebuilt) != 0)
+        return;
+    std::unique_lock<std::shared_mutex> lock(autocomplete_mutex);
+    std::swap(autocomplete, rebuilt);
+}
+
+/**
+ * @brief Builds the autocompletion index from a database.
+ *
+ * @details From then on, scans and the watcher keep the index up to date
+ *          while they write to the same database.
+ *
+ * @param[in] db_path The path to the database file.
+ *
+ * @return The number of names indexed, or -1 on failure.
+ */
+int autocompleteLoad(const char *db_path) {
+    sqlite3 *db;
+    if (sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+        logError("Can't open database %s: %s\n", db_path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return -1;
+    }
+    Trie loaded;
+    int rc = loadTrie(db, loaded);
+    const char *filename = sqlite3_db_filename(db, "main");
+    std::string database = filename != NULL ? filename : "";
+    sqlite3_close(db);
+    if (rc != 0)
+        return -1;
+
+    std::unique_lock<std::shared_mutex> lock(autocomplete_mutex);
+    std::swap(autocomplete, loaded);
+    autocomplete_database = database;
+    return autocomplete.size();
+}
+
+/**
+ * @brief Completes a prefix against the names loaded by autocompleteLoad.
+ *
+ * @details Matching ignores case and Latin-1 accents, and a name matches if
+ *          any of its words starts with the prefix.
+ *
+ * @param[in] prefix The text typed so far.
+ * @param[in] limit The largest number of completions to return.
+ *
+ * @return A JSON array of {"kind", "id", "name"} objects, kind being a
+ *         CompletionKind, to be released with scanFreeString.
+ */
+char *autocompleteQuery(const char *prefix, int limit) {
+    nlohmann::json result = nlohmann::json::array();
+    {
+        std::shared_lock<std::shared_mutex> lock(autocomplete_mutex);
+        for (const CompletionItem *item : autocomplete.complete(prefix, std::max(limit, 0))) {
+            nlohmann::json completion;
+            completion["kind"] = item->kind;
+            completion["id"] = item->id;
+            completion["name"] = item->name;
+            result.push_back(completion);
+        }
+    }
+    return strdup(result.dump().c_str());
+}
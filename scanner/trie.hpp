@@ -0,0 +1,88 @@
+#pragma once
+
+#include <sqlite3.h>
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+/**
+ * @brief What a completion refers to. The values are part of the FFI
+ *        interface.
+ */
+enum CompletionKind {
+    CompleteSong = 0,
+    CompleteArtist = 1,
+    CompleteAlbum = 2,
+    CompleteGenre = 3
+};
+
+/**
+ * @brief A name that can be completed, and the row it belongs to.
+ */
+struct CompletionItem {
+    int kind;  // a CompletionKind
+    int id;
+    std::string name;
+};
+
+/**
+ * @brief A radix tree from case and accent folded names to CompletionItems.
+ *
+ * @details Every word of a name is a key, so "The Beatles" completes both
+ *          "the b" and "beat". Nodes sit only where keys branch. They live in
+ *          one vector and refer to each other by index, and their edge labels
+ *          are slices of one append-only string, so splitting an edge copies
+ *          no characters. Siblings are kept sorted, which makes completions
+ *          come out in key order.
+ */
+class Trie {
+   public:
+    Trie();
+
+    void insert(int kind, int id, const std::string &name);
+    std::vector<const CompletionItem *> complete(const std::string &prefix, size_t limit) const;
+    void clear();
+    size_t size() const { return items.size(); }
+
+   private:
+    static const uint32_t k_none = UINT32_MAX;
+
+    struct Node {
+        uint32_t label_offset;  // edge label leading to this node, in `labels`
+        uint32_t label_length;
+        uint32_t child;    // first child, k_none if a leaf
+        uint32_t sibling;  // next sibling in label order, k_none if last
+        uint32_t items;    // first entry of this node's list in `links`, k_none if none
+    };
+
+    struct ItemLink {
+        uint32_t item;  // index into `items`
+        uint32_t next;  // next link of the same node, k_none if last
+    };
+
+    void insertKey(const char *key, size_t length, uint32_t item);
+    uint32_t findChild(uint32_t node, unsigned char first) const;
+    uint32_t addChild(uint32_t parent, const char *label, size_t length);
+    void splitNode(uint32_t node, uint32_t at);
+    void collect(uint32_t node, size_t limit, std::vector<const CompletionItem *> &found) const;
+
+    std::vector<Node> nodes;  // nodes[0] is the root
+    std::vector<ItemLink> links;
+    std::vector<CompletionItem> items;
+    std::string labels;
+    std::unordered_set<uint64_t> present;  // kind and id of every item
+};
+
+int forEachName(sqlite3 *db, const std::function<void(int kind, int id, const std::string &name)> &callback);
+int loadTrie(sqlite3 *db, Trie &trie);
+
+bool autocompleteFollows(sqlite3 *db);
+void addToAutocomplete(sqlite3 *db, const std::vector<CompletionItem> &added);
+void reloadAutocomplete(sqlite3 *db);
+
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) int autocompleteLoad(const char *db_path);
+
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) char *autocompleteQuery(const char *prefix, int limit);
@@ -0,0 +1,321 @@
+#include "walker.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <utility>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#endif
+
+/**
+ * @brief Checks a file name against the extensions asked for.
+ */
+static bool wantedFile(const char *name, size_t length, const WalkOptions &options) {
+    if (options.extensions.empty())
+        return true;
+    for (const std::string &extension : options.extensions) {
+        if (endsWithIgnoreCase(name, length, extension))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Tells whether the walk leaves out a file or directory by its name,
+ *        because it is hidden and skip_hidden is set.
+ */
+bool hiddenEntry(const char *name, const WalkOptions &options) {
+    return options.skip_hidden && name[0] == '.';
+}
+
+/**
+ * @brief Tells whether the walk leaves out a directory, given by its full
+ *        path, because it is in exclude_paths.
+ */
+bool excludedDirectory(const std::string &path, const WalkOptions &options) {
+    return std::find(options.exclude_paths.begin(), options.exclude_paths.end(), path) != options.exclude_paths.end();
+}
+
+#ifdef __linux__
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct DirectoryJob {
+    std::string path;
+    bool via_symlink;  // reached through a symbolic link, so it may close a cycle
+};
+
+/**
+ * @brief A directory walk shared by the walker threads.
+ *
+ * @details Each thread owns a deque of directories still to read. It takes
+ *          work from the back of its own deque, which keeps the walk depth
+ *          first and the deques short, and when it runs dry it steals from
+ *          the front of the others, where the largest subtrees are.
+ *          `outstanding` counts directories queued or being read; the walk
+ *          is over when it drops to zero. A thread that finds nothing to
+ *          steal sleeps on `work_available` until a directory is queued or
+ *          the walk is over.
+ */
+struct WalkState {
+    WalkState(const WalkOptions &options, const WalkCallback &callback, unsigned int threads)
+        : options(options), callback(callback), queues(threads), outstanding(0), queued(0), sleeping(0) {
+        for (auto &queue : queues)
+            queue.reset(new WorkQueue());
+    }
+
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<DirectoryJob> directories;
+    };
+
+    const WalkOptions &options;
+    const WalkCallback &callback;
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+    std::atomic<size_t> outstanding;
+    std::atomic<size_t> queued;    // directories in the deques, not yet taken
+    std::atomic<size_t> sleeping;  // threads waiting on work_available
+    std::mutex idle_mutex;
+    std::condition_variable work_available;
+    std::mutex callback_mutex;
+    std::mutex visited_mutex;
+    std::set<std::pair<dev_t, ino_t>> visited;  // directories entered through symbolic links
+};
+
+/**
+ * @brief Wakes sleeping threads, if there are any. Taking idle_mutex orders
+ *        the wake-up after a sleeper's check of its condition, so it cannot
+ *        be lost.
+ */
+static void wakeIdle(WalkState &state, bool all) {
+    if (state.sleeping == 0)
+        return;
+    { std::lock_guard<std::mutex> lock(state.idle_mutex); }
+    if (all)
+        state.work_available.notify_all();
+    else
+        state.work_available.notify_one();
+}
+
+static void pushDirectory(WalkState &state, unsigned int self, DirectoryJob job) {
+    state.outstanding++;
+    {
+        std::lock_guard<std::mutex> lock(state.queues[self]->mutex);
+        state.queued++;
+        state.queues[self]->directories.push_back(std::move(job));
+    }
+    wakeIdle(state, false);
+}
+
+static bool nextDirectory(WalkState &state, unsigned int self, DirectoryJob &job) {
+    {
+        std::lock_guard<std::mutex> lock(state.queues[self]->mutex);
+        auto &own = state.queues[self]->directories;
+        if (!own.empty()) {
+            job = std::move(own.back());
+            own.pop_back();
+            state.queued--;
+            return true;
+        }
+    }
+    for (size_t i = 1; i < state.queues.size(); i++) {
+        auto &victim = *state.queues[(self + i) % state.queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.directories.empty()) {
+            job = std::move(victim.directories.front());
+            victim.directories.pop_front();
+            state.queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Reads one directory with getdents64, queueing its subdirectories and
+ *        reporting its wanted files.
+ *
+ * @details The entry type comes from d_type, so regular files and
+ *          directories cost no stat call. Only symbolic links, entries on
+ *          file systems that do not fill in d_type, and reported files when
+ *          fingerprints are asked for are looked at with fstatat, relative to
+ *          the open directory.
+ */
+static void readDirectory(WalkState &state, unsigned int self, const DirectoryJob &job, std::vector<char> &buffer) {
+    if (state.options.cancel != NULL && *state.options.cancel)
+        return;
+    int fd = openat(AT_FDCWD, job.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        logError("Unable to open directory %s: %s\n", job.path.c_str(), strerror(errno));
+        return;
+    }
+    if (job.via_symlink) {
+        struct stat st;
+        bool seen = true;
+        if (fstat(fd, &st) == 0) {
+            std::lock_guard<std::mutex> lock(state.visited_mutex);
+            seen = !state.visited.insert({st.st_dev, st.st_ino}).second;
+        }
+        if (seen) {
+            close(fd);
+            return;
+        }
+    }
+
+    std::vector<std::pair<std::string, FileFingerprint>> found;
+    long length;
+    while ((length = syscall(SYS_getdents64, fd, buffer.data(), buffer.size())) > 0) {
+        for (long offset = 0; offset < length;) {
+            const struct linux_dirent64 *entry = (const struct linux_dirent64 *)(buffer.data() + offset);
+            offset += entry->d_reclen;
+
+            const char *name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+            if (hiddenEntry(name, state.options))
+                continue;
+
+            unsigned char type = entry->d_type;
+            bool via_symlink = type == DT_LNK;
+            struct stat st;
+            bool have_stat = false;
+            if (type == DT_LNK || type == DT_UNKNOWN) {
+                if (fstatat(fd, name, &st, 0) != 0)
+                    continue;  // dangling link or entry removed meanwhile
+                have_stat = true;
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+
+            if (type == DT_DIR) {
+                std::string path = joinPath(job.path, name);
+                if (!excludedDirectory(path, state.options))
+                    pushDirectory(state, self, {std::move(path), via_symlink || job.via_symlink});
+            } else if (type == DT_REG && wantedFile(name, strlen(name), state.options)) {
+                FileFingerprint fingerprint;
+                if (state.options.fingerprints) {
+                    if (!have_stat && fstatat(fd, name, &st, 0) != 0)
+                        continue;
+                    fingerprintFromStat(st, fingerprint);
+                }
+                found.emplace_back(joinPath(job.path, name), fingerprint);
+            }
+        }
+    }
+    if (length == -1)
+        logError("Error while reading directory %s: %s\n", job.path.c_str(), strerror(errno));
+    close(fd);
+
+    if (!found.empty()) {
+        std::lock_guard<std::mutex> lock(state.callback_mutex);
+        for (auto &file : found)
+            state.callback(file.first, state.options.fingerprints ? &file.second : NULL);
+    }
+}
+
+static void walkWorker(WalkState &state, unsigned int self) {
+    std::vector<char> buffer(64 * 1024);
+    DirectoryJob job;
+    while (true) {
+        if (nextDirectory(state, self, job)) {
+            readDirectory(state, self, job, buffer);
+            if (--state.outstanding == 0)
+                wakeIdle(state, true);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(state.idle_mutex);
+        state.sleeping++;
+        state.work_available.wait(lock, [&] { return state.queued > 0 || state.outstanding == 0; });
+        state.sleeping--;
+        if (state.outstanding == 0)
+            return;
+    }
+}
+
+#endif
+
+/**
+ * @brief Walks a directory tree and reports the files in it to a callback as
+ *        they are found.
+ *
+ * @details On Linux directories are read with getdents64, and with more than
+ *          one thread subtrees are read in parallel, with idle threads
+ *          stealing directories from busy ones. Elsewhere this falls back to
+ *          std::filesystem on the calling thread. Paths are reported in no
+ *          particular order. Symbolic links are followed, each linked
+ *          directory at most once. Setting *options.cancel makes the walk
+ *          stop early without reporting the rest of the tree.
+ *
+ * @param[in] root The directory to walk.
+ * @param[in] options Which files to report and how to walk.
+ * @param[in] callback Called once per reported file.
+ *
+ * @return 0 on success, -1 if root is not a directory.
+ */
+int walkDirectory(const std::string &root, const WalkOptions &options, const WalkCallback &callback) {
+    std::error_code error;
+    if (!std::filesystem::is_directory(std::filesystem::u8path(root), error))
+        return -1;
+
+#ifdef __linux__
+    unsigned int threads = std::max(1u, options.threads);
+    WalkState state(options, callback, threads);
+    pushDirectory(state, 0, {root, false});
+    if (threads == 1) {
+        walkWorker(state, 0);
+        return 0;
+    }
+    std::vector<std::thread> workers;
+    for (unsigned int i = 1; i < threads; i++)
+        workers.emplace_back(walkWorker, std::ref(state), i);
+    walkWorker(state, 0);
+    for (std::thread &worker : workers)
+        worker.join();
+#else
+    auto walk_options = std::filesystem::directory_options::follow_directory_symlink | std::filesystem::directory_options::skip_permission_denied;
+    std::filesystem::recursive_directory_iterator it(std::filesystem::u8path(root), walk_options, error), end;
+    for (; !error && it != end; it.increment(error)) {
+        if (options.cancel != NULL && *options.cancel)
+            break;
+        std::string name = it->path().filename().u8string();
+        std::error_code entry_error;
+        bool is_directory = it->is_directory(entry_error);
+        if (hiddenEntry(name.c_str(), options) || (is_directory && excludedDirectory(it->path().generic_u8string(), options))) {
+            if (is_directory)
+                it.disable_recursion_pending();
+            continue;
+        }
+        if (is_directory || !it->is_regular_file(entry_error) || !wantedFile(name.c_str(), name.size(), options))
+            continue;
+        std::string path = it->path().generic_u8string();
+        if (!options.fingerprints) {
+            callback(path, NULL);
+            continue;
+        }
+        FileFingerprint fingerprint;
+        if (getFileFingerprint(path, fingerprint) == 0)
+            callback(path, &fingerprint);
+    }
+#endif
+    return 0;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "misc.hpp"
+
+/**
+ * @brief What walkDirectory reports and how it walks.
+ */
+struct WalkOptions {
+    std::vector<std::string> extensions;     // lower case with the dot; empty reports every file
+    std::vector<std::string> exclude_paths;  // directories not to enter
+    bool skip_hidden = false;                // skip files and directories whose name starts with '.'
+    bool fingerprints = false;               // stat reported files and pass their fingerprint
+    unsigned int threads = 1;                // directories read in parallel
+    const std::atomic<bool> *cancel = NULL;  // stops the walk once it becomes true
+};
+
+/**
+ * @brief Receives each file found by walkDirectory. The fingerprint is NULL
+ *        unless WalkOptions::fingerprints is set. Calls are never concurrent,
+ *        but may come from any of the walker's threads.
+ */
+typedef std::function<void(const std::string &path, const FileFingerprint *fingerprint)> WalkCallback;
+
+int walkDirectory(const std::string &root, const WalkOptions &options, const WalkCallback &callback);
+bool hiddenEntry(const char *name, const WalkOptions &options);
+bool excludedDirectory(const std::string &path, const WalkOptions &options);
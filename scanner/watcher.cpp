@@ -0,0 +1,364 @@
+#include "watcher.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <mutex>
+#include <vector>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <climits>
+#endif
+
+#include "migrations.hpp"
+#include "misc.hpp"
+#include "scan_pipeline.hpp"
+#include "art_pack.hpp"
+#include "formats.hpp"
+#include "thumbnails.hpp"
+#include "name_indexes.hpp"
+
+static std::mutex watcher_mutex;
+static std::unique_ptr<LibraryWatcher> watcher;
+
+LibraryWatcher::LibraryWatcher(const ScanConfig &config)
+    : config(config), db(NULL), inotify_fd(-1), wake_fd(-1), stopping(false), rescan_needed(false) {
+    walk_options.exclude_paths = config.exclude_paths;
+    walk_options.skip_hidden = config.skip_hidden;
+}
+
+LibraryWatcher::~LibraryWatcher() {
+    stop();
+}
+
+#ifdef __linux__
+
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+/**
+ * @brief Opens the database, sets up the inotify watches and starts the
+ *        watcher thread.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int LibraryWatcher::start() {
+    if (sqlite3_open(config.database_location.c_str(), &db) != SQLITE_OK) {
+        logError("Watcher can't open database %s: %s\n", config.database_location.c_str(), sqlite3_errmsg(db));
+        sqlite3_close(db);
+        db = NULL;
+        return -1;
+    }
+    sqlite3_exec(db, "PRAGMA foreign_keys = 1;", NULL, NULL, NULL);
+    sqlite3_busy_timeout(db, 5000);
+    {
+        std::lock_guard<std::mutex> lock(library_write_mutex);
+        if (migrateDatabase(db) != 0) {
+            logError("Error while upgrading database %s.\n", config.database_location.c_str());
+            stop();
+            return -1;
+        }
+    }
+    ctx.reset(new ScanContext(db));
+
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (inotify_fd == -1 || wake_fd == -1) {
+        logError("Error while setting up inotify.\n");
+        stop();
+        return -1;
+    }
+
+    std::error_code error;
+    if (!std::filesystem::is_directory(std::filesystem::path(config.album_art_directory), error) &&
+        !std::filesystem::create_directory(std::filesystem::path(config.album_art_directory), error)) {
+        logError("Unable to create the album art directory %s: %s\n", config.album_art_directory.c_str(), error.message().c_str());
+        stop();
+        return -1;
+    }
+    for (const std::string &path : config.search_paths)
+        watchDirectory(path, false);
+
+    thread = std::thread(&LibraryWatcher::run, this);
+    return 0;
+}
+
+/**
+ * @brief Stops the watcher thread, applying the events already collected,
+ *        and releases everything start() set up.
+ */
+void LibraryWatcher::stop() {
+    if (thread.joinable()) {
+        stopping = true;
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) != sizeof(one))
+            logError("Unable to wake the watcher thread.\n");
+        thread.join();
+    }
+    if (inotify_fd != -1)
+        close(inotify_fd);
+    if (wake_fd != -1)
+        close(wake_fd);
+    inotify_fd = wake_fd = -1;
+    watched.clear();
+    ctx.reset();
+    sqlite3_close(db);
+    db = NULL;
+}
+
+void LibraryWatcher::run() {
+    while (!stopping) {
+        int timeout = -1;
+        if (rescan_needed || !pending_files.empty() || !removed_directories.empty()) {
+            auto now = std::chrono::steady_clock::now();
+            auto deadline = std::min(last_event + std::chrono::milliseconds(config.debounce_ms),
+                                     first_event + std::chrono::milliseconds(config.debounce_ms * 10));
+            if (now >= deadline) {
+                applyPending();
+                continue;
+            }
+            timeout = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count() + 1;
+        }
+
+        struct pollfd fds[2] = {{inotify_fd, POLLIN, 0}, {wake_fd, POLLIN, 0}};
+        if (poll(fds, 2, timeout) == -1 && errno != EINTR) {
+            logError("Error while waiting for inotify events.\n");
+            break;
+        }
+        if (fds[0].revents & POLLIN)
+            readEvents();
+    }
+    applyPending();
+}
+
+/**
+ * @brief Reads every queued inotify event and records what it touched.
+ */
+void LibraryWatcher::readEvents() {
+    alignas(struct inotify_event) char buffer[64 * (sizeof(struct inotify_event) + NAME_MAX + 1)];
+    ssize_t length;
+    while ((length = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+        auto now = std::chrono::steady_clock::now();
+        if (!rescan_needed && pending_files.empty() && removed_directories.empty())
+            first_event = now;
+        last_event = now;
+
+        for (char *p = buffer; p < buffer + length; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            if (event->mask & IN_Q_OVERFLOW) {
+                logWarning("inotify queue overflowed, rescanning the library.\n");
+                rescan_needed = true;
+                continue;
+            }
+            auto it = watched.find(event->wd);
+            if (it == watched.end())
+                continue;
+            if (event->mask & IN_IGNORED) {
+                watched.erase(it);
+                continue;
+            }
+            if (event->len == 0 || hiddenEntry(event->name, walk_options))
+                continue;
+
+            std::string path = joinPath(it->second, event->name);
+            if (event->mask & IN_ISDIR) {
+                if (excludedDirectory(path, walk_options))
+                    continue;
+                if (event->mask & (IN_CREATE | IN_MOVED_TO))
+                    watchDirectory(path, true);
+                else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    unwatchDirectory(path);
+                    removed_directories.insert(path);
+                }
+            } else if ((event->mask & (IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) && isMusicFile(path))
+                pending_files.insert(path);
+        }
+    }
+}
+
+/**
+ * @brief Watches a directory and all directories below it.
+ *
+ * @param[in] directory The directory to watch.
+ * @param[in] queue_files Whether to queue the music files already in it, for
+ *                        a directory that was just created or moved in.
+ */
+void LibraryWatcher::watchDirectory(const std::string &directory, bool queue_files) {
+    std::error_code error;
+    if (!std::filesystem::is_directory(std::filesystem::path(directory), error))
+        return;
+
+    int wd = inotify_add_watch(inotify_fd, directory.c_str(), WATCH_MASK);
+    if (wd == -1) {
+        logError("Unable to watch %s, changes to it will only be seen by update().\n", directory.c_str());
+        return;
+    }
+    watched[wd] = directory;
+
+    auto options = std::filesystem::directory_options::skip_permission_denied;
+    for (std::filesystem::directory_iterator it(directory, options, error), end; !error && it != end; it.increment(error)) {
+        if (hiddenEntry(it->path().filename().u8string().c_str(), walk_options))
+            continue;
+        std::string path = joinPath(directory, it->path().filename().u8string().c_str());
+        std::error_code entry_error;
+        if (it->is_directory(entry_error)) {
+            // Linked directories are left to update(), see LibraryWatcher.
+            if (!it->is_symlink(entry_error) && !excludedDirectory(path, walk_options))
+                watchDirectory(path, queue_files);
+        } else if (queue_files && isMusicFile(path))
+            pending_files.insert(path);
+    }
+}
+
+/**
+ * @brief Drops the watches of a directory that was moved away, and of all
+ *        directories below it, so that their events are not attributed to
+ *        the old paths.
+ */
+void LibraryWatcher::unwatchDirectory(const std::string &directory) {
+    std::string prefix = directory + "/";
+    for (auto it = watched.begin(); it != watched.end();) {
+        if (it->second == directory || it->second.compare(0, prefix.size(), prefix) == 0) {
+            inotify_rm_watch(inotify_fd, it->first);
+            it = watched.erase(it);
+        } else
+            it++;
+    }
+}
+
+#else
+
+int LibraryWatcher::start() {
+    logWarning("Watching the library is only supported on Linux.\n");
+    return -1;
+}
+
+void LibraryWatcher::stop() {}
+
+void LibraryWatcher::run() {}
+
+void LibraryWatcher::readEvents() {}
+
+void LibraryWatcher::watchDirectory(const std::string &directory, bool queue_files) {}
+
+void LibraryWatcher::unwatchDirectory(const std::string &directory) {}
+
+#endif
+
+/**
+ * @brief Reconciles the collected paths with the database.
+ *
+ * @details Each path is compared with its song, if any: a file that is gone
+ *          has its song deleted, a file that is new or whose fingerprint
+ *          changed is (re-)read. Songs below removed directories are checked
+ *          the same way. Albums, artists and genres left without songs are
+ *          deleted afterwards.
+ */
+void LibraryWatcher::applyPending() {
+    std::lock_guard<std::mutex> lock(library_write_mutex);
+
+    if (rescan_needed) {
+        updateLibrary(*ctx, config);
+        rescan_needed = false;
+        pending_files.clear();
+        removed_directories.clear();
+        return;
+    }
+
+    for (const std::string &directory : removed_directories) {
+        std::vector<std::string> locations;
+        getSongLocationsUnder(*ctx, directory, locations);
+        pending_files.insert(locations.begin(), locations.end());
+    }
+    removed_directories.clear();
+    if (pending_files.empty())
+        return;
+
+    std::vector<std::string> locations(pending_files.begin(), pending_files.end());
+    pending_files.clear();
+    std::sort(locations.begin(), locations.end());
+
+    std::vector<ScanJob> jobs;
+    std::vector<std::string> gone;
+    for (const std::string &location : locations) {
+        StoredSong song;
+        if (getSongByLocation(*ctx, location, song) != 0)
+            continue;
+        FileFingerprint fingerprint;
+        std::error_code error;
+        if (std::filesystem::is_regular_file(std::filesystem::path(location), error) && getFileFingerprint(location, fingerprint) == 0) {
+            if (song.id == 0 || !song.has_fingerprint || !song.has_audio_properties || song.fingerprint != fingerprint)
+                jobs.push_back({location, song.id, fingerprint});
+        } else if (song.id != 0)
+            gone.push_back(location);
+    }
+
+    ctx->track_completions = nameIndexesFollow(db);
+    setArtPacking(config.album_art_directory, config.pack_artwork);
+    ScanStats &stats = ctx->progress->stats;
+    stats.resetFormatCounters();
+    int failures = scanFiles(*ctx, jobs, config.album_art_directory, config.worker_threads, config.batch_size, config.read_options);
+    if (failures > 0)
+        logWarning("%d of %zu changed files could not be read.\n", failures, jobs.size());
+    logFormatCounters(stats.formatCounters());
+
+    beginTransaction(db);
+    for (const std::string &location : gone)
+        deleteSongByLocation(*ctx, location);
+    deleteUselessAlbums(db);
+    deleteUselessArtists(db);
+    deleteUselessGenres(db);
+    if (commitTransaction(db) != 0)
+        rollbackTransaction(db);
+    if (config.thumbnails)
+        generateThumbnails(db, config.album_art_directory, config.worker_threads, NULL);
+    deleteUselessAlbumArt(db, config.album_art_directory);
+    if (!gone.empty() || std::any_of(jobs.begin(), jobs.end(), [](const ScanJob &job) { return job.song_id != 0; }))
+        reloadNameIndexes(db);
+}
+
+/**
+ * @brief Starts watching the search paths for changes in the background.
+ *
+ * @details Takes the same input JSON as update(), plus an optional
+ *          "debounce_ms". The watcher only follows changes made after it
+ *          started, so the frontend should still call update() once first.
+ *
+ * @param[in] input The input JSON.
+ *
+ * @return 0 on success, -1 on failure or if a watcher is already running.
+ */
+int watchStart(const char *input) {
+    ScanConfig config;
+    if (parseInputJSON(input, config) != 0)
+        return -1;
+
+    std::lock_guard<std::mutex> lock(watcher_mutex);
+    if (watcher) {
+        logWarning("The library is already being watched.\n");
+        return -1;
+    }
+    std::unique_ptr<LibraryWatcher> started(new LibraryWatcher(config));
+    if (started->start() != 0)
+        return -1;
+    watcher = std::move(started);
+    return 0;
+}
+
+/**
+ * @brief Stops the watcher started by watchStart, after applying the changes
+ *        it has already seen.
+ *
+ * @return 0 on success, -1 if no watcher was running.
+ */
+int watchStop() {
+    std::lock_guard<std::mutex> lock(watcher_mutex);
+    if (!watcher)
+        return -1;
+    watcher.reset();
+    return 0;
+}
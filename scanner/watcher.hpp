@@ -0,0 +1,80 @@
+#pragma once
+
+#include <sqlite3.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "database_functions.hpp"
+#include "project_dbs_ffi.hpp"
+#include "walker.hpp"
+
+/**
+ * @brief Keeps the database in sync with the search paths while it runs,
+ *        using inotify.
+ *
+ * @details Every directory below the search paths is watched. Events are not
+ *          applied one by one: the paths they name are collected until no
+ *          event has arrived for debounce_ms milliseconds (or until a burst
+ *          has lasted ten times that long), and are then reconciled with the
+ *          database in one go. A path whose file is gone has its song deleted
+ *          with deleteSongByLocation, a new or changed file goes through
+ *          scanFiles and so through addSong or updateSong. If the kernel
+ *          reports that events were dropped, the whole library is rescanned
+ *          with updateLibrary.
+ *
+ *          Hidden and excluded directories are left out the way update()
+ *          leaves them out (see hiddenEntry and excludedDirectory), so the
+ *          two agree on which files belong to the library. Unlike update(),
+ *          the watcher does not follow symbolic links to directories: inotify
+ *          has one watch per directory, which cannot report events under
+ *          more than one path. Changes below a linked directory are only
+ *          picked up by the next update().
+ *
+ *          The watcher has its own database connection and thread, and holds
+ *          library_write_mutex while it writes, so it never races update().
+ *
+ *          Only Linux is supported; elsewhere start() fails.
+ */
+class LibraryWatcher {
+   public:
+    explicit LibraryWatcher(const ScanConfig &config);
+    ~LibraryWatcher();
+
+    LibraryWatcher(const LibraryWatcher &) = delete;
+    LibraryWatcher &operator=(const LibraryWatcher &) = delete;
+
+    int start();
+    void stop();
+
+   private:
+    void run();
+    void readEvents();
+    void watchDirectory(const std::string &directory, bool queue_files);
+    void unwatchDirectory(const std::string &directory);
+    void applyPending();
+
+    ScanConfig config;
+    WalkOptions walk_options;  // the filters of update()'s walk
+    sqlite3 *db;
+    std::unique_ptr<ScanContext> ctx;
+    int inotify_fd;
+    int wake_fd;  // written to by stop() to interrupt poll()
+    std::thread thread;
+    std::atomic<bool> stopping;
+
+    std::unordered_map<int, std::string> watched;        // watch descriptor -> directory
+    std::unordered_set<std::string> pending_files;        // files to reconcile with the database
+    std::unordered_set<std::string> removed_directories;  // directories whose songs must be checked
+    bool rescan_needed;
+    std::chrono::steady_clock::time_point first_event, last_event;
+};
+
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) int watchStart(const char *input);
+
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) int watchStop();